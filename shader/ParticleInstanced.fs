@@ -0,0 +1,12 @@
+#version 330
+
+in vec4 fragColor;
+in vec3 fragNormal;
+out vec4 finalColor;
+
+const vec3 lightDir = vec3(0.4, 0.8, 0.45);
+
+void main() {
+    float diffuse = max(dot(normalize(fragNormal), normalize(lightDir)), 0.0);
+    finalColor = vec4(fragColor.rgb * (0.35 + 0.65 * diffuse), fragColor.a);
+}
@@ -0,0 +1,25 @@
+#version 330
+
+// Instanced particle spheres: one draw call for all particles.
+// Per-instance attributes are (x, y, z, element index), filled by the CPU or
+// by the culling pass, see Draw.c.
+
+#define ELEMENT_COUNT 6
+
+layout(location = 0) in vec3 vertexPosition;
+layout(location = 2) in vec3 vertexNormal;
+layout(location = 6) in vec3 instancePosition;
+layout(location = 7) in float instanceKey;   // element index
+
+uniform mat4 mvp;                            // view-projection
+uniform vec4 elementColor[ELEMENT_COUNT];
+
+out vec4 fragColor;
+out vec3 fragNormal;
+
+void main() {
+    int element = int(instanceKey);
+    fragColor = (element >= 0 && element < ELEMENT_COUNT) ? elementColor[element] : vec4(1.0);
+    fragNormal = vertexNormal;
+    gl_Position = mvp * vec4(vertexPosition + instancePosition, 1.0);
+}
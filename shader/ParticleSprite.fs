@@ -0,0 +1,27 @@
+#version 330
+
+in vec4 fragColor;
+out vec4 finalColor;
+
+uniform int density;        // 1: additive density splats, 0: lit sphere impostors
+uniform float intensity;    // brightness of one density splat
+
+const vec3 lightDir = vec3(0.4, 0.8, 0.45);
+
+void main() {
+    vec2 p = gl_PointCoord * 2.0 - 1.0;
+    p.y = -p.y;
+    float r2 = dot(p, p);
+    if (r2 > 1.0) discard;
+
+    if (density != 0) {
+        float w = exp(-4.0 * r2) * intensity;
+        finalColor = vec4(fragColor.rgb * w, w);
+        return;
+    }
+
+    // Sphere impostor: reconstruct the normal of the visible hemisphere
+    vec3 normal = vec3(p, sqrt(1.0 - r2));
+    float diffuse = max(dot(normal, normalize(lightDir)), 0.0);
+    finalColor = vec4(fragColor.rgb * (0.35 + 0.65 * diffuse), fragColor.a);
+}
@@ -0,0 +1,25 @@
+#version 330
+
+// Far particles as point sprites; ParticleSprite.fs turns each one into a
+// sphere impostor (or a soft splat in density mode). Same per-instance data
+// as ParticleInstanced.vs, but one vertex per particle.
+
+#define ELEMENT_COUNT 6
+
+layout(location = 6) in vec3 instancePosition;
+layout(location = 7) in float instanceKey;   // element index
+
+uniform mat4 mvp;                            // view-projection
+uniform vec4 elementColor[ELEMENT_COUNT];
+uniform float pointScale;                    // pixels per world unit at distance 1
+uniform float radius;                        // particle radius in world units
+uniform float maxPointSize;
+
+out vec4 fragColor;
+
+void main() {
+    int element = int(instanceKey);
+    fragColor = (element >= 0 && element < ELEMENT_COUNT) ? elementColor[element] : vec4(1.0);
+    gl_Position = mvp * vec4(instancePosition, 1.0);
+    gl_PointSize = clamp(2.0 * radius * pointScale / max(gl_Position.w, 1e-3), 1.0, maxPointSize);
+}
@@ -0,0 +1,501 @@
+#include "BarnesHut.h"
+#include "SimdKernels.h"
+#include "JobSystem.h"
+#include <string.h>
+
+// Particle copy in tree order (leaves reference contiguous ranges)
+typedef struct BHBody {
+    float x, y, z, mass;
+    float vx, vy, vz;             // for the jerk (Hermite integrators)
+    int id; // slot in the ObjectList
+} BHBody;
+
+typedef struct BHNode {
+    float comX, comY, comZ, mass; // centre of mass and total mass
+    float comVX, comVY, comVZ;    // velocity of the centre of mass
+    float size2;                  // squared edge length of the cell
+    int next;                     // first node after this subtree (depth-first order)
+    int firstChild;               // -1 for leaves, otherwise the node right after this one
+    int start, count;             // range of the subtree's bodies in tree order
+} BHNode;
+
+// Interactions gathered per body before one call of the SIMD force kernel
+#define BH_LIST_SIZE 128
+
+typedef struct InteractionList {
+    float x[BH_LIST_SIZE], y[BH_LIST_SIZE], z[BH_LIST_SIZE], m[BH_LIST_SIZE];
+    int count;
+} InteractionList;
+
+// Buffers are kept between steps and only grow
+static BHBody* gBodies = NULL;
+static BHBody* gScratch = NULL;
+static float* gTreeX = NULL; // gBodies as structure of arrays, for the force kernel
+static float* gTreeY = NULL;
+static float* gTreeZ = NULL;
+static float* gTreeM = NULL;
+static float* gAccel = NULL;
+static int* gTreeIndex = NULL; // slot -> position in tree order
+static int gBodyCapacity = 0;
+static BHNode* gNodes = NULL;
+static int gNodeCount = 0;
+static int gNodeCapacity = 0;
+
+static int reserveBodies(int count) {
+    if (count <= gBodyCapacity) return 1;
+    int newCap = gBodyCapacity == 0 ? 1024 : gBodyCapacity;
+    while (newCap < count) newCap *= 2;
+    alignedFree(gBodies);
+    alignedFree(gScratch);
+    alignedFree(gAccel);
+    alignedFree(gTreeIndex);
+    alignedFree(gTreeX);
+    alignedFree(gTreeY);
+    alignedFree(gTreeZ);
+    alignedFree(gTreeM);
+    gBodies = alignedAlloc(sizeof(BHBody) * newCap);
+    gScratch = alignedAlloc(sizeof(BHBody) * newCap);
+    gAccel = alignedAlloc(sizeof(float) * 3 * newCap);
+    gTreeIndex = alignedAlloc(sizeof(int) * newCap);
+    gTreeX = alignedAlloc(sizeof(float) * newCap);
+    gTreeY = alignedAlloc(sizeof(float) * newCap);
+    gTreeZ = alignedAlloc(sizeof(float) * newCap);
+    gTreeM = alignedAlloc(sizeof(float) * newCap);
+    if (!gBodies || !gScratch || !gAccel || !gTreeIndex || !gTreeX || !gTreeY || !gTreeZ || !gTreeM) {
+        gBodyCapacity = 0;
+        return 0;
+    }
+    gBodyCapacity = newCap;
+    return 1;
+}
+
+static int allocNode(void) {
+    if (gNodeCount >= gNodeCapacity) {
+        int newCap = gNodeCapacity == 0 ? 4096 : gNodeCapacity * 2;
+        BHNode* nodes = realloc(gNodes, sizeof(BHNode) * newCap);
+        if (nodes == NULL) return -1;
+        gNodes = nodes;
+        gNodeCapacity = newCap;
+    }
+    return gNodeCount++;
+}
+
+// Recursively build the subtree for bodies [start, start+count) inside the cube
+// centred at (cx, cy, cz) with half edge length `half`. Nodes are laid out in
+// depth-first order so a subtree occupies [node, node.next).
+static int buildNode(int start, int count, float cx, float cy, float cz, float half, int depth) {
+    int nodeIdx = allocNode();
+    if (nodeIdx < 0) return -1;
+    float edge = 2.0f * half;
+    gNodes[nodeIdx].size2 = edge * edge;
+    gNodes[nodeIdx].start = start;
+    gNodes[nodeIdx].count = count;
+    gNodes[nodeIdx].firstChild = -1;
+
+    if (count <= BH_LEAF_SIZE || depth >= BH_MAX_DEPTH) {
+        float m = 0.0f, mx = 0.0f, my = 0.0f, mz = 0.0f, mvx = 0.0f, mvy = 0.0f, mvz = 0.0f;
+        for (int i = start; i < start + count; i++) {
+            const BHBody* b = &gBodies[i];
+            m += b->mass;
+            mx += b->mass * b->x;
+            my += b->mass * b->y;
+            mz += b->mass * b->z;
+            mvx += b->mass * b->vx;
+            mvy += b->mass * b->vy;
+            mvz += b->mass * b->vz;
+        }
+        float inv = m > 0.0f ? 1.0f / m : 0.0f;
+        gNodes[nodeIdx].mass = m;
+        gNodes[nodeIdx].comX = mx * inv;
+        gNodes[nodeIdx].comY = my * inv;
+        gNodes[nodeIdx].comZ = mz * inv;
+        gNodes[nodeIdx].comVX = mvx * inv;
+        gNodes[nodeIdx].comVY = mvy * inv;
+        gNodes[nodeIdx].comVZ = mvz * inv;
+        gNodes[nodeIdx].next = gNodeCount;
+        return nodeIdx;
+    }
+
+    // Counting sort of the range by octant
+    int octCount[8] = {0};
+    for (int i = start; i < start + count; i++) {
+        const BHBody* b = &gBodies[i];
+        int oct = (b->x >= cx) | ((b->y >= cy) << 1) | ((b->z >= cz) << 2);
+        octCount[oct]++;
+    }
+    int octStart[8];
+    int offset = start;
+    for (int o = 0; o < 8; o++) {
+        octStart[o] = offset;
+        offset += octCount[o];
+    }
+    int fill[8];
+    memcpy(fill, octStart, sizeof(fill));
+    for (int i = start; i < start + count; i++) {
+        const BHBody* b = &gBodies[i];
+        int oct = (b->x >= cx) | ((b->y >= cy) << 1) | ((b->z >= cz) << 2);
+        gScratch[fill[oct]++] = *b;
+    }
+    memcpy(&gBodies[start], &gScratch[start], sizeof(BHBody) * count);
+
+    gNodes[nodeIdx].firstChild = nodeIdx + 1;
+    float quarter = half * 0.5f;
+    float m = 0.0f, mx = 0.0f, my = 0.0f, mz = 0.0f, mvx = 0.0f, mvy = 0.0f, mvz = 0.0f;
+    for (int o = 0; o < 8; o++) {
+        if (octCount[o] == 0) continue;
+        float ox = cx + ((o & 1) ? quarter : -quarter);
+        float oy = cy + ((o & 2) ? quarter : -quarter);
+        float oz = cz + ((o & 4) ? quarter : -quarter);
+        int child = buildNode(octStart[o], octCount[o], ox, oy, oz, quarter, depth + 1);
+        if (child < 0) return -1;
+        const BHNode* c = &gNodes[child];
+        m += c->mass;
+        mx += c->mass * c->comX;
+        my += c->mass * c->comY;
+        mz += c->mass * c->comZ;
+        mvx += c->mass * c->comVX;
+        mvy += c->mass * c->comVY;
+        mvz += c->mass * c->comVZ;
+    }
+    float inv = m > 0.0f ? 1.0f / m : 0.0f;
+    gNodes[nodeIdx].mass = m;
+    gNodes[nodeIdx].comX = mx * inv;
+    gNodes[nodeIdx].comY = my * inv;
+    gNodes[nodeIdx].comZ = mz * inv;
+    gNodes[nodeIdx].comVX = mvx * inv;
+    gNodes[nodeIdx].comVY = mvy * inv;
+    gNodes[nodeIdx].comVZ = mvz * inv;
+    gNodes[nodeIdx].next = gNodeCount;
+    return nodeIdx;
+}
+
+static inline void flushInteractions(InteractionList* list, const BHBody* me, float* acc) {
+    gravityBlock(list->x, list->y, list->z, list->m, list->count, me->x, me->y, me->z, acc);
+    list->count = 0;
+}
+
+// Acceleration on body s (tree order) from a stackless walk over the tree.
+// Leaf bodies and accepted cells are queued and summed by the SIMD kernel;
+// body s itself sits at distance zero and adds nothing.
+static void accelerationOn(int s, float theta2, float G, float* out) {
+    const BHBody* me = &gBodies[s];
+    InteractionList list;
+    list.count = 0;
+    float acc[3] = { 0.0f, 0.0f, 0.0f };
+    int node = 0;
+    while (node < gNodeCount) {
+        const BHNode* n = &gNodes[node];
+        int containsMe = s >= n->start && s < n->start + n->count;
+        if (n->firstChild < 0) {
+            // Leaf: queue its bodies (contiguous in tree order)
+            if (list.count + n->count > BH_LIST_SIZE) flushInteractions(&list, me, acc);
+            if (n->count > BH_LIST_SIZE) {
+                gravityBlock(&gTreeX[n->start], &gTreeY[n->start], &gTreeZ[n->start], &gTreeM[n->start],
+                             n->count, me->x, me->y, me->z, acc);
+            } else {
+                for (int j = n->start; j < n->start + n->count; j++) {
+                    list.x[list.count] = gTreeX[j];
+                    list.y[list.count] = gTreeY[j];
+                    list.z[list.count] = gTreeZ[j];
+                    list.m[list.count] = gTreeM[j];
+                    list.count++;
+                }
+            }
+            node = n->next;
+            continue;
+        }
+        float dx = n->comX - me->x;
+        float dy = n->comY - me->y;
+        float dz = n->comZ - me->z;
+        float distSqr = dx*dx + dy*dy + dz*dz;
+        if (!containsMe && n->size2 < theta2 * distSqr) {
+            // Far enough away: use the cell's monopole
+            if (list.count == BH_LIST_SIZE) flushInteractions(&list, me, acc);
+            list.x[list.count] = n->comX;
+            list.y[list.count] = n->comY;
+            list.z[list.count] = n->comZ;
+            list.m[list.count] = n->mass;
+            list.count++;
+            node = n->next;
+        } else {
+            node = n->firstChild;
+        }
+    }
+    if (list.count > 0) flushInteractions(&list, me, acc);
+    out[0] = G * acc[0];
+    out[1] = G * acc[1];
+    out[2] = G * acc[2];
+}
+
+typedef struct ForcePass {
+    float theta2;
+    float G;
+} ForcePass;
+
+static void accelerationRange(void* data, int begin, int end) {
+    const ForcePass* pass = data;
+    for (int s = begin; s < end; s++) {
+        accelerationOn(s, pass->theta2, pass->G, &gAccel[3 * s]);
+    }
+}
+
+// Copy the particles into tree order and build the octree over them; 0 when out of memory
+static int buildTree(const ObjectList* oList) {
+    int n = oList->size;
+    if (!reserveBodies(n)) {
+        fprintf(stderr, "[ERROR] Could not allocate Barnes-Hut buffers.\n");
+        return 0;
+    }
+
+    // Copy bodies and find the bounding cube
+    float minX = oList->posX[0], maxX = minX;
+    float minY = oList->posY[0], maxY = minY;
+    float minZ = oList->posZ[0], maxZ = minZ;
+    for (int i = 0; i < n; i++) {
+        float x = oList->posX[i], y = oList->posY[i], z = oList->posZ[i];
+        gBodies[i].x = x;
+        gBodies[i].y = y;
+        gBodies[i].z = z;
+        gBodies[i].mass = oList->mass[i];
+        gBodies[i].vx = oList->velX[i];
+        gBodies[i].vy = oList->velY[i];
+        gBodies[i].vz = oList->velZ[i];
+        gBodies[i].id = i;
+        if (x < minX) minX = x;
+        if (y < minY) minY = y;
+        if (z < minZ) minZ = z;
+        if (x > maxX) maxX = x;
+        if (y > maxY) maxY = y;
+        if (z > maxZ) maxZ = z;
+    }
+    float half = 0.5f * fmaxf(maxX - minX, fmaxf(maxY - minY, maxZ - minZ));
+    half = half * 1.001f + 1e-3f;
+
+    gNodeCount = 0;
+    if (buildNode(0, n, 0.5f * (minX + maxX), 0.5f * (minY + maxY), 0.5f * (minZ + maxZ), half, 0) < 0) {
+        fprintf(stderr, "[ERROR] Could not allocate Barnes-Hut nodes.\n");
+        return 0;
+    }
+
+    for (int s = 0; s < n; s++) {
+        gTreeX[s] = gBodies[s].x;
+        gTreeY[s] = gBodies[s].y;
+        gTreeZ[s] = gBodies[s].z;
+        gTreeM[s] = gBodies[s].mass;
+        gTreeIndex[gBodies[s].id] = s;
+    }
+    return 1;
+}
+
+// Accelerations of all bodies into gAccel, in tree order
+static int evaluateTree(const ObjectList* oList, float theta, float G) {
+    if (!buildTree(oList)) return 0;
+    // Force evaluation in tree order: neighbouring bodies walk similar paths.
+    // simdLevel picks the kernels before the workers start using them.
+    simdLevel();
+    ForcePass pass = { theta * theta, G };
+    jobParallelFor(oList->size, 256, accelerationRange, &pass);
+    if (DEBUG_MODE) printf("[Barnes-Hut] %d bodies, %d nodes, theta=%.2f, %s\n", oList->size, gNodeCount, theta, simdLevelName(simdLevel()));
+    return 1;
+}
+
+void computeBarnesHutGravity(ObjectList* oList, float theta, float deltaTime, float G) {
+    int n = oList->size;
+    if (n == 0 || !evaluateTree(oList, theta, G)) return;
+    for (int s = 0; s < n; s++) {
+        int id = gBodies[s].id;
+        oList->velX[id] += gAccel[3 * s + 0] * deltaTime;
+        oList->velY[id] += gAccel[3 * s + 1] * deltaTime;
+        oList->velZ[id] += gAccel[3 * s + 2] * deltaTime;
+    }
+}
+
+int computeBarnesHutAccelerations(const ObjectList* oList, float theta, float G, float* acc) {
+    int n = oList->size;
+    if (n == 0) return 1;
+    if (!evaluateTree(oList, theta, G)) return 0;
+    for (int s = 0; s < n; s++) {
+        int id = gBodies[s].id;
+        acc[3 * id + 0] = gAccel[3 * s + 0];
+        acc[3 * id + 1] = gAccel[3 * s + 1];
+        acc[3 * id + 2] = gAccel[3 * s + 2];
+    }
+    return 1;
+}
+
+// Pull of a point mass m at offset d moving at relative velocity w, softened
+// as in gravityBlock, and its time derivative (without G)
+static inline void addPullAndJerk(float dx, float dy, float dz, float wx, float wy, float wz, float m,
+                                  float* acc, float* jerk) {
+    float distSqr = dx*dx + dy*dy + dz*dz;
+    if (distSqr < 1.0f) {
+        // Inside the softening core the pull grows linearly with the offset
+        acc[0] += m * dx; acc[1] += m * dy; acc[2] += m * dz;
+        jerk[0] += m * wx; jerk[1] += m * wy; jerk[2] += m * wz;
+        return;
+    }
+    float invDist = 1.0f / sqrtf(distSqr);
+    float f = m * invDist * invDist * invDist;
+    float rv = 3.0f * (dx*wx + dy*wy + dz*wz) / distSqr;
+    acc[0] += f * dx; acc[1] += f * dy; acc[2] += f * dz;
+    jerk[0] += f * (wx - rv * dx);
+    jerk[1] += f * (wy - rv * dy);
+    jerk[2] += f * (wz - rv * dz);
+}
+
+// Acceleration and jerk on body s (tree order); same walk as accelerationOn,
+// accepted cells move with their centre-of-mass velocity
+static void accelerationJerkOn(int s, float theta2, float G, float* outAcc, float* outJerk) {
+    const BHBody* me = &gBodies[s];
+    float acc[3] = { 0.0f, 0.0f, 0.0f };
+    float jerk[3] = { 0.0f, 0.0f, 0.0f };
+    int node = 0;
+    while (node < gNodeCount) {
+        const BHNode* n = &gNodes[node];
+        if (n->firstChild < 0) {
+            for (int j = n->start; j < n->start + n->count; j++) {
+                if (j == s) continue;
+                const BHBody* b = &gBodies[j];
+                addPullAndJerk(b->x - me->x, b->y - me->y, b->z - me->z,
+                               b->vx - me->vx, b->vy - me->vy, b->vz - me->vz, b->mass, acc, jerk);
+            }
+            node = n->next;
+            continue;
+        }
+        int containsMe = s >= n->start && s < n->start + n->count;
+        float dx = n->comX - me->x;
+        float dy = n->comY - me->y;
+        float dz = n->comZ - me->z;
+        float distSqr = dx*dx + dy*dy + dz*dz;
+        if (!containsMe && n->size2 < theta2 * distSqr) {
+            addPullAndJerk(dx, dy, dz, n->comVX - me->vx, n->comVY - me->vy, n->comVZ - me->vz, n->mass, acc, jerk);
+            node = n->next;
+        } else {
+            node = n->firstChild;
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        outAcc[k] = G * acc[k];
+        outJerk[k] = G * jerk[k];
+    }
+}
+
+typedef struct JerkPass {
+    const int* active;
+    float theta2;
+    float G;
+    float* acc;
+    float* jerk;
+} JerkPass;
+
+static void jerkRange(void* data, int begin, int end) {
+    const JerkPass* pass = data;
+    for (int k = begin; k < end; k++) {
+        // All bodies: walk in tree order; a subset: in the order given
+        int s = pass->active ? gTreeIndex[pass->active[k]] : k;
+        int id = gBodies[s].id;
+        accelerationJerkOn(s, pass->theta2, pass->G, &pass->acc[3 * id], &pass->jerk[3 * id]);
+    }
+}
+
+int computeBarnesHutJerk(const ObjectList* oList, const int* active, int activeCount, float theta, float G,
+                         float* acc, float* jerk) {
+    int n = oList->size;
+    if (n == 0) return 1;
+    if (!buildTree(oList)) return 0;
+    JerkPass pass = { active, theta * theta, G, acc, jerk };
+    jobParallelFor(active ? activeCount : n, 64, jerkRange, &pass);
+    return 1;
+}
+
+// Potential of a point mass m at squared distance distSqr (without G),
+// matching the softened pull of addPullAndJerk
+static inline float potentialOf(float distSqr, float m) {
+    if (distSqr < 1.0f) return -0.5f * m * (3.0f - distSqr);
+    return -m / sqrtf(distSqr);
+}
+
+// Potential at body s (tree order); same walk and opening test as accelerationOn
+static float potentialOn(int s, float theta2) {
+    const BHBody* me = &gBodies[s];
+    float phi = 0.0f;
+    int node = 0;
+    while (node < gNodeCount) {
+        const BHNode* n = &gNodes[node];
+        if (n->firstChild < 0) {
+            for (int j = n->start; j < n->start + n->count; j++) {
+                if (j == s) continue;
+                float dx = gTreeX[j] - me->x, dy = gTreeY[j] - me->y, dz = gTreeZ[j] - me->z;
+                phi += potentialOf(dx*dx + dy*dy + dz*dz, gTreeM[j]);
+            }
+            node = n->next;
+            continue;
+        }
+        int containsMe = s >= n->start && s < n->start + n->count;
+        float dx = n->comX - me->x;
+        float dy = n->comY - me->y;
+        float dz = n->comZ - me->z;
+        float distSqr = dx*dx + dy*dy + dz*dz;
+        if (!containsMe && n->size2 < theta2 * distSqr) {
+            phi += potentialOf(distSqr, n->mass);
+            node = n->next;
+        } else {
+            node = n->firstChild;
+        }
+    }
+    return phi;
+}
+
+// Fixed body slices, so the sum does not depend on the worker count
+#define BH_POTENTIAL_SLICES 64
+
+typedef struct PotentialPass {
+    float theta2;
+    int count;
+    double sums[BH_POTENTIAL_SLICES]; // sum of m * phi per slice
+} PotentialPass;
+
+static void potentialSlices(void* data, int begin, int end) {
+    PotentialPass* pass = data;
+    for (int t = begin; t < end; t++) {
+        int first = (int)((long)pass->count * t / BH_POTENTIAL_SLICES);
+        int last = (int)((long)pass->count * (t + 1) / BH_POTENTIAL_SLICES);
+        double sum = 0.0;
+        for (int s = first; s < last; s++) sum += (double)gTreeM[s] * potentialOn(s, pass->theta2);
+        pass->sums[t] = sum;
+    }
+}
+
+int computeBarnesHutPotential(const ObjectList* oList, float theta, float G, double* energy) {
+    *energy = 0.0;
+    int n = oList->size;
+    if (n == 0) return 1;
+    if (!buildTree(oList)) return 0;
+    PotentialPass pass;
+    pass.theta2 = theta * theta;
+    pass.count = n;
+    jobParallelFor(BH_POTENTIAL_SLICES, 1, potentialSlices, &pass);
+    double sum = 0.0;
+    for (int t = 0; t < BH_POTENTIAL_SLICES; t++) sum += pass.sums[t];
+    // Every pair is seen from both sides
+    *energy = 0.5 * (double)G * sum;
+    return 1;
+}
+
+void freeBarnesHut(void) {
+    alignedFree(gBodies);
+    alignedFree(gScratch);
+    alignedFree(gAccel);
+    alignedFree(gTreeIndex);
+    alignedFree(gTreeX);
+    alignedFree(gTreeY);
+    alignedFree(gTreeZ);
+    alignedFree(gTreeM);
+    free(gNodes);
+    gBodies = gScratch = NULL;
+    gTreeX = gTreeY = gTreeZ = gTreeM = NULL;
+    gAccel = NULL;
+    gTreeIndex = NULL;
+    gNodes = NULL;
+    gBodyCapacity = gNodeCapacity = gNodeCount = 0;
+}
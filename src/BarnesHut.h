@@ -0,0 +1,40 @@
+#ifndef BARNES_HUT_H
+#define BARNES_HUT_H
+
+#include "particle.h"
+
+// Opening angle: a cell of edge length s seen from distance d is treated as a
+// point mass when s / d < theta. 0 gives exact direct summation.
+#define BH_DEFAULT_THETA 0.5f
+
+// Maximum number of particles stored in one leaf before it is split
+#define BH_LEAF_SIZE 8
+
+// Maximum tree depth (protects against coincident particles)
+#define BH_MAX_DEPTH 32
+
+// Build an octree over the object list and apply one gravity kick of
+// length deltaTime to every particle's velocity. Positions are not changed.
+void computeBarnesHutGravity(ObjectList* objList, float theta, float deltaTime, float G);
+
+// The same accelerations written to acc (3 floats per slot) instead of
+// applied; 0 when the tree could not be allocated
+int computeBarnesHutAccelerations(const ObjectList* objList, float theta, float G, float* acc);
+
+// Acceleration and jerk (its time derivative, from the relative velocities;
+// accepted cells move with their centre of mass) for the Hermite integrators.
+// Only the slots in active[0, activeCount) are written, all of them when
+// active is NULL; the tree always covers every particle. Scalar walk, slower
+// per body than the SIMD acceleration-only path.
+int computeBarnesHutJerk(const ObjectList* objList, const int* active, int activeCount, float theta, float G,
+                         float* acc, float* jerk);
+
+// Total potential energy 0.5 * G * sum m_i phi_i over the same tree walk, with
+// the softened potential that belongs to the softened pull. Summed in double
+// over fixed slices, so repeated calls agree whatever the thread count.
+int computeBarnesHutPotential(const ObjectList* objList, float theta, float G, double* energy);
+
+// Release the tree buffers kept between calls
+void freeBarnesHut(void);
+
+#endif
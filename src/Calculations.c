@@ -1,168 +1,355 @@
 #include "Calculations.h"
-
-#define HASH_SIZE 10007
+#include "BarnesHut.h"
+#include "ParticleMesh.h"
+#include "GPUState.h"
+#include "Integrator.h"
+#include "JobSystem.h"
+#include "Profiler.h"
 
 
 const float G = 6.67430e-11f; // Universal gravitational constant
 
 static int gUseGPU = 1;         // default: try GPU
 static int gCullingEnabled = 1; // default: culling on
+static int gUseParticleMesh = 0; // CPU Particle-Mesh solver instead of the tree codes
+static int gGPUResident = 0;    // keep the particle state on the GPU between ticks
+static int gStateOnGPU = 0;     // the GPU copy is newer than the ObjectList
+static float gTheta = BH_DEFAULT_THETA; // opening angle of the CPU octree and the GPU cell tree
+static int gNearNeighbours = 1; // GPU near field: 3x3x3 neighbourhood (1) or own cell only (0)
+static Grid* gGrid = NULL;      // persistent gravity grid, updated every tick
+static int gGridCurrent = 0;    // the last tick filed the particles into gGrid
+static float gGridDrift = 0.0f; // farthest any particle moved since gGrid was updated
+static CollisionMode gCollisionMode = COLLISION_MERGE;
+static Integrator gIntegrator = INTEGRATOR_LEAPFROG; // CPU solvers; the GPU shaders kick then drift
+static float gContactRadius = 0.0f; // particle radius of the last CalculateCollision, for the GPU search
+static GridContacts gContacts;      // contacts found by the last GPU gravity step
+static GPUObject* gStaging = NULL;  // GPU grid path: packed particles, only grows
+static int gStagingCapacity = 0;
+static JobGraph* gTickGraph = NULL; // GPU grid path: grid update next to the packing, reset every tick
+static int gDiagnosticsInterval = 0; // ticks between diagnostics, 0 = off
+static double gReferenceEnergy = 0.0; // energy the drift is measured against
+static int gReferenceParticles = -1;  // ... and what it was measured on
+static const char* gReferenceSource = NULL;
+static float gReferenceTheta = 0.0f;
 
 void SetUseGPU(int enabled) { gUseGPU = enabled ? 1 : 0; }
 int IsUseGPU(void) { return gUseGPU; }
+void SetUseParticleMesh(int enabled) { gUseParticleMesh = enabled ? 1 : 0; }
+int IsUseParticleMesh(void) { return gUseParticleMesh; }
+void SetGPUResident(int enabled) { gGPUResident = enabled ? 1 : 0; }
+int IsGPUResident(void) { return gGPUResident; }
+int IsStateOnGPU(void) { return gStateOnGPU; }
+
+// Bring the ObjectList up to date with the resident GPU state (no-op otherwise)
+void SyncGravitationToCPU(ObjectList* oList) {
+    if (!gStateOnGPU) return;
+    if (!gpuStateDownload(oList) && DEBUG_MODE) printf("[SyncGravitationToCPU] Readback failed.\n");
+}
+
+// Hand the state back to the CPU for good
+static void LeaveResidentState(ObjectList* oList) {
+    if (!gStateOnGPU) return;
+    SyncGravitationToCPU(oList);
+    gStateOnGPU = 0;
+}
+
+// GPU-resident step: only particles appended since the last tick (spawned via
+// handleInput) are uploaded. The result is read back asynchronously and lands
+// in the ObjectList about one tick later.
+static int StepResidentState(ObjectList* oList, float deltaTime) {
+    int onGPU = gpuStateCount();
+    if (!gStateOnGPU || oList->size < onGPU) {
+        if (!gpuStateUpload(oList, 0)) return 0;
+    } else if (oList->size > onGPU) {
+        if (!gpuStateUpload(oList, onGPU)) return 0;
+    }
+    // Last tick's snapshot, if its copy has landed; never waits
+    if (gStateOnGPU) gpuStatePoll(oList);
+    gStateOnGPU = 1;
+    if (!gpuStateStep(deltaTime, G)) {
+        LeaveResidentState(oList);
+        return 0;
+    }
+    gpuStateRequestReadback();
+    return 1;
+}
+const Grid* GetSpatialGrid(const ObjectList* oList, float* drift) {
+    if (!gGridCurrent || !gGrid || gGrid->nodeCount == 0) return NULL;
+    if (oList->size < gGrid->objectCount) return NULL; // slots were removed
+    if (drift) *drift = gGridDrift;
+    return gGrid;
+}
+
 void SetCullingEnabled(int enabled) { gCullingEnabled = enabled ? 1 : 0; }
 int IsCullingEnabled(void) { return gCullingEnabled; }
+void SetTheta(float theta) { gTheta = theta < 0.0f ? 0.0f : theta; }
+float GetTheta(void) { return gTheta; }
+void SetNearFieldNeighbours(int enabled) { gNearNeighbours = enabled ? 1 : 0; }
+int IsNearFieldNeighbours(void) { return gNearNeighbours; }
+void SetCollisionMode(CollisionMode mode) { gCollisionMode = mode; }
+CollisionMode GetCollisionMode(void) { return gCollisionMode; }
+void SetIntegrator(Integrator integrator) { gIntegrator = integrator; }
+Integrator GetIntegrator(void) { return gIntegrator; }
+void SetDiagnosticsInterval(int ticks) { gDiagnosticsInterval = ticks > 0 ? ticks : 0; }
+int GetDiagnosticsInterval(void) { return gDiagnosticsInterval; }
+
+int MeasureDiagnostics(ObjectList* oList, Diagnostics* out) {
+    ProfileZone zone = profileBegin("diagnostics");
+    double start = jobTime();
+    int ok;
+    if (gStateOnGPU) {
+        // The CPU copy trails the GPU: reduce the resident state itself
+        ok = gpuStateDiagnostics(G, out);
+        out->potentialSource = "gpu";
+    } else {
+        diagnosticsReduce(oList, out);
+        if (gUseParticleMesh) {
+            ok = computeParticleMeshPotential(oList, PM_DEFAULT_MESH_SIZE, G, &out->potential);
+            out->potentialSource = "mesh";
+        } else {
+            // The CPU octree, or the GPU cell tree at the same opening angle
+            ok = computeBarnesHutPotential(oList, gTheta, G, &out->potential);
+            out->potentialSource = "tree";
+        }
+    }
+    if (ok) {
+        out->energy = out->kinetic + out->potential;
+        // Spawns, merges or a different potential start a new reference
+        if (out->particles != gReferenceParticles || out->potentialSource != gReferenceSource ||
+            gTheta != gReferenceTheta || gReferenceEnergy == 0.0) {
+            gReferenceEnergy = out->energy;
+            gReferenceParticles = out->particles;
+            gReferenceSource = out->potentialSource;
+            gReferenceTheta = gTheta;
+        }
+        // A zero reference (e.g. a single particle at rest) has no relative error
+        out->energyError = fabs(gReferenceEnergy) > 0.0 ? (out->energy - gReferenceEnergy) / fabs(gReferenceEnergy) : 0.0;
+    }
+    out->ms = (jobTime() - start) * 1000.0;
+    profileEnd(zone);
+    return ok;
+}
+
+void ResetDiagnosticsReference(void) {
+    gReferenceParticles = -1;
+}
+
+// CPU step: the chosen integrator over the Barnes-Hut octree (current
+// opening angle) or the PM mesh
+static void StepOnCPU(ObjectList* oList, float deltaTime) {
+    ForceSolver solver = { gUseParticleMesh, PM_DEFAULT_MESH_SIZE, gTheta, G };
+    integrateStep(oList, gIntegrator, &solver, deltaTime);
+}
+
+// Smallest number of particles worth a job of their own
+#define PARTICLE_JOB_GRAIN 4096
+
+// Particle loops of one tick, run in chunks on the job system
+typedef struct TickPass {
+    ObjectList* oList;
+    GPUObject* gpuObjs;
+    float deltaTime;
+    int slices;            // copy-back: fixed slices, one drift result each
+    float* sliceDrift2;
+} TickPass;
+
+static void packRange(void* data, int begin, int end) {
+    const TickPass* pass = data;
+    const ObjectList* oList = pass->oList;
+    GPUObject* gpuObjs = pass->gpuObjs;
+    for (int i = begin; i < end; i++) {
+        gpuObjs[i].position[0] = oList->posX[i];
+        gpuObjs[i].position[1] = oList->posY[i];
+        gpuObjs[i].position[2] = oList->posZ[i];
+        gpuObjs[i].velocity[0] = oList->velX[i];
+        gpuObjs[i].velocity[1] = oList->velY[i];
+        gpuObjs[i].velocity[2] = oList->velZ[i];
+        gpuObjs[i].mass = oList->mass[i];
+        gpuObjs[i].element = (float)elementIndex(oList->element[i]);
+    }
+}
+
+static void packObjectsJob(void* data) {
+    TickPass* pass = data;
+    ProfileZone zone = profileBegin("pack");
+    jobParallelFor(pass->oList->size, PARTICLE_JOB_GRAIN, packRange, pass);
+    profileEnd(zone);
+}
+
+// Copy the GPU results back, tracking how far the particles moved
+static void unpackSlices(void* data, int begin, int end) {
+    const TickPass* pass = data;
+    ObjectList* oList = pass->oList;
+    const GPUObject* gpuObjs = pass->gpuObjs;
+    int n = oList->size;
+    for (int t = begin; t < end; t++) {
+        int first = (int)((long)n * t / pass->slices);
+        int last = (int)((long)n * (t + 1) / pass->slices);
+        float drift2 = 0.0f;
+        for (int i = first; i < last; i++) {
+            float dx = gpuObjs[i].position[0] - oList->posX[i];
+            float dy = gpuObjs[i].position[1] - oList->posY[i];
+            float dz = gpuObjs[i].position[2] - oList->posZ[i];
+            float d2 = dx*dx + dy*dy + dz*dz;
+            if (d2 > drift2) drift2 = d2;
+            oList->posX[i] = gpuObjs[i].position[0];
+            oList->posY[i] = gpuObjs[i].position[1];
+            oList->posZ[i] = gpuObjs[i].position[2];
+            oList->velX[i] = gpuObjs[i].velocity[0];
+            oList->velY[i] = gpuObjs[i].velocity[1];
+            oList->velZ[i] = gpuObjs[i].velocity[2];
+        }
+        pass->sliceDrift2[t] = drift2;
+    }
+}
+
+// Bring the persistent grid up to date (runs next to the packing)
+static void updateGridJob(void* data) {
+    ObjectList* oList = ((TickPass*)data)->oList;
+    ProfileZone zone = profileBegin("grid.update");
+    float cellSize = 20.f;
+    if (gGrid == NULL) {
+        gGrid = getGrid(oList, cellSize);
+    } else {
+        updateGrid(gGrid, oList);
+    }
+    if (gGrid && gGrid->buildNeighbours != gNearNeighbours) {
+        // Toggled (or first tick): the next update rebuilds or drops the neighbour lists
+        gGrid->buildNeighbours = gNearNeighbours;
+        gGrid->neighbourCount = 0;
+        updateGrid(gGrid, oList);
+    }
+    profileEnd(zone);
+}
+
+// Room for `count` packed particles in gStaging, grown geometrically
+static GPUObject* reserveStaging(int count) {
+    if (count <= gStagingCapacity) return gStaging;
+    int newCap = gStagingCapacity > 0 ? gStagingCapacity : 1024;
+    while (newCap < count) newCap *= 2;
+    GPUObject* staging = realloc(gStaging, sizeof(GPUObject) * (size_t)newCap);
+    if (!staging) return NULL;
+    gStaging = staging;
+    gStagingCapacity = newCap;
+    return staging;
+}
 
 // Use the compute shader to calculate gravity for all objects
 void ComputeGravitationWithShader(ObjectList* oList, float deltaTime) {
+    gGridCurrent = 0;
+    gContacts.complete = 0;
     if (oList->size == 0) return;
-    if (!gUseGPU) {
-        CalculateGravitation(oList);
-        MoveParticles(oList, deltaTime);
+    if (gGPUResident && gUseGPU && !gUseParticleMesh) {
+        ProfileZone zone = profileBegin("gravity.resident");
+        int stepped = StepResidentState(oList, deltaTime);
+        profileEnd(zone);
+        if (stepped) {
+            invalidateIntegrator();
+            return;
+        }
+        if (DEBUG_MODE) printf("[ComputeGravitationWithShader] Resident step failed, using the streaming path.\n");
+        gGPUResident = 0;
+    }
+    LeaveResidentState(oList);
+    if (gUseParticleMesh || !gUseGPU) {
+        StepOnCPU(oList, deltaTime);
         return;
     }
     // --- New grid-based GPU path ---
-    float cellSize = 20.f;
-    Grid* grid = getGrid(oList, cellSize);
+    int numObjects = oList->size;
+    GPUObject* gpuObjs = reserveStaging(numObjects);
+    if (!gpuObjs) {
+        StepOnCPU(oList, deltaTime);
+        return;
+    }
+    // Grid update and GPUObject packing only read the particles: run them side by side
+    float sliceDrift2[256];
+    int slices = jobWorkerCount() * 4;
+    if (slices > 256) slices = 256;
+    TickPass pass = { oList, gpuObjs, deltaTime, slices, sliceDrift2 };
+    if (!gTickGraph) gTickGraph = jobGraphCreate();
+    int ran = 0;
+    if (gTickGraph) {
+        jobGraphReset(gTickGraph);
+        jobGraphAdd(gTickGraph, updateGridJob, &pass);
+        jobGraphAdd(gTickGraph, packObjectsJob, &pass);
+        ran = jobGraphRun(gTickGraph); // refused if an add failed
+    }
+    if (!ran) {
+        updateGridJob(&pass);
+        packObjectsJob(&pass);
+    }
+    Grid* grid = gGrid;
     if (!grid) {
-        CalculateGravitation(oList);
-        MoveParticles(oList, deltaTime);
+        StepOnCPU(oList, deltaTime);
         return;
     }
-    int numObjects = oList->size;
-    int numCells = (int)(grid->gridSize.x * grid->gridSize.y * grid->gridSize.z);
-    // Prepare GPUObject array
-    GPUObject* gpuObjs = malloc(sizeof(GPUObject) * numObjects);
-    for (int i = 0; i < numObjects; i++) {
-        GravitationalObject* obj = oList->gObjs[i];
-        gpuObjs[i].position[0] = obj->position.x;
-        gpuObjs[i].position[1] = obj->position.y;
-        gpuObjs[i].position[2] = obj->position.z;
-        gpuObjs[i].velocity[0] = obj->velocity.x;
-        gpuObjs[i].velocity[1] = obj->velocity.y;
-        gpuObjs[i].velocity[2] = obj->velocity.z;
-        gpuObjs[i].mass = (float)obj->element;
-    }
-    // Prepare GPUGridCell and object index arrays
-    extern void flattenGridForGPU(const Grid* grid, GPUGridCell** outCells, int* outCellCount, unsigned int** outObjIndices, int* outObjIndexCount, ObjectList* objList);
-    GPUGridCell* gpuCells = NULL;
-    unsigned int* objIndices = NULL;
-    int objIndexCount = 0, cellCount = 0;
-    flattenGridForGPU(grid, &gpuCells, &cellCount, &objIndices, &objIndexCount, oList);
-    // Call the new computeGravity
-    int ok = computeGravity(
-        gpuObjs, numObjects,
-        gpuCells, cellCount,
-        objIndices, objIndexCount,
-        grid->gridSize, cellSize, deltaTime, G
-    );
+    // The grid already holds its cells and the cell-sorted indices in GPU layout
+    // The near-field pass finds the contacts on the way (and bounces them);
+    // CalculateCollision then skips its own search
+    GridContacts* contacts = NULL;
+    if (gCollisionMode != COLLISION_OFF && gContactRadius > 0.0f) {
+        gContacts.radius = gContactRadius;
+        gContacts.elastic = gCollisionMode == COLLISION_ELASTIC;
+        contacts = &gContacts;
+    }
+    int ok = computeGridGravity(gpuObjs, numObjects, grid, gTheta, gNearNeighbours, deltaTime, G, contacts);
     if (!ok) {
+        gContacts.complete = 0;
         if (DEBUG_MODE) printf("[ComputeGravitationWithShader] Falling back to CPU path.\n");
-        CalculateGravitation(oList);
-        MoveParticles(oList, deltaTime);
-        free(gpuObjs);
-        free(gpuCells);
-        free(objIndices);
-        freeGrid(grid);
+        StepOnCPU(oList, deltaTime);
         return;
     }
-    // Copy results back to GravitationalObject
-    for (int i = 0; i < numObjects; i++) {
-        GravitationalObject* obj = oList->gObjs[i];
-        obj->position.x = gpuObjs[i].position[0];
-        obj->position.y = gpuObjs[i].position[1];
-        obj->position.z = gpuObjs[i].position[2];
-        obj->velocity.x = gpuObjs[i].velocity[0];
-        obj->velocity.y = gpuObjs[i].velocity[1];
-        obj->velocity.z = gpuObjs[i].velocity[2];
-    }
-    free(gpuObjs);
-    free(gpuCells);
-    free(objIndices);
-    freeGrid(grid);
-}
-
-// Linked list entry for spatial hash grid
-typedef struct CellEntry {
-    GravitationalObject* obj;
-    struct CellEntry* next;
-} CellEntry;
-
-// Spatial hash grid for efficient neighbor search
-typedef struct {
-    CellEntry* table[HASH_SIZE];
-} SpatialHash;
-
-// Hash function for 3D cell coordinates
-unsigned int hashCell(int x, int y, int z) {
-    unsigned int h = 73856093u * x ^ 19349663u * y ^ 83492791u * z;
-    return h % HASH_SIZE;
+    // Copy results back into the particle store
+    ProfileZone unpack = profileBegin("unpack");
+    jobParallelFor(slices, 1, unpackSlices, &pass);
+    profileEnd(unpack);
+    float drift2 = 0.0f;
+    for (int t = 0; t < slices; t++) {
+        if (sliceDrift2[t] > drift2) drift2 = sliceDrift2[t];
+    }
+    // Moved by the shader: the CPU integrator starts over
+    invalidateIntegrator();
+    gGridDrift = sqrtf(drift2);
+    gGridCurrent = grid->objectCount == numObjects;
 }
 
-// Insert an object into the spatial hash grid
-void insertObject(SpatialHash* grid, GravitationalObject* obj, float cellSize) {
-    int cx = (int)floor(obj->position.x / cellSize);
-    int cy = (int)floor(obj->position.y / cellSize);
-    int cz = (int)floor(obj->position.z / cellSize);
-    unsigned int h = hashCell(cx, cy, cz);
-    CellEntry* entry = malloc(sizeof(CellEntry));
-    entry->obj = obj;
-    entry->next = grid->table[h];
-    grid->table[h] = entry;
+// Release the persistent grid and solver buffers
+void ShutdownGravitation(void) {
+    gpuStateRelease();
+    gStateOnGPU = 0;
+    freeGrid(gGrid);
+    gGrid = NULL;
+    gGridCurrent = 0;
+    free(gStaging);
+    gStaging = NULL;
+    gStagingCapacity = 0;
+    jobGraphFree(gTickGraph);
+    gTickGraph = NULL;
+    freeBarnesHut();
+    freeParticleMesh();
+    freeCollisions();
+    freeIntegrator();
 }
 
-// Free all memory used by the spatial hash grid
-void freeSpatialHash(SpatialHash* grid) {
-    for (int h = 0; h < HASH_SIZE; h++) {
-        CellEntry* entry = grid->table[h];
-        while (entry) {
-            CellEntry* next = entry->next;
-            free(entry);
-            entry = next;
-        }
-        grid->table[h] = NULL;
-    }
-}
-
-// Detect and handle collisions between objects using spatial hashing
+// Detect and resolve collisions between touching particles
 void CalculateCollision(ObjectList* list, int particleRadius) {
-    SpatialHash grid = {0};
-    float cellSize = 2.f;
-    // Insert all objects into the grid
-    for (int i = 0; i < list->size; i++) {
-        insertObject(&grid, list->gObjs[i], cellSize);
-    }
-    // Check for collisions in each cell and neighbors
-    for (int h = 0; h < HASH_SIZE; h++) {
-        CellEntry* entry = grid.table[h];
-        while (entry) {
-            GravitationalObject* a = entry->obj;
-            for (int dx = -1; dx <= 1; dx++) {
-                for (int dy = -1; dy <= 1; dy++) {
-                    for (int dz = -1; dz <= 1; dz++) {
-                        unsigned int nh = hashCell(
-                            (int)floor(a->position.x / cellSize) + dx,
-                            (int)floor(a->position.y / cellSize) + dy,
-                            (int)floor(a->position.z / cellSize) + dz
-                        );
-                        CellEntry* neighbor = grid.table[nh];
-                        while (neighbor) {
-                            GravitationalObject* b = neighbor->obj;
-                            if (a == b) { neighbor = neighbor->next; continue; }
-                            float dx = a->position.x - b->position.x;
-                            float dy = a->position.y - b->position.y;
-                            float dz = a->position.z - b->position.z;
-                            float distSq = dx*dx + dy*dy + dz*dz;
-                            if (distSq <= particleRadius*particleRadius) {
-                                // Collision response can be implemented here
-                            }
-                            neighbor = neighbor->next;
-                        }
-                    }
-                }
-            }
-            entry = entry->next;
+    // The CPU copy is stale while the GPU owns the state
+    if (gStateOnGPU) return;
+    gContactRadius = (float)particleRadius;
+    ProfileZone zone = profileBegin("collision");
+    int size = list->size;
+    if (gContacts.complete) {
+        // Found by this tick's GPU gravity step; elastic pairs already bounced there
+        gContacts.complete = 0;
+        if (gCollisionMode == COLLISION_MERGE) {
+            resolveCollisionPairs(list, gContacts.pairs, gContacts.count, gContactRadius, gCollisionMode);
         }
+    } else {
+        resolveCollisions(list, gContactRadius, gCollisionMode);
     }
-    freeSpatialHash(&grid);
-}
\ No newline at end of file
+    // Merged particles left their slots: the grid no longer matches them.
+    // Stored accelerations are dropped by the list's new generation.
+    if (list->size != size) gGridCurrent = 0;
+    profileEnd(zone);
+}
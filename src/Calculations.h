@@ -2,17 +2,60 @@
 #define CALCULATIONS_H
 
 #include "particle.h"
+#include "Collision.h"
+#include "Integrator.h"
+#include "Diagnostics.h"
 
 // Gravity & Movement
 void ComputeGravitationWithShader(ObjectList* objList, float deltaTime);
+void ShutdownGravitation(void);
 
-// Collision
+// GPU-resident state: while IsStateOnGPU() the ObjectList trails the GPU by
+// about one tick (asynchronous readback) and is exact after
+// SyncGravitationToCPU; appending particles is fine at any time. Collisions
+// are skipped meanwhile.
+void SyncGravitationToCPU(ObjectList* objList);
+int  IsStateOnGPU(void);
+
+// Gravity grid whose cells still describe the current ObjectList slots, for
+// spatial queries such as culling; NULL when the last tick did not build it.
+// Particles may have left their cells by up to *drift since; slots from
+// grid->objectCount on were appended later and are in no cell.
+const Grid* GetSpatialGrid(const ObjectList* objList, float* drift);
+
+// Collision: resolves touching pairs with the current mode (see Collision.h).
+// Merging removes particles, so slots change. Call it after every gravity
+// step: when the GPU grid step with the 3x3x3 near field already found the
+// contacts (from the second call on, which supplies the radius), only those
+// are resolved, elastic ones were bounced on the GPU.
 void CalculateCollision(ObjectList* list, int particleRadius);
+void SetCollisionMode(CollisionMode mode);
+CollisionMode GetCollisionMode(void);
 
 // Runtime toggles
 void SetUseGPU(int enabled);
 int  IsUseGPU(void);
+void SetUseParticleMesh(int enabled); // Particle-Mesh (FFT) solver, takes precedence over the GPU toggle
+int  IsUseParticleMesh(void);
+void SetGPUResident(int enabled);     // GPU mode keeps the particles on the GPU between ticks
+int  IsGPUResident(void);
 void SetCullingEnabled(int enabled);
 int  IsCullingEnabled(void);
+void  SetTheta(float theta); // Opening angle of both tree solvers, 0 = exact
+float GetTheta(void);
+void SetNearFieldNeighbours(int enabled); // GPU near field over the 3x3x3 cell neighbourhood
+int  IsNearFieldNeighbours(void);
+void SetIntegrator(Integrator integrator); // CPU solvers only (see Integrator.h), default leapfrog
+Integrator GetIntegrator(void);
+
+// Conservation diagnostics (see Diagnostics.h). The potential comes from the
+// active solver: the resident GPU state is reduced on the GPU (direct sum),
+// the PM solver uses its mesh, everything else the Barnes-Hut octree at the
+// current opening angle. energyError is relative to the first measurement
+// since the particle count or the potential changed. Returns 0 on failure.
+int  MeasureDiagnostics(ObjectList* objList, Diagnostics* out);
+void ResetDiagnosticsReference(void);  // next measurement becomes the reference
+void SetDiagnosticsInterval(int ticks); // measure every `ticks` ticks, 0 = off
+int  GetDiagnosticsInterval(void);
 
 #endif
\ No newline at end of file
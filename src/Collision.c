@@ -0,0 +1,422 @@
+#include "Collision.h"
+#include "JobSystem.h"
+#include <string.h>
+
+// Smallest number of particles (or cells) worth a job of their own
+#define COLLISION_JOB_GRAIN 4096
+
+// Fixed output slices of the pair search: each writes its own pair list, so
+// the result does not depend on the thread timing
+#define COLLISION_MAX_SLICES 256
+
+#define COLLISION_NO_CELL -1
+
+// Contact between the particles with these stable ids
+typedef struct CollisionPair {
+    unsigned int a, b;
+} CollisionPair;
+
+typedef struct CellSlot {
+    uint64_t key;
+    int cell;              // COLLISION_NO_CELL for an empty slot
+} CellSlot;
+
+typedef struct PairList {
+    CollisionPair* pairs;
+    int count;
+    int capacity;
+} PairList;
+
+// Broadphase buffers, kept between calls
+static uint64_t* gKeys = NULL;        // Morton key of every particle, sorted
+static uint64_t* gKeysTmp = NULL;
+static unsigned int* gOrder = NULL;   // particle slots in key order
+static unsigned int* gOrderTmp = NULL;
+static int gCapacity = 0;
+static int* gCellStart = NULL;        // first gOrder entry of every occupied cell, plus the end
+static int gCellCapacity = 0;
+static float* gSortedX = NULL;        // positions in key order
+static float* gSortedY = NULL;
+static float* gSortedZ = NULL;
+static CellSlot* gTable = NULL;       // open addressing: cell key -> occupied cell
+static int gTableSize = 0;            // power of two
+static uint64_t* gFilter = NULL;      // one bit per hash of the occupied keys: most empty
+static int gFilterShift = 64;         // neighbours are rejected without touching gTable
+static int gFilterWords = 0;
+static PairList gSlices[COLLISION_MAX_SLICES];
+static unsigned char* gMerged = NULL; // resolveCollisionPairs: one bit per id, all clear between calls
+static unsigned int gMergedBytes = 0;
+
+// Bits of one axis in a Morton key (see gridMortonKey): x, y = << 1, z = << 2
+#define MORTON_AXIS_X 0x1249249249249249ULL
+
+// Half of the 3x3x3 neighbourhood: every neighbouring pair of cells is visited once
+static const int FORWARD_NEIGHBOURS[13][3] = {
+    { 1, 0, 0},
+    {-1, 1, 0}, { 0, 1, 0}, { 1, 1, 0},
+    {-1,-1, 1}, { 0,-1, 1}, { 1,-1, 1},
+    {-1, 0, 1}, { 0, 0, 1}, { 1, 0, 1},
+    {-1, 1, 1}, { 0, 1, 1}, { 1, 1, 1}
+};
+
+// Move a Morton key one cell along an axis without decoding it. Steps past
+// the edge of the key range wrap around; the distance test rejects those.
+static inline uint64_t mortonStep(uint64_t key, uint64_t axis, int delta) {
+    uint64_t coord = key & axis;
+    if (delta > 0) coord = ((coord | ~axis) + 1) & axis;
+    else if (delta < 0) coord = (coord - 1) & axis;
+    return coord | (key & ~axis);
+}
+
+static inline uint64_t neighbourKey(uint64_t key, const int* offset) {
+    key = mortonStep(key, MORTON_AXIS_X, offset[0]);
+    key = mortonStep(key, MORTON_AXIS_X << 1, offset[1]);
+    return mortonStep(key, MORTON_AXIS_X << 2, offset[2]);
+}
+
+const char* collisionModeName(CollisionMode mode) {
+    switch (mode) {
+        case COLLISION_MERGE:   return "Merge";
+        case COLLISION_ELASTIC: return "Elastic";
+        default:                return "Off";
+    }
+}
+
+static void freeParticleBuffers(void) {
+    free(gKeys); free(gKeysTmp); free(gOrder); free(gOrderTmp);
+    free(gSortedX); free(gSortedY); free(gSortedZ);
+    gKeys = gKeysTmp = NULL;
+    gOrder = gOrderTmp = NULL;
+    gSortedX = gSortedY = gSortedZ = NULL;
+    gCapacity = 0;
+}
+
+static int reserveParticles(int count) {
+    if (count <= gCapacity) return 1;
+    int newCap = gCapacity > 0 ? gCapacity : 1024;
+    while (newCap < count) newCap *= 2;
+    freeParticleBuffers();
+    gKeys = malloc(sizeof(uint64_t) * newCap);
+    gKeysTmp = malloc(sizeof(uint64_t) * newCap);
+    gOrder = malloc(sizeof(unsigned int) * newCap);
+    gOrderTmp = malloc(sizeof(unsigned int) * newCap);
+    gSortedX = malloc(sizeof(float) * newCap);
+    gSortedY = malloc(sizeof(float) * newCap);
+    gSortedZ = malloc(sizeof(float) * newCap);
+    if (!gKeys || !gKeysTmp || !gOrder || !gOrderTmp || !gSortedX || !gSortedY || !gSortedZ) {
+        freeParticleBuffers();
+        return 0;
+    }
+    gCapacity = newCap;
+    return 1;
+}
+
+static inline unsigned int hashKey(uint64_t key, int tableSize) {
+    return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (unsigned int)(tableSize - 1);
+}
+
+static inline uint64_t filterBit(uint64_t key) {
+    return (key * 0xC2B2AE3D27D4EB4FULL) >> gFilterShift;
+}
+
+// Occupied cell with this key, or COLLISION_NO_CELL
+static inline int findCell(uint64_t key) {
+    uint64_t bit = filterBit(key);
+    if (!(gFilter[bit >> 6] >> (bit & 63) & 1)) return COLLISION_NO_CELL;
+    unsigned int slot = hashKey(key, gTableSize);
+    for (;;) {
+        const CellSlot* entry = &gTable[slot];
+        if (entry->cell == COLLISION_NO_CELL || entry->key == key) return entry->cell;
+        slot = (slot + 1) & (unsigned int)(gTableSize - 1);
+    }
+}
+
+typedef struct CollisionPass {
+    const ObjectList* list;
+    float invCell;
+    float touch2;          // squared contact distance
+    int cellCount;
+    int slices;
+} CollisionPass;
+
+static inline int cellCoord(float v, float invCell) {
+    return (int)floorf(v * invCell);
+}
+
+static void keyRange(void* data, int begin, int end) {
+    const CollisionPass* pass = data;
+    const ObjectList* list = pass->list;
+    for (int i = begin; i < end; i++) {
+        gKeys[i] = gridMortonKey(cellCoord(list->posX[i], pass->invCell),
+                                 cellCoord(list->posY[i], pass->invCell),
+                                 cellCoord(list->posZ[i], pass->invCell));
+        gOrder[i] = (unsigned int)i;
+    }
+}
+
+static void gatherRange(void* data, int begin, int end) {
+    const CollisionPass* pass = data;
+    const ObjectList* list = pass->list;
+    for (int k = begin; k < end; k++) {
+        unsigned int i = gOrder[k];
+        gSortedX[k] = list->posX[i];
+        gSortedY[k] = list->posY[i];
+        gSortedZ[k] = list->posZ[i];
+    }
+}
+
+static void pushPair(PairList* out, unsigned int a, unsigned int b) {
+    if (out->count == out->capacity) {
+        int newCap = out->capacity > 0 ? out->capacity * 2 : 64;
+        CollisionPair* pairs = realloc(out->pairs, sizeof(CollisionPair) * newCap);
+        if (!pairs) return; // dropped; found again next tick
+        out->pairs = pairs;
+        out->capacity = newCap;
+    }
+    out->pairs[out->count].a = a;
+    out->pairs[out->count].b = b;
+    out->count++;
+}
+
+// u and v index the sorted order
+static inline void testPair(const CollisionPass* pass, PairList* out, int u, int v) {
+    float dx = gSortedX[v] - gSortedX[u];
+    float dy = gSortedY[v] - gSortedY[u];
+    float dz = gSortedZ[v] - gSortedZ[u];
+    if (dx*dx + dy*dy + dz*dz <= pass->touch2) {
+        pushPair(out, pass->list->ids[gOrder[u]], pass->list->ids[gOrder[v]]);
+    }
+}
+
+// Pairs within cells [first, last) and between them and their forward neighbours
+static void pairSlices(void* data, int begin, int end) {
+    const CollisionPass* pass = data;
+    for (int s = begin; s < end; s++) {
+        PairList* out = &gSlices[s];
+        int first = (int)((long)pass->cellCount * s / pass->slices);
+        int last = (int)((long)pass->cellCount * (s + 1) / pass->slices);
+        out->count = 0;
+        for (int c = first; c < last; c++) {
+            int start = gCellStart[c], stop = gCellStart[c + 1];
+            for (int u = start; u < stop; u++)
+                for (int v = u + 1; v < stop; v++) testPair(pass, out, u, v);
+            uint64_t key = gKeys[start];
+            for (int k = 0; k < 13; k++) {
+                int other = findCell(neighbourKey(key, FORWARD_NEIGHBOURS[k]));
+                if (other == COLLISION_NO_CELL || other == c) continue;
+                for (int u = start; u < stop; u++)
+                    for (int v = gCellStart[other]; v < gCellStart[other + 1]; v++) testPair(pass, out, u, v);
+            }
+        }
+    }
+}
+
+// Sort by cell, index the occupied cells and collect all touching pairs into gSlices
+static int findPairs(const ObjectList* list, float radius, CollisionPass* pass) {
+    int n = list->size;
+    if (!reserveParticles(n)) return 0;
+    pass->list = list;
+    pass->invCell = 1.0f / (2.0f * radius);
+    pass->touch2 = 4.0f * radius * radius;
+    jobParallelFor(n, COLLISION_JOB_GRAIN, keyRange, pass);
+    gridSortPairs(gKeys, gOrder, gKeysTmp, gOrderTmp, n, 3 * GRID_KEY_BITS);
+    jobParallelFor(n, COLLISION_JOB_GRAIN, gatherRange, pass);
+
+    // Runs of equal keys are the occupied cells
+    if (gCellCapacity < n + 1) {
+        int* starts = realloc(gCellStart, sizeof(int) * (n + 1));
+        if (!starts) return 0;
+        gCellStart = starts;
+        gCellCapacity = n + 1;
+    }
+    int cells = 0;
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || gKeys[i] != gKeys[i - 1]) gCellStart[cells++] = i;
+    }
+    gCellStart[cells] = n;
+
+    // Table at most half full
+    int tableSize = 1024;
+    while (tableSize < 2 * cells) tableSize *= 2;
+    if (tableSize > gTableSize) {
+        CellSlot* table = realloc(gTable, sizeof(CellSlot) * tableSize);
+        if (!table) return 0;
+        gTable = table;
+        gTableSize = tableSize;
+    }
+    // About 8 filter bits per occupied cell: at most one in eight empty neighbours gets through
+    int filterLog = 12;
+    while ((1L << filterLog) < 8L * cells) filterLog++;
+    int words = (int)((1L << filterLog) / 64);
+    if (words > gFilterWords) {
+        uint64_t* filter = realloc(gFilter, sizeof(uint64_t) * words);
+        if (!filter) return 0;
+        gFilter = filter;
+        gFilterWords = words;
+    }
+    gFilterShift = 64 - filterLog;
+    memset(gFilter, 0, sizeof(uint64_t) * words);
+    for (int t = 0; t < gTableSize; t++) gTable[t].cell = COLLISION_NO_CELL;
+    for (int c = 0; c < cells; c++) {
+        uint64_t key = gKeys[gCellStart[c]];
+        uint64_t bit = filterBit(key);
+        gFilter[bit >> 6] |= 1ULL << (bit & 63);
+        unsigned int slot = hashKey(key, gTableSize);
+        while (gTable[slot].cell != COLLISION_NO_CELL) slot = (slot + 1) & (unsigned int)(gTableSize - 1);
+        gTable[slot].key = key;
+        gTable[slot].cell = c;
+    }
+
+    int slices = jobWorkerCount() * 4;
+    if (slices > COLLISION_MAX_SLICES) slices = COLLISION_MAX_SLICES;
+    if (slices > cells) slices = cells;
+    pass->cellCount = cells;
+    pass->slices = slices;
+    jobParallelFor(slices, 1, pairSlices, pass);
+    return 1;
+}
+
+// Absorb the lighter particle into the heavier one at their centre of mass
+static int mergePair(ObjectList* list, int a, int b, float touch2) {
+    float dx = list->posX[b] - list->posX[a];
+    float dy = list->posY[b] - list->posY[a];
+    float dz = list->posZ[b] - list->posZ[a];
+    // An earlier merge in this pass may have moved them apart
+    if (dx*dx + dy*dy + dz*dz > touch2) return 0;
+    if (list->mass[b] > list->mass[a]) {
+        int t = a; a = b; b = t;
+    }
+    float ma = list->mass[a], mb = list->mass[b];
+    float m = ma + mb;
+    float wa = ma / m, wb = mb / m;
+    list->posX[a] = list->posX[a] * wa + list->posX[b] * wb;
+    list->posY[a] = list->posY[a] * wa + list->posY[b] * wb;
+    list->posZ[a] = list->posZ[a] * wa + list->posZ[b] * wb;
+    list->velX[a] = list->velX[a] * wa + list->velX[b] * wb;
+    list->velY[a] = list->velY[a] * wa + list->velY[b] * wb;
+    list->velZ[a] = list->velZ[a] * wa + list->velZ[b] * wb;
+    list->mass[a] = m;
+    removeObjectAtIndex(list, b);
+    return 1;
+}
+
+// Exchange momentum along the line of centres and push the spheres apart
+static void bouncePair(ObjectList* list, int a, int b, float radius) {
+    float dx = list->posX[b] - list->posX[a];
+    float dy = list->posY[b] - list->posY[a];
+    float dz = list->posZ[b] - list->posZ[a];
+    float dist = sqrtf(dx*dx + dy*dy + dz*dz);
+    float nx = 1.0f, ny = 0.0f, nz = 0.0f;
+    if (dist > 0.0f) {
+        nx = dx / dist; ny = dy / dist; nz = dz / dist;
+    }
+    float invA = 1.0f / list->mass[a], invB = 1.0f / list->mass[b];
+    float approach = (list->velX[b] - list->velX[a]) * nx
+                   + (list->velY[b] - list->velY[a]) * ny
+                   + (list->velZ[b] - list->velZ[a]) * nz;
+    if (approach < 0.0f) {
+        float j = -2.0f * approach / (invA + invB);
+        list->velX[a] -= j * invA * nx; list->velY[a] -= j * invA * ny; list->velZ[a] -= j * invA * nz;
+        list->velX[b] += j * invB * nx; list->velY[b] += j * invB * ny; list->velZ[b] += j * invB * nz;
+    }
+    // Separate the overlap, the lighter particle moving further
+    float overlap = 2.0f * radius - dist;
+    if (overlap > 0.0f) {
+        float sa = overlap * invA / (invA + invB), sb = overlap * invB / (invA + invB);
+        list->posX[a] -= sa * nx; list->posY[a] -= sa * ny; list->posZ[a] -= sa * nz;
+        list->posX[b] += sb * nx; list->posY[b] += sb * ny; list->posZ[b] += sb * nz;
+    }
+}
+
+int resolveCollisions(ObjectList* list, float radius, CollisionMode mode) {
+    if (mode == COLLISION_OFF || list->size < 2 || radius <= 0.0f) return 0;
+    CollisionPass pass;
+    if (!findPairs(list, radius, &pass)) return 0;
+    // Resolved one after another in cell order; pairs refer to stable ids
+    // because merging moves particles between slots
+    int found = 0, merged = 0;
+    for (int s = 0; s < pass.slices; s++) {
+        const PairList* slice = &gSlices[s];
+        for (int p = 0; p < slice->count; p++) {
+            int a = indexOfObjectId(list, slice->pairs[p].a);
+            int b = indexOfObjectId(list, slice->pairs[p].b);
+            found++;
+            if (a < 0 || b < 0) continue;
+            if (mode == COLLISION_MERGE) merged += mergePair(list, a, b, pass.touch2);
+            else bouncePair(list, a, b, radius);
+        }
+    }
+    if (found > 0) touchObjectList(list);
+    if (DEBUG_MODE) printf("[resolveCollisions] %d pairs, %d merged, %s\n", found, merged, collisionModeName(mode));
+    return found;
+}
+
+int resolveCollisionPairs(ObjectList* list, const unsigned int* slotPairs, int count, float radius, CollisionMode mode) {
+    if (mode == COLLISION_OFF || count <= 0 || radius <= 0.0f) return 0;
+    // To ids first: merging moves particles between slots
+    PairList* pairs = &gSlices[0];
+    pairs->count = 0;
+    for (int p = 0; p < count; p++) {
+        unsigned int a = slotPairs[2 * p], b = slotPairs[2 * p + 1];
+        if (a >= (unsigned int)list->size || b >= (unsigned int)list->size) continue;
+        pushPair(pairs, list->ids[a], list->ids[b]);
+    }
+    // Found before the step moved the particles, so the distance is not
+    // checked again; instead a particle merges at most once per call
+    unsigned char* merged = gMerged;
+    if (mode == COLLISION_MERGE && list->nextId / 8 + 1 > gMergedBytes) {
+        unsigned int bytes = list->nextId / 8 + 1;
+        merged = realloc(gMerged, bytes);
+        if (!merged) return 0;
+        memset(merged + gMergedBytes, 0, bytes - gMergedBytes);
+        gMerged = merged;
+        gMergedBytes = bytes;
+    }
+    int done = 0;
+    for (int p = 0; p < pairs->count; p++) {
+        unsigned int idA = pairs->pairs[p].a, idB = pairs->pairs[p].b;
+        int a = indexOfObjectId(list, idA);
+        int b = indexOfObjectId(list, idB);
+        if (a < 0 || b < 0) continue;
+        if (mode == COLLISION_MERGE) {
+            if ((merged[idA >> 3] >> (idA & 7) & 1) || (merged[idB >> 3] >> (idB & 7) & 1)) continue;
+            merged[idA >> 3] |= (unsigned char)(1 << (idA & 7));
+            merged[idB >> 3] |= (unsigned char)(1 << (idB & 7));
+            done += mergePair(list, a, b, INFINITY);
+        } else {
+            bouncePair(list, a, b, radius);
+            done++;
+        }
+    }
+    if (mode == COLLISION_MERGE) {
+        // Every bit set belongs to one of the pairs: clearing their bytes empties the bitmap
+        for (int p = 0; p < pairs->count; p++) {
+            merged[pairs->pairs[p].a >> 3] = 0;
+            merged[pairs->pairs[p].b >> 3] = 0;
+        }
+    }
+    if (done > 0) touchObjectList(list);
+    if (DEBUG_MODE) printf("[resolveCollisionPairs] %d pairs, %d resolved, %s\n", count, done, collisionModeName(mode));
+    return done;
+}
+
+void freeCollisions(void) {
+    freeParticleBuffers();
+    free(gCellStart);
+    gCellStart = NULL;
+    gCellCapacity = 0;
+    free(gTable);
+    gTable = NULL;
+    gTableSize = 0;
+    free(gFilter);
+    gFilter = NULL;
+    gFilterWords = 0;
+    free(gMerged);
+    gMerged = NULL;
+    gMergedBytes = 0;
+    for (int s = 0; s < COLLISION_MAX_SLICES; s++) {
+        free(gSlices[s].pairs);
+        gSlices[s].pairs = NULL;
+        gSlices[s].count = gSlices[s].capacity = 0;
+    }
+}
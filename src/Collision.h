@@ -0,0 +1,33 @@
+#ifndef COLLISION_H
+#define COLLISION_H
+
+#include "particle.h"
+
+// What happens when two particles touch
+typedef enum CollisionMode {
+    COLLISION_OFF,
+    COLLISION_MERGE,   // perfectly inelastic: the lighter one is absorbed, mass and momentum conserved
+    COLLISION_ELASTIC, // bounce off each other, momentum and kinetic energy conserved
+    COLLISION_MODE_COUNT
+} CollisionMode;
+
+// Find every pair of particles whose spheres of the given radius overlap and
+// resolve it with `mode`. Broadphase: particles sorted by the Morton key of
+// their cell (edge = 2 * radius), then each occupied cell is tested against
+// itself and its 13 forward neighbours. Merging removes particles with
+// removeObjectAtIndex, so slots change; any pair touches the list
+// (touchObjectList). Returns the number of pairs found.
+int resolveCollisions(ObjectList* objList, float radius, CollisionMode mode);
+
+// Resolve pairs found elsewhere (the GPU near-field pass), given as ObjectList
+// slots, two per pair. They may predate the last move, so the distance is not
+// checked again; a particle merges at most once per call instead, further
+// contacts are found on the next tick. Returns the number of pairs resolved.
+int resolveCollisionPairs(ObjectList* objList, const unsigned int* slotPairs, int count, float radius, CollisionMode mode);
+
+const char* collisionModeName(CollisionMode mode);
+
+// Release the buffers kept between calls
+void freeCollisions(void);
+
+#endif
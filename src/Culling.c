@@ -0,0 +1,297 @@
+#include "Culling.h"
+#include <rlgl.h>
+#include <string.h>
+
+static GLuint gProgram = 0;
+static int gProgramFailed = 0;
+static GLuint gSourceBuffers[4] = { 0, 0, 0, 0 }; // posX, posY, posZ, element index
+static float* gSourceElements = NULL;              // elementIndex() per slot, staged for buffer 3
+static int gSourceCapacity = 0;
+static GLuint gInstanceBuffer = 0;
+static GLuint gCommandBuffer = 0;
+static int gCapacity = 0;
+static GLuint gRangeBuffer = 0;   // CullRange list of the last cullGridCells
+static GLuint gIndexBuffer = 0;   // Grid.objIndices
+static CullRange* gRanges = NULL;
+static int gRangeCount = 0;
+static int gRangeCapacity = 0;
+
+// Classification of a box against the frustum
+enum { BOX_OUTSIDE, BOX_INTERSECTS, BOX_INSIDE };
+
+static void setPlane(float* plane, float a, float b, float c, float d) {
+    float len = sqrtf(a*a + b*b + c*c);
+    float inv = len > 0.0f ? 1.0f / len : 0.0f;
+    plane[0] = a * inv;
+    plane[1] = b * inv;
+    plane[2] = c * inv;
+    plane[3] = d * inv;
+}
+
+ViewFrustum currentViewFrustum(Vector3 eye) {
+    // Clip space rows of M = modelview * projection (raylib: clip.x = m0*x + m4*y + m8*z + m12)
+    Matrix m = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+    ViewFrustum f;
+    f.eye = eye;
+    setPlane(f.planes[0], m.m3 + m.m0, m.m7 + m.m4, m.m11 + m.m8, m.m15 + m.m12); // left
+    setPlane(f.planes[1], m.m3 - m.m0, m.m7 - m.m4, m.m11 - m.m8, m.m15 - m.m12); // right
+    setPlane(f.planes[2], m.m3 + m.m1, m.m7 + m.m5, m.m11 + m.m9, m.m15 + m.m13); // bottom
+    setPlane(f.planes[3], m.m3 - m.m1, m.m7 - m.m5, m.m11 - m.m9, m.m15 - m.m13); // top
+    setPlane(f.planes[4], m.m3 + m.m2, m.m7 + m.m6, m.m11 + m.m10, m.m15 + m.m14); // near
+    setPlane(f.planes[5], m.m3 - m.m2, m.m7 - m.m6, m.m11 - m.m10, m.m15 - m.m14); // far
+    return f;
+}
+
+int frustumSphereVisible(const ViewFrustum* f, Vector3 c, float radius) {
+    for (int k = 0; k < 6; k++) {
+        const float* p = f->planes[k];
+        if (p[0] * c.x + p[1] * c.y + p[2] * c.z + p[3] < -radius) return 0;
+    }
+    return 1;
+}
+
+// Box [mn, mx] against the frustum, using the nearest and farthest corner per plane
+static int frustumBoxClass(const ViewFrustum* f, const float* mn, const float* mx) {
+    int result = BOX_INSIDE;
+    for (int k = 0; k < 6; k++) {
+        const float* p = f->planes[k];
+        float dMax = p[3], dMin = p[3];
+        for (int a = 0; a < 3; a++) {
+            dMax += p[a] * (p[a] > 0.0f ? mx[a] : mn[a]);
+            dMin += p[a] * (p[a] > 0.0f ? mn[a] : mx[a]);
+        }
+        if (dMax < 0.0f) return BOX_OUTSIDE;
+        if (dMin < 0.0f) result = BOX_INTERSECTS;
+    }
+    return result;
+}
+
+// Append a range, merging it into the previous one when they are contiguous
+static int pushRange(unsigned int first, unsigned int count, unsigned int flags) {
+    if (count == 0) return 1;
+    if (gRangeCount > 0) {
+        CullRange* last = &gRanges[gRangeCount - 1];
+        if (last->flags == flags && last->first + last->count == first) {
+            last->count += count;
+            return 1;
+        }
+    }
+    if (gRangeCount == gRangeCapacity) {
+        int newCap = gRangeCapacity > 0 ? gRangeCapacity * 2 : 1024;
+        CullRange* ranges = realloc(gRanges, sizeof(CullRange) * (size_t)newCap);
+        if (!ranges) return 0;
+        gRanges = ranges;
+        gRangeCapacity = newCap;
+    }
+    unsigned int offset = 0;
+    if (gRangeCount > 0) offset = gRanges[gRangeCount - 1].offset + gRanges[gRangeCount - 1].count;
+    gRanges[gRangeCount++] = (CullRange){ first, count, flags, offset };
+    return 1;
+}
+
+static int pushCell(const Grid* grid, const GPUCellNode* leaf, unsigned int flags) {
+    const GPUGridCell* cell = &grid->cells[leaf->cell];
+    return pushRange(cell->objectStart, cell->objectCount, flags);
+}
+
+int cullGridCells(const Grid* grid, const ViewFrustum* frustum, float margin, int objectCount, const CullRange** ranges) {
+    gRangeCount = 0;
+    int ok = 1;
+    int i = 0;
+    while (ok && i < grid->nodeCount) {
+        const GPUCellNode* node = &grid->nodes[i];
+        float edge = (float)(1u << node->level) * grid->cellSize;
+        float mn[3], mx[3];
+        const float origin[3] = { grid->origin.x, grid->origin.y, grid->origin.z };
+        for (int a = 0; a < 3; a++) {
+            mn[a] = origin[a] + (float)node->minCell[a] * grid->cellSize - margin;
+            mx[a] = mn[a] + edge + 2.0f * margin;
+        }
+        int cls = frustumBoxClass(frustum, mn, mx);
+        if (cls == BOX_OUTSIDE) {
+            i = (int)node->next;
+        } else if (cls == BOX_INSIDE) {
+            // Accept every leaf of the subtree
+            for (unsigned int c = (unsigned int)i; ok && c < node->next; c++) {
+                if (grid->nodes[c].level == 0) ok = pushCell(grid, &grid->nodes[c], CULL_RANGE_INSIDE);
+            }
+            i = (int)node->next;
+        } else {
+            if (node->level == 0) ok = pushCell(grid, node, 0);
+            i++; // descend: the first child follows its parent
+        }
+    }
+    if (ok && objectCount > grid->objectCount) {
+        ok = pushRange((unsigned int)grid->objectCount, (unsigned int)(objectCount - grid->objectCount), CULL_RANGE_SLOTS);
+    }
+    if (!ok) return -1;
+    *ranges = gRanges;
+    return gRangeCount;
+}
+
+// Grow an SSBO to hold `bytes` (contents are not kept)
+static void reserveBytes(GLuint* buffer, size_t bytes, GLenum usage) {
+    if (*buffer == 0) glGenBuffers(1, buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, *buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, NULL, usage);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+static int prepare(int count) {
+    if (gProgram == 0) {
+        if (gProgramFailed || !computeAvailable()) return 0;
+        gProgram = createComputeProgram("shader/ParticleCull.comp");
+        if (gProgram == 0) {
+            gProgramFailed = 1;
+            return 0;
+        }
+        glGenBuffers(1, &gCommandBuffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gCommandBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(GLuint) * 12, NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+    if (count > gCapacity || gInstanceBuffer == 0) {
+        int newCap = gCapacity > 0 ? gCapacity : 4096;
+        while (newCap < count) newCap *= 2;
+        reserveBytes(&gInstanceBuffer, sizeof(float) * 4 * 2 * (size_t)newCap, GL_DYNAMIC_COPY);
+        gCapacity = newCap;
+    }
+    return 1;
+}
+
+// `count` threads; with numRanges > 0 thread t handles candidate t of the ranges
+static void dispatchCull(int count, int sourceIsObjects, int numRanges, const CullParams* params) {
+    // Commands start empty; the shader counts the instances / sprite vertices
+    GLuint commands[12] = { 0 };
+    if (params->meshIndexCount > 0) {
+        commands[0] = (GLuint)params->meshIndexCount; // count, instanceCount, firstIndex, baseVertex, baseInstance
+    } else {
+        commands[0] = (GLuint)params->meshVertexCount; // count, instanceCount, first, baseInstance
+    }
+    commands[9] = 1; // sprites: one instance of `count` points
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gCommandBuffer);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(commands), commands);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    float planes[24];
+    memcpy(planes, params->frustum->planes, sizeof(planes));
+    float lod2 = params->lodDistance < 0.0f ? -1.0f : params->lodDistance * params->lodDistance;
+    Vector3 eye = params->frustum->eye;
+
+    glUseProgram(gProgram);
+    glUniform1i(glGetUniformLocation(gProgram, "numObjects"), count);
+    glUniform1i(glGetUniformLocation(gProgram, "sourceIsObjects"), sourceIsObjects);
+    glUniform1i(glGetUniformLocation(gProgram, "numRanges"), numRanges);
+    glUniform1ui(glGetUniformLocation(gProgram, "capacity"), (GLuint)gCapacity);
+    glUniform4fv(glGetUniformLocation(gProgram, "planes"), 6, planes);
+    glUniform1i(glGetUniformLocation(gProgram, "cullEnabled"), params->cullEnabled);
+    glUniform3f(glGetUniformLocation(gProgram, "eye"), eye.x, eye.y, eye.z);
+    glUniform1f(glGetUniformLocation(gProgram, "lodDistance2"), lod2);
+    glUniform1f(glGetUniformLocation(gProgram, "radius"), params->radius);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, gInstanceBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, gCommandBuffer);
+    // Bindings 7 and 8 are declared by the shader even when unused
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, numRanges > 0 ? gRangeBuffer : gCommandBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, numRanges > 0 ? gIndexBuffer : gCommandBuffer);
+    if (count > 0) glDispatchCompute((count + 255) / 256, 1, 1);
+    // The draws read the commands and the instances as vertex attributes
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    glUseProgram(0);
+}
+
+int cullObjectList(const ObjectList* oList, const CullParams* params) {
+    int n = oList->size;
+    if (!prepare(n)) return 0;
+
+    // Upload the position arrays as they are; only the colour key is converted
+    if (n > gSourceCapacity || gSourceBuffers[0] == 0) {
+        int newCap = gSourceCapacity > 0 ? gSourceCapacity : 4096;
+        while (newCap < n) newCap *= 2;
+        float* elements = realloc(gSourceElements, sizeof(float) * (size_t)newCap);
+        if (elements == NULL) return 0;
+        gSourceElements = elements;
+        for (int b = 0; b < 4; b++) reserveBytes(&gSourceBuffers[b], sizeof(float) * (size_t)newCap, GL_STREAM_DRAW);
+        gSourceCapacity = newCap;
+    }
+    for (int i = 0; i < n; i++) gSourceElements[i] = (float)elementIndex(oList->element[i]);
+    const float* arrays[4] = { oList->posX, oList->posY, oList->posZ, gSourceElements };
+    for (int b = 0; b < 4; b++) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gSourceBuffers[b]);
+        // Orphan last frame's storage so the upload does not wait for it
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * (size_t)gSourceCapacity, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(float) * (size_t)n, arrays[b]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (GLuint)b, gSourceBuffers[b]);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    // Binding 4 is declared by the shader even when unused
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, gSourceBuffers[0]);
+
+    // Cell-level culling: the shader only visits the particles of cells that
+    // are not entirely outside, and skips the tests in cells entirely inside
+    const CullRange* ranges = NULL;
+    int numRanges = -1;
+    if (params->grid && params->cullEnabled) {
+        float margin = params->radius + params->gridDrift;
+        numRanges = cullGridCells(params->grid, params->frustum, margin, n, &ranges);
+    }
+    if (numRanges < 0) {
+        dispatchCull(n, 0, 0, params);
+        return 1;
+    }
+    int candidates = 0;
+    if (numRanges > 0) {
+        candidates = (int)(ranges[numRanges - 1].offset + ranges[numRanges - 1].count);
+        if (gRangeBuffer == 0) glGenBuffers(1, &gRangeBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gRangeBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(CullRange) * (size_t)numRanges, ranges, GL_STREAM_DRAW);
+        if (gIndexBuffer == 0) glGenBuffers(1, &gIndexBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gIndexBuffer);
+        size_t indexBytes = sizeof(unsigned int) * (size_t)(params->grid->objectCount > 0 ? params->grid->objectCount : 1);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, indexBytes, params->grid->objectCount > 0 ? params->grid->objIndices : NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+    // No ranges: nothing is visible, the pass only resets the commands
+    dispatchCull(candidates, 0, numRanges, params);
+    return 1;
+}
+
+int cullGPUObjects(GLuint objects, int count, const CullParams* params) {
+    if (!prepare(count)) return 0;
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, objects);
+    for (int b = 0; b < 4; b++) glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (GLuint)b, objects);
+    dispatchCull(count, 1, 0, params);
+    return 1;
+}
+
+GLuint cullInstanceBuffer(void) {
+    return gInstanceBuffer;
+}
+
+GLuint cullCommandBuffer(void) {
+    return gCommandBuffer;
+}
+
+int cullCapacity(void) {
+    return gCapacity;
+}
+
+void releaseCulling(void) {
+    if (gProgram != 0) glDeleteProgram(gProgram);
+    if (gSourceBuffers[0] != 0) glDeleteBuffers(4, gSourceBuffers);
+    if (gInstanceBuffer != 0) glDeleteBuffers(1, &gInstanceBuffer);
+    if (gCommandBuffer != 0) glDeleteBuffers(1, &gCommandBuffer);
+    if (gRangeBuffer != 0) glDeleteBuffers(1, &gRangeBuffer);
+    if (gIndexBuffer != 0) glDeleteBuffers(1, &gIndexBuffer);
+    free(gRanges);
+    free(gSourceElements);
+    gRanges = NULL;
+    gSourceElements = NULL;
+    gRangeCount = gRangeCapacity = 0;
+    gRangeBuffer = gIndexBuffer = 0;
+    gProgram = 0;
+    gProgramFailed = 0;
+    for (int b = 0; b < 4; b++) gSourceBuffers[b] = 0;
+    gInstanceBuffer = gCommandBuffer = 0;
+    gSourceCapacity = gCapacity = 0;
+}
@@ -0,0 +1,73 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include "particle.h"
+
+// Six frustum planes (a, b, c, d): a point p is inside when
+// a*p.x + b*p.y + c*p.z + d >= 0 for all of them. Normalised, so the
+// value is the signed distance.
+typedef struct ViewFrustum {
+    float planes[6][4];
+    Vector3 eye;
+} ViewFrustum;
+
+// Planes of the current rlgl modelview * projection (call inside BeginMode3D)
+ViewFrustum currentViewFrustum(Vector3 eye);
+int frustumSphereVisible(const ViewFrustum* frustum, Vector3 center, float radius);
+
+// Candidate particles from cell-level culling (uvec4 in shader/ParticleCull.comp).
+// [first, first + count) are positions in Grid.objIndices, or ObjectList
+// slots with CULL_RANGE_SLOTS. offset is the number of candidates in all
+// earlier ranges.
+typedef struct CullRange {
+    unsigned int first;
+    unsigned int count;
+    unsigned int flags;
+    unsigned int offset;
+} CullRange;
+
+#define CULL_RANGE_INSIDE 1u // every particle is visible, skip the sphere tests
+#define CULL_RANGE_SLOTS  2u // first is an ObjectList slot (particles not in the grid)
+
+// Walk the grid's cell octree against the frustum: subtrees outside are
+// dropped whole, subtrees inside are accepted without per-particle tests,
+// and only cells on the frustum boundary are left to test. Cell boxes are
+// grown by `margin` (particle radius plus drift since the grid update).
+// Slots [grid->objectCount, objectCount) are added as one range to test.
+// Returns the number of ranges (valid until the next call), -1 on failure.
+int cullGridCells(const Grid* grid, const ViewFrustum* frustum, float margin, int objectCount, const CullRange** ranges);
+
+// Byte offsets of the indirect draw commands in cullCommandBuffer()
+#define CULL_MESH_COMMAND_OFFSET 0    // DrawElementsIndirectCommand or DrawArraysIndirectCommand
+#define CULL_SPRITE_COMMAND_OFFSET 32 // DrawArraysIndirectCommand (GL_POINTS)
+
+// GPU culling pass (shader/ParticleCull.comp): tests every particle against
+// the frustum (unless cullEnabled is 0), splits them at lodDistance (< 0:
+// everything is a sprite) and compacts them into cullInstanceBuffer().
+// meshIndexCount > 0 writes an elements command for the mesh draw, otherwise
+// an arrays command with meshVertexCount vertices. With a grid (ObjectList
+// source only) the pass runs over the candidates of cullGridCells instead of
+// every particle. Returns 0 if compute shaders are unavailable.
+typedef struct CullParams {
+    const ViewFrustum* frustum;
+    int cullEnabled;
+    float lodDistance;
+    float radius;
+    int meshIndexCount;
+    int meshVertexCount;
+    const Grid* grid;  // optional, see GetSpatialGrid
+    float gridDrift;
+} CullParams;
+
+int cullObjectList(const ObjectList* objList, const CullParams* params);
+int cullGPUObjects(GLuint objects, int count, const CullParams* params);
+
+// vec4 instances (x, y, z, element index): near ones from element 0, far
+// ones from element cullCapacity()
+GLuint cullInstanceBuffer(void);
+GLuint cullCommandBuffer(void);
+int cullCapacity(void);
+
+void releaseCulling(void);
+
+#endif
@@ -0,0 +1,70 @@
+#include "Diagnostics.h"
+#include "JobSystem.h"
+#include <string.h>
+
+// One slice's partial sums: mass, kinetic, momentum, angular momentum, mass * position
+typedef struct DiagnosticsSlice {
+    double mass, kinetic;
+    double momentum[3], angularMomentum[3], massPosition[3];
+} DiagnosticsSlice;
+
+typedef struct ReducePass {
+    const ObjectList* oList;
+    DiagnosticsSlice slices[DIAGNOSTICS_SLICES];
+} ReducePass;
+
+static void reduceSlices(void* data, int begin, int end) {
+    ReducePass* pass = data;
+    const ObjectList* oList = pass->oList;
+    int n = oList->size;
+    for (int t = begin; t < end; t++) {
+        DiagnosticsSlice sum;
+        memset(&sum, 0, sizeof(sum));
+        int first = (int)((long)n * t / DIAGNOSTICS_SLICES);
+        int last = (int)((long)n * (t + 1) / DIAGNOSTICS_SLICES);
+        for (int i = first; i < last; i++) {
+            double m = oList->mass[i];
+            double x = oList->posX[i], y = oList->posY[i], z = oList->posZ[i];
+            double px = m * oList->velX[i], py = m * oList->velY[i], pz = m * oList->velZ[i];
+            sum.mass += m;
+            sum.kinetic += 0.5 * (px * oList->velX[i] + py * oList->velY[i] + pz * oList->velZ[i]);
+            sum.momentum[0] += px;
+            sum.momentum[1] += py;
+            sum.momentum[2] += pz;
+            sum.angularMomentum[0] += y * pz - z * py;
+            sum.angularMomentum[1] += z * px - x * pz;
+            sum.angularMomentum[2] += x * py - y * px;
+            sum.massPosition[0] += m * x;
+            sum.massPosition[1] += m * y;
+            sum.massPosition[2] += m * z;
+        }
+        pass->slices[t] = sum;
+    }
+}
+
+void diagnosticsReduce(const ObjectList* oList, Diagnostics* out) {
+    ReducePass pass;
+    pass.oList = oList;
+    jobParallelFor(DIAGNOSTICS_SLICES, 1, reduceSlices, &pass);
+    // Fixed order, so the result is the same on any number of threads
+    DiagnosticsSlice total;
+    memset(&total, 0, sizeof(total));
+    for (int t = 0; t < DIAGNOSTICS_SLICES; t++) {
+        const DiagnosticsSlice* s = &pass.slices[t];
+        total.mass += s->mass;
+        total.kinetic += s->kinetic;
+        for (int k = 0; k < 3; k++) {
+            total.momentum[k] += s->momentum[k];
+            total.angularMomentum[k] += s->angularMomentum[k];
+            total.massPosition[k] += s->massPosition[k];
+        }
+    }
+    out->particles = oList->size;
+    out->mass = total.mass;
+    out->kinetic = total.kinetic;
+    for (int k = 0; k < 3; k++) {
+        out->momentum[k] = total.momentum[k];
+        out->angularMomentum[k] = total.angularMomentum[k];
+        out->centreOfMass[k] = total.mass > 0.0 ? total.massPosition[k] / total.mass : 0.0;
+    }
+}
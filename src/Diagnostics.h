@@ -0,0 +1,31 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include "particle.h"
+
+// Conservation checks: with a correct solver and integrator the total energy
+// drifts only slowly and the momenta stay put (up to collisions, which keep
+// momentum but merges lose energy). Sums run in double over fixed slices, so
+// a measurement does not depend on the thread count.
+typedef struct Diagnostics {
+    int particles;
+    double mass;
+    double kinetic;              // sum 0.5 m v^2
+    double potential;            // 0.5 sum m phi, from the active solver
+    double energy;               // kinetic + potential
+    double energyError;          // (energy - reference) / |reference|, see MeasureDiagnostics
+    double momentum[3];          // sum m v
+    double angularMomentum[3];   // sum x cross m v, about the origin
+    double centreOfMass[3];
+    const char* potentialSource; // "tree", "mesh" or "gpu"
+    double ms;                   // wall time of the measurement
+} Diagnostics;
+
+// Particles reduced per slice, independent of the worker count
+#define DIAGNOSTICS_SLICES 64
+
+// Mass, kinetic energy, momenta and centre of mass of the CPU copy in one
+// parallel pass. The potential fields are left alone.
+void diagnosticsReduce(const ObjectList* objList, Diagnostics* out);
+
+#endif
@@ -1,24 +1,206 @@
 #include "Draw.h"
+#include "Calculations.h"
+#include "GPUState.h"
+#include "Culling.h"
+#include "SimdKernels.h"
+#include "Profiler.h"
+#include <rlgl.h>
+#include <stddef.h>
 
 const int PARTICLERADIUS = 1; // in km
 
+// Element colours, in elementIndex order
+static const Color ELEMENT_COLORS[ELEMENT_COUNT] = {
+    { 245, 245, 245, 255 }, // hydrogen: RAYWHITE
+    { 230, 41, 55, 255 },   // helium:   RED
+    { 0, 121, 241, 255 },   // oxygen:   BLUE
+    { 130, 130, 130, 255 }, // carbon:   GRAY
+    { 255, 109, 194, 255 }, // neon:     PINK
+    { 200, 200, 200, 255 }, // iron:     LIGHTGRAY
+};
+
 // Get color for a given element type
 Color getColor(enum element element) {
-    switch (element) {
-        case hydrogen: return RAYWHITE;
-        case helium:   return RED;
-        case oxygen:   return BLUE;
-        case carbon:   return GRAY;
-        case neon:     return PINK;
-        case iron:     return LIGHTGRAY;
-    }
-    return WHITE;
+    return ELEMENT_COLORS[elementIndex(element)];
 }
 
+// Render settings
+static ParticleRenderMode gRenderMode = RENDER_MODE_LOD;
+static float gLODDistance = 150.0f;     // meshes closer than this, sprites beyond
+static float gMaxPointSize = 64.0f;     // sprite size cap in pixels
+static float gDensityIntensity = 0.15f; // brightness of one splat in density mode
+
+void SetRenderMode(ParticleRenderMode mode) { gRenderMode = mode; }
+ParticleRenderMode GetRenderMode(void) { return gRenderMode; }
+void SetLODDistance(float distance) { gLODDistance = distance < 0.0f ? 0.0f : distance; }
+float GetLODDistance(void) { return gLODDistance; }
+
 // Cached sphere model for faster rendering
 static Model gSphereModel = {0};
 static bool gSphereReady = false;
 
+// Shader program plus the uniform locations the particle renderers set
+typedef struct ParticleProgram {
+    Shader shader;
+    int locMvp;
+    int locPointScale, locRadius, locMaxPointSize; // sprites only
+    int locDensity, locIntensity;                  // sprites only
+} ParticleProgram;
+
+// Instanced renderers: near particles are instances of the sphere mesh,
+// far ones (and all of them in density mode) single point sprites
+static ParticleProgram gMeshProgram = {0};
+static ParticleProgram gSpriteProgram = {0};
+static int gInstancedReady = 0; // 1 ready, -1 shaders unavailable (per-particle DrawModel fallback)
+static GLuint gInstanceBuffer = 0;  // x, y, z, element index; near from the front, far from the back
+static GLuint gSpriteVao = 0;
+static float* gInstanceData = NULL;
+static int gInstanceCapacity = 0;
+
+#define INSTANCE_ATTRIB_POSITION 6
+#define INSTANCE_ATTRIB_KEY 7
+
+static int loadParticleProgram(ParticleProgram* prog, const char* vsPath, const char* fsPath) {
+    prog->shader = LoadShader(vsPath, fsPath);
+    if (prog->shader.id == 0 || prog->shader.id == rlGetShaderIdDefault()) return 0;
+    prog->locMvp = GetShaderLocation(prog->shader, "mvp");
+    prog->locPointScale = GetShaderLocation(prog->shader, "pointScale");
+    prog->locRadius = GetShaderLocation(prog->shader, "radius");
+    prog->locMaxPointSize = GetShaderLocation(prog->shader, "maxPointSize");
+    prog->locDensity = GetShaderLocation(prog->shader, "density");
+    prog->locIntensity = GetShaderLocation(prog->shader, "intensity");
+
+    Vector4 colors[ELEMENT_COUNT];
+    for (int e = 0; e < ELEMENT_COUNT; e++) colors[e] = ColorNormalize(ELEMENT_COLORS[e]);
+    SetShaderValueV(prog->shader, GetShaderLocation(prog->shader, "elementColor"), colors, SHADER_UNIFORM_VEC4, ELEMENT_COUNT);
+    return 1;
+}
+
+static int initInstancedRender(void) {
+    if (gInstancedReady != 0) return gInstancedReady > 0;
+    gInstancedReady = -1;
+    if (!loadParticleProgram(&gMeshProgram, "shader/ParticleInstanced.vs", "shader/ParticleInstanced.fs") ||
+        !loadParticleProgram(&gSpriteProgram, "shader/ParticleSprite.vs", "shader/ParticleSprite.fs")) {
+        return 0;
+    }
+    glGenBuffers(1, &gInstanceBuffer);
+    glGenVertexArrays(1, &gSpriteVao);
+    gInstancedReady = 1;
+    return 1;
+}
+
+static int reserveInstances(int count) {
+    if (count <= gInstanceCapacity) return 1;
+    int newCap = gInstanceCapacity > 0 ? gInstanceCapacity : 4096;
+    while (newCap < count) newCap *= 2;
+    float* data = alignedAlloc(sizeof(float) * 4 * (size_t)newCap);
+    if (data == NULL) return 0;
+    alignedFree(gInstanceData);
+    gInstanceData = data;
+    gInstanceCapacity = newCap;
+    return 1;
+}
+
+// Point the per-instance attributes at `source`: position at offset 0, the
+// colour key at `keyOffset`, `stride` bytes apart, starting at element `first`.
+// divisor 1 for mesh instances, 0 for sprites (one vertex per particle).
+static void bindInstanceAttributes(GLuint source, int first, GLsizei stride, size_t keyOffset, GLuint divisor) {
+    size_t base = (size_t)first * (size_t)stride;
+    glBindBuffer(GL_ARRAY_BUFFER, source);
+    glEnableVertexAttribArray(INSTANCE_ATTRIB_POSITION);
+    glVertexAttribPointer(INSTANCE_ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, stride, (const void*)base);
+    glVertexAttribDivisor(INSTANCE_ATTRIB_POSITION, divisor);
+    glEnableVertexAttribArray(INSTANCE_ATTRIB_KEY);
+    glVertexAttribPointer(INSTANCE_ATTRIB_KEY, 1, GL_FLOAT, GL_FALSE, stride, (const void*)(base + keyOffset));
+    glVertexAttribDivisor(INSTANCE_ATTRIB_KEY, divisor);
+}
+
+static void unbindInstanceAttributes(void) {
+    glDisableVertexAttribArray(INSTANCE_ATTRIB_POSITION);
+    glDisableVertexAttribArray(INSTANCE_ATTRIB_KEY);
+    glVertexAttribDivisor(INSTANCE_ATTRIB_POSITION, 0);
+    glVertexAttribDivisor(INSTANCE_ATTRIB_KEY, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void setCommonUniforms(const ParticleProgram* prog) {
+    Matrix viewProj = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+    SetShaderValueMatrix(prog->shader, prog->locMvp, viewProj);
+}
+
+// Near particles: one instanced draw of the sphere mesh. With `indirect` the
+// instance count comes from the culling pass's command buffer.
+static void drawMeshInstances(GLuint source, int first, int count, int indirect, GLsizei stride, size_t keyOffset) {
+    if (!indirect && count <= 0) return;
+    const Mesh* mesh = &gSphereModel.meshes[0];
+    setCommonUniforms(&gMeshProgram);
+
+    glUseProgram(gMeshProgram.shader.id);
+    glBindVertexArray(mesh->vaoId);
+    bindInstanceAttributes(source, first, stride, keyOffset, 1);
+    if (indirect) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cullCommandBuffer());
+        if (mesh->indices != NULL) {
+            glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, (const void*)CULL_MESH_COMMAND_OFFSET);
+        } else {
+            glDrawArraysIndirect(GL_TRIANGLES, (const void*)CULL_MESH_COMMAND_OFFSET);
+        }
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    } else if (mesh->indices != NULL) {
+        glDrawElementsInstanced(GL_TRIANGLES, mesh->triangleCount * 3, GL_UNSIGNED_SHORT, 0, count);
+    } else {
+        glDrawArraysInstanced(GL_TRIANGLES, 0, mesh->vertexCount, count);
+    }
+    // The mesh VAO also serves raylib's DrawModel: leave it as we found it
+    unbindInstanceAttributes();
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
+
+// Far particles: one point sprite each, drawn as sphere impostors or, in
+// density mode, as additive splats without depth writes. With `indirect` the
+// sprite count comes from the culling pass's command buffer.
+static void drawSprites(const Camera3D* camera, GLuint source, int first, int count, int indirect, GLsizei stride, size_t keyOffset, int density) {
+    if (!indirect && count <= 0) return;
+    const ParticleProgram* prog = &gSpriteProgram;
+    float pointScale = (float)GetScreenHeight() / (2.0f * tanf(camera->fovy * DEG2RAD * 0.5f));
+    float radius = (float)PARTICLERADIUS;
+    setCommonUniforms(prog);
+    SetShaderValue(prog->shader, prog->locPointScale, &pointScale, SHADER_UNIFORM_FLOAT);
+    SetShaderValue(prog->shader, prog->locRadius, &radius, SHADER_UNIFORM_FLOAT);
+    SetShaderValue(prog->shader, prog->locMaxPointSize, &gMaxPointSize, SHADER_UNIFORM_FLOAT);
+    SetShaderValue(prog->shader, prog->locDensity, &density, SHADER_UNIFORM_INT);
+    SetShaderValue(prog->shader, prog->locIntensity, &gDensityIntensity, SHADER_UNIFORM_FLOAT);
+
+    glUseProgram(prog->shader.id);
+    glEnable(GL_PROGRAM_POINT_SIZE);
+    if (density) {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glDepthMask(GL_FALSE);
+        glDisable(GL_DEPTH_TEST);
+    }
+    glBindVertexArray(gSpriteVao);
+    bindInstanceAttributes(source, first, stride, keyOffset, 0);
+    if (indirect) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cullCommandBuffer());
+        glDrawArraysIndirect(GL_POINTS, (const void*)CULL_SPRITE_COMMAND_OFFSET);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    } else {
+        glDrawArrays(GL_POINTS, 0, count);
+    }
+    unbindInstanceAttributes();
+    glBindVertexArray(0);
+    if (density) {
+        // Back to raylib's default alpha blending and depth state
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glDepthMask(GL_TRUE);
+        glEnable(GL_DEPTH_TEST);
+    }
+    glDisable(GL_PROGRAM_POINT_SIZE);
+    glUseProgram(0);
+}
+
 void InitParticleRender(void) {
     if (gSphereReady) return;
     Mesh sphere = GenMeshSphere((float)PARTICLERADIUS, 8, 8);
@@ -27,6 +209,19 @@ void InitParticleRender(void) {
 }
 
 void ShutdownParticleRender(void) {
+    if (gInstancedReady > 0) {
+        UnloadShader(gMeshProgram.shader);
+        UnloadShader(gSpriteProgram.shader);
+        glDeleteBuffers(1, &gInstanceBuffer);
+        glDeleteVertexArrays(1, &gSpriteVao);
+        releaseCulling();
+        gInstanceBuffer = 0;
+        gSpriteVao = 0;
+    }
+    gInstancedReady = 0;
+    alignedFree(gInstanceData);
+    gInstanceData = NULL;
+    gInstanceCapacity = 0;
     if (!gSphereReady) return;
     UnloadModel(gSphereModel);
     gSphereModel = (Model){0};
@@ -34,62 +229,152 @@ void ShutdownParticleRender(void) {
 }
 
 // Draw a single particle using the cached sphere model
-static inline void drawParticle(GravitationalObject *obj) {
+static inline void drawParticle(const ObjectList* oList, int i, Vector3 pos) {
     if (!gSphereReady) InitParticleRender();
-    Color col = getColor(obj->element);
-    Vector3 pos = obj->position;
+    Color col = getColor(oList->element[i]);
     DrawModel(gSphereModel, pos, 1.0f, col);
     if (DEBUG_MODE) {
-        printf("[DRAW] %s: pos=(%.2f, %.2f, %.2f)\n", obj->name, pos.x, pos.y, pos.z);
+        printf("[DRAW] #%u: pos=(%.2f, %.2f, %.2f)\n", oList->ids[i], pos.x, pos.y, pos.z);
     }
 }
 
-// Frustum culling: quick sphere-in-frustum test using camera FOV and orientation
-static inline int SphereInView(const Camera3D* cam, Vector3 center, float radius) {
-    // Camera basis vectors
-    Vector3 forward = Vector3Normalize(Vector3Subtract(cam->target, cam->position));
-    Vector3 right = Vector3Normalize(Vector3CrossProduct(forward, cam->up));
-    Vector3 up = Vector3Normalize(Vector3CrossProduct(right, forward));
+// Calls visit for every particle that passes the frustum test. With a grid
+// whole cells are accepted or rejected first (see cullGridCells).
+typedef void (*VisibleParticleFn)(ObjectList* oList, int i, Vector3 pos, void* ctx);
+static void forEachVisible(ObjectList* oList, const ViewFrustum* frustum, int culling, const Grid* grid, float drift, VisibleParticleFn visit, void* ctx) {
+    float radius = (float)PARTICLERADIUS;
+    CullRange all = { 0, (unsigned int)oList->size, CULL_RANGE_SLOTS | (culling ? 0u : CULL_RANGE_INSIDE), 0 };
+    const CullRange* ranges = NULL;
+    int numRanges = -1;
+    if (grid && culling) numRanges = cullGridCells(grid, frustum, radius + drift, oList->size, &ranges);
+    if (numRanges < 0) {
+        ranges = &all;
+        numRanges = 1;
+    }
+    int visible[256];
+    for (int r = 0; r < numRanges; r++) {
+        const CullRange* range = &ranges[r];
+        const unsigned int* indices = (range->flags & CULL_RANGE_SLOTS) ? NULL : grid->objIndices;
+        if (range->flags & CULL_RANGE_INSIDE) {
+            for (unsigned int k = range->first; k < range->first + range->count; k++) {
+                int i = indices ? (int)indices[k] : (int)k;
+                visit(oList, i, objectPosition(oList, i), ctx);
+            }
+            continue;
+        }
+        // Sphere tests in SIMD blocks (see SimdKernels.h)
+        int end = (int)(range->first + range->count);
+        for (int start = (int)range->first; start < end; start += 256) {
+            int count = end - start < 256 ? end - start : 256;
+            int n = cullSpheres((const float (*)[4])frustum->planes, radius, oList->posX, oList->posY, oList->posZ,
+                                indices, start, count, visible);
+            for (int v = 0; v < n; v++) visit(oList, visible[v], objectPosition(oList, visible[v]), ctx);
+        }
+    }
+}
 
-    // Vector from camera to sphere center
-    Vector3 v = Vector3Subtract(center, cam->position);
+// CPU instance gather: near particles from the front of the instance buffer, far ones from the back
+typedef struct InstanceGather {
+    Vector3 eye;
+    float lod2;
+    int nearCount;
+    int farStart;
+} InstanceGather;
 
-    // Depth along forward axis
-    float z = Vector3DotProduct(v, forward);
-    if (z < -radius) return 0; // behind camera
+static void gatherInstance(ObjectList* oList, int i, Vector3 pos, void* ctx) {
+    InstanceGather* g = ctx;
+    float dx = pos.x - g->eye.x, dy = pos.y - g->eye.y, dz = pos.z - g->eye.z;
+    int slot = (dx*dx + dy*dy + dz*dz < g->lod2) ? g->nearCount++ : --g->farStart;
+    float* inst = &gInstanceData[4 * slot];
+    inst[0] = pos.x;
+    inst[1] = pos.y;
+    inst[2] = pos.z;
+    inst[3] = (float)elementIndex(oList->element[i]);
+}
 
-    // Near/far planes (approximate to typical values used by raylib)
-    const float nearPlane = 0.01f;
-    const float farPlane = 10000.0f;
-    // Add small margin to reduce popping near near-plane
-    float margin = 2.0f;
-    if (z + radius < nearPlane - margin) return 0;
-    if (z - radius > farPlane) return 0;
+static void drawVisibleParticle(ObjectList* oList, int i, Vector3 pos, void* ctx) {
+    (void)ctx;
+    drawParticle(oList, i, pos);
+}
 
-    // Field of view
-    float aspect = (float)GetScreenWidth() / (float)GetScreenHeight();
-    float vHalf = tanf((cam->fovy * DEG2RAD) * 0.5f);
-    float hHalf = vHalf * aspect;
+// Draw the particles in camera view; grid (may be NULL) lets the culling
+// reject or accept whole cells, resident draws the GPU-resident state
+static void drawParticleList(ObjectList* oList, const Camera3D* camera, const Grid* grid, float drift, int resident) {
+    if (!gSphereReady) InitParticleRender();
+    int instanced = initInstancedRender();
+    int density = gRenderMode == RENDER_MODE_DENSITY;
+    int culling = IsCullingEnabled();
+    float radius = (float)PARTICLERADIUS;
+    rlDrawRenderBatchActive(); // flush raylib's batch before issuing raw GL
+    ViewFrustum frustum = currentViewFrustum(camera->position);
 
-    // Project v onto camera right and up axes to get horizontal/vertical distances
-    float x = Vector3DotProduct(v, right);
-    float y = Vector3DotProduct(v, up);
+    if (instanced) {
+        // Cull, split by LOD and compact on the GPU, then draw indirectly
+        const Mesh* mesh = &gSphereModel.meshes[0];
+        CullParams params = {
+            &frustum, culling, density ? -1.0f : gLODDistance, radius,
+            mesh->indices != NULL ? mesh->triangleCount * 3 : 0, mesh->vertexCount,
+            grid, drift
+        };
+        ProfileZone cull = profileGPUBegin("draw.cull");
+        int culled = resident
+            ? cullGPUObjects(gpuStateBuffer(), gpuStateCount(), &params)
+            : cullObjectList(oList, &params);
+        profileGPUEnd(cull);
+        if (culled) {
+            GLsizei stride = sizeof(float) * 4;
+            ProfileZone meshes = profileGPUBegin("draw.meshes");
+            drawMeshInstances(cullInstanceBuffer(), 0, 0, 1, stride, sizeof(float) * 3);
+            profileGPUEnd(meshes);
+            ProfileZone sprites = profileGPUBegin("draw.sprites");
+            drawSprites(camera, cullInstanceBuffer(), cullCapacity(), 0, 1, stride, sizeof(float) * 3, density);
+            profileGPUEnd(sprites);
+            return;
+        }
+        // No compute shaders: the resident state cannot exist, so oList is current
+    }
 
-    // Frustum side planes: |x| <= z * hHalf (+radius), |y| <= z * vHalf (+radius)
-    // Use max(z, nearPlane) to avoid negative z cases and add small margin
-    float zClamp = (z < nearPlane) ? nearPlane : z;
-    if (fabsf(x) > zClamp * hHalf + radius + margin) return 0;
-    if (fabsf(y) > zClamp * vHalf + radius + margin) return 0;
+    if (!instanced || !reserveInstances(oList->size)) {
+        ProfileZone immediate = profileBegin("draw.immediate");
+        forEachVisible(oList, &frustum, culling, grid, drift, drawVisibleParticle, NULL);
+        profileEnd(immediate);
+        return;
+    }
 
-    return 1;
+    // CPU fallback: gather the visible particles on the CPU
+    InstanceGather gather = { camera->position, density ? -1.0f : gLODDistance * gLODDistance, 0, gInstanceCapacity };
+    ProfileZone gatherZone = profileBegin("draw.gather");
+    forEachVisible(oList, &frustum, culling, grid, drift, gatherInstance, &gather);
+    profileEnd(gatherZone);
+    int nearCount = gather.nearCount, farStart = gather.farStart;
+    int farCount = gInstanceCapacity - farStart;
+    size_t instanceBytes = sizeof(float) * 4;
+    ProfileZone upload = profileBegin("draw.upload");
+    glBindBuffer(GL_ARRAY_BUFFER, gInstanceBuffer);
+    // Orphan the old storage so the upload never waits for last frame's draw
+    glBufferData(GL_ARRAY_BUFFER, instanceBytes * (size_t)gInstanceCapacity, NULL, GL_STREAM_DRAW);
+    if (nearCount > 0) glBufferSubData(GL_ARRAY_BUFFER, 0, instanceBytes * nearCount, gInstanceData);
+    if (farCount > 0) glBufferSubData(GL_ARRAY_BUFFER, instanceBytes * farStart, instanceBytes * farCount, &gInstanceData[4 * farStart]);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    profileEnd(upload);
+
+    ProfileZone meshes = profileGPUBegin("draw.meshes");
+    drawMeshInstances(gInstanceBuffer, 0, nearCount, 0, (GLsizei)instanceBytes, sizeof(float) * 3);
+    profileGPUEnd(meshes);
+    ProfileZone sprites = profileGPUBegin("draw.sprites");
+    drawSprites(camera, gInstanceBuffer, farStart, farCount, 0, (GLsizei)instanceBytes, sizeof(float) * 3, density);
+    profileGPUEnd(sprites);
 }
 
-// Draw all particles in the object list (only those in camera view)
-void DrawParticles(ObjectList* oList, const Camera3D* camera, bool gCullingEnabled) {
-    for (int i = 0; i < oList->size; i++) {
-        GravitationalObject* obj = oList->gObjs[i];
-        if (!gCullingEnabled || SphereInView(camera, obj->position, (float)PARTICLERADIUS)) {
-            drawParticle(obj);
-        }
-    }
-}
\ No newline at end of file
+// Draw all particles in the simulated object list (only those in camera view)
+void DrawParticles(ObjectList* oList, const Camera3D* camera) {
+    float drift = 0.0f;
+    int resident = IsStateOnGPU();
+    const Grid* grid = resident ? NULL : GetSpatialGrid(oList, &drift);
+    drawParticleList(oList, camera, grid, drift, resident);
+}
+
+// Draw a detached copy of the particles (e.g. a blended frame)
+void DrawParticleFrame(ObjectList* oList, const Camera3D* camera, const Grid* grid, float drift) {
+    drawParticleList(oList, camera, grid, drift, 0);
+}
@@ -2,8 +2,24 @@
 #define DRAW_H
 
 #include "particle.h"
+#include "GridSystem.h"
+
+// How particles are drawn
+typedef enum ParticleRenderMode {
+    RENDER_MODE_LOD,     // sphere meshes up close, sphere impostors beyond the LOD distance
+    RENDER_MODE_DENSITY, // additive splats for every particle (dense clusters glow)
+    RENDER_MODE_COUNT
+} ParticleRenderMode;
 
 void DrawParticles(ObjectList* objList, const Camera3D* camera);
+// A copy of the state, e.g. the blended frame of the simulation thread; never
+// draws the GPU-resident buffer. grid (may be NULL) must file objList's slots,
+// with particles up to drift outside their cells.
+void DrawParticleFrame(ObjectList* objList, const Camera3D* camera, const Grid* grid, float drift);
+void SetRenderMode(ParticleRenderMode mode);
+ParticleRenderMode GetRenderMode(void);
+void  SetLODDistance(float distance); // camera distance where meshes turn into impostors
+float GetLODDistance(void);
 void InitParticleRender(void);
 void ShutdownParticleRender(void);
 
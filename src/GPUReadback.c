@@ -0,0 +1,135 @@
+#include "GPUReadback.h"
+
+typedef struct ReadbackSlot {
+    GLuint buffer;
+    void* mapped;         // persistent mapping (NULL without GL 4.4 buffer storage)
+    GLsync fence;         // signalled once the copy into this slot is done
+    size_t bytes;
+    unsigned long serial; // order of the requests
+} ReadbackSlot;
+
+static ReadbackSlot gSlots[READBACK_RING_SIZE];
+static size_t gCapacity = 0;       // bytes per slot
+static int gHead = 0;              // slot written by the next request
+static int gPersistent = -1;       // -1 unknown, 0 map on demand, 1 persistent + coherent
+static int gMappedSlot = -1;       // slot mapped by readbackAcquire (map-on-demand path)
+static unsigned long gSerial = 0;
+static unsigned long gConsumed = 0;
+
+// glBufferStorage and persistent mappings need OpenGL 4.4
+static int persistentSupported(void) {
+    const GLubyte* versionStr = glGetString(GL_VERSION);
+    if (!versionStr) return 0;
+    int major = 0, minor = 0;
+    if (sscanf((const char*)versionStr, "%d.%d", &major, &minor) < 2) return 0;
+    return (major > 4) || (major == 4 && minor >= 4);
+}
+
+static int reserveRing(size_t bytes) {
+    if (bytes <= gCapacity && gSlots[0].buffer != 0) return 1;
+    readbackReset();
+    if (gPersistent < 0) gPersistent = persistentSupported();
+    size_t capacity = (size_t)1 << 20;
+    while (capacity < bytes) capacity *= 2;
+
+    GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    for (int s = 0; s < READBACK_RING_SIZE; s++) {
+        ReadbackSlot* slot = &gSlots[s];
+        glGenBuffers(1, &slot->buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, slot->buffer);
+        if (gPersistent) {
+            glBufferStorage(GL_COPY_WRITE_BUFFER, capacity, NULL, flags);
+            slot->mapped = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, capacity, flags);
+            if (slot->mapped == NULL) {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+                readbackReset();
+                gPersistent = 0; // try again without persistent mappings next time
+                return 0;
+            }
+        } else {
+            glBufferData(GL_COPY_WRITE_BUFFER, capacity, NULL, GL_STREAM_READ);
+        }
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    gCapacity = capacity;
+    return 1;
+}
+
+int readbackRequest(GLuint source, size_t bytes) {
+    if (source == 0 || bytes == 0) return 0;
+    readbackRelease();
+    if (!reserveRing(bytes)) return 0;
+
+    // The oldest slot is reused even if its copy is still pending: the GL
+    // orders both copies, and the CPU only reads a slot behind its fence
+    ReadbackSlot* slot = &gSlots[gHead];
+    if (slot->fence) glDeleteSync(slot->fence);
+    glBindBuffer(GL_COPY_READ_BUFFER, source);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, slot->buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, bytes);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    if (gPersistent) glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+    slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot->bytes = bytes;
+    slot->serial = ++gSerial;
+    gHead = (gHead + 1) % READBACK_RING_SIZE;
+    return 1;
+}
+
+const void* readbackAcquire(size_t* bytes) {
+    readbackRelease();
+    int best = -1;
+    for (int s = 0; s < READBACK_RING_SIZE; s++) {
+        ReadbackSlot* slot = &gSlots[s];
+        if (!slot->fence || slot->serial <= gConsumed) continue;
+        // Zero timeout: only polls (and flushes so the fence eventually signals)
+        GLenum state = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED) continue;
+        if (best < 0 || slot->serial > gSlots[best].serial) best = s;
+    }
+    if (best < 0) return NULL;
+
+    ReadbackSlot* slot = &gSlots[best];
+    gConsumed = slot->serial;
+    if (bytes) *bytes = slot->bytes;
+    if (gPersistent) return slot->mapped;
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, slot->buffer);
+    const void* ptr = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, slot->bytes, GL_MAP_READ_BIT);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    if (ptr) gMappedSlot = best;
+    return ptr;
+}
+
+void readbackRelease(void) {
+    if (gMappedSlot < 0) return;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, gSlots[gMappedSlot].buffer);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    gMappedSlot = -1;
+}
+
+void readbackReset(void) {
+    readbackRelease();
+    for (int s = 0; s < READBACK_RING_SIZE; s++) {
+        ReadbackSlot* slot = &gSlots[s];
+        if (slot->fence) glDeleteSync(slot->fence);
+        if (slot->buffer) {
+            if (slot->mapped) {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, slot->buffer);
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            }
+            glDeleteBuffers(1, &slot->buffer);
+        }
+        slot->buffer = 0;
+        slot->mapped = NULL;
+        slot->fence = NULL;
+        slot->bytes = 0;
+        slot->serial = 0;
+    }
+    gCapacity = 0;
+    gHead = 0;
+    gConsumed = gSerial;
+}
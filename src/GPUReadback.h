@@ -0,0 +1,23 @@
+#ifndef GPU_READBACK_H
+#define GPU_READBACK_H
+
+#include "compute.h"
+
+// Number of readback slots in flight. With three, the copy of tick N can
+// finish while tick N+1 computes and the CPU still reads tick N-1.
+#define READBACK_RING_SIZE 3
+
+// Queue a GPU-side copy of the first `bytes` of `source` into the next ring
+// slot, guarded by a fence. Never waits on the GPU unless every slot is
+// still in flight. Returns 0 on failure.
+int readbackRequest(GLuint source, size_t bytes);
+
+// Newest completed readback (NULL if none has finished yet). Does not block.
+// The pointer stays valid until readbackRelease or the next readbackRequest.
+const void* readbackAcquire(size_t* bytes);
+void readbackRelease(void);
+
+// Drop pending copies (e.g. after the source was replaced) and free the ring
+void readbackReset(void);
+
+#endif
@@ -0,0 +1,210 @@
+#include "GPUState.h"
+#include "GPUReadback.h"
+#include "Profiler.h"
+#include <string.h>
+
+static GLuint gProgram = 0;
+static GLuint gBuffers[2] = { 0, 0 }; // ping-pong: [gCurrent] holds the latest state
+static int gCurrent = 0;
+static int gCount = 0;
+static int gCapacity = 0;
+static GLuint gDiagnosticsProgram = 0;
+static GLuint gPartials = 0;        // four vec4 per workgroup of shader/Diagnostics.comp
+static int gPartialCapacity = 0;    // in workgroups
+
+// Grow both buffers, keeping the first gCount objects of the current one
+static int reserveState(int count) {
+    if (count <= gCapacity && gBuffers[0] != 0) return 1;
+    int newCap = gCapacity > 0 ? gCapacity : 1024;
+    while (newCap < count) newCap *= 2;
+
+    GLuint fresh[2];
+    glGenBuffers(2, fresh);
+    for (int b = 0; b < 2; b++) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, fresh[b]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GPUObject) * newCap, NULL, GL_DYNAMIC_COPY);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    if (gBuffers[gCurrent] != 0 && gCount > 0) {
+        glBindBuffer(GL_COPY_READ_BUFFER, gBuffers[gCurrent]);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, fresh[0]);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(GPUObject) * gCount);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    if (gBuffers[0] != 0) glDeleteBuffers(2, gBuffers);
+    gBuffers[0] = fresh[0];
+    gBuffers[1] = fresh[1];
+    gCurrent = 0;
+    gCapacity = newCap;
+    return 1;
+}
+
+int gpuStateUpload(const ObjectList* oList, int first) {
+    int n = oList->size;
+    if (first < 0 || first > gCount) first = 0;
+    // Pending readbacks would describe a different slot layout
+    if (first == 0) readbackReset();
+    if (!reserveState(n)) return 0;
+    if (n > first) {
+        GPUObject* staging = malloc(sizeof(GPUObject) * (n - first));
+        if (staging == NULL) return 0;
+        memset(staging, 0, sizeof(GPUObject) * (n - first));
+        for (int i = first; i < n; i++) {
+            GPUObject* o = &staging[i - first];
+            o->position[0] = oList->posX[i];
+            o->position[1] = oList->posY[i];
+            o->position[2] = oList->posZ[i];
+            o->velocity[0] = oList->velX[i];
+            o->velocity[1] = oList->velY[i];
+            o->velocity[2] = oList->velZ[i];
+            o->mass = oList->mass[i];
+            o->element = (float)elementIndex(oList->element[i]);
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gBuffers[gCurrent]);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(GPUObject) * first, sizeof(GPUObject) * (n - first), staging);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        free(staging);
+    }
+    gCount = n;
+    return 1;
+}
+
+int gpuStateStep(float deltaTime, float G) {
+    if (gCount == 0) return 1;
+    if (gProgram == 0) {
+        if (!computeAvailable()) return 0;
+        gProgram = createGravityComputeShader();
+        if (gProgram == 0) return 0;
+    }
+    glUseProgram(gProgram);
+    glUniform1f(glGetUniformLocation(gProgram, "deltaTime"), deltaTime);
+    glUniform1f(glGetUniformLocation(gProgram, "G"), G);
+    glUniform1i(glGetUniformLocation(gProgram, "numObjects"), gCount);
+    glUniform1f(glGetUniformLocation(gProgram, "softening"), 1.0f);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gBuffers[gCurrent]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gBuffers[1 - gCurrent]);
+    ProfileZone zone = profileGPUBegin("gravity.resident_step");
+    glDispatchCompute((gCount + 255) / 256, 1, 1);
+    // Next step and the renderer both read what was just written
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    profileGPUEnd(zone);
+    gCurrent = 1 - gCurrent;
+    return 1;
+}
+
+int gpuStateDownload(ObjectList* oList) {
+    int n = gCount < oList->size ? gCount : oList->size;
+    if (n == 0) return 1;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gBuffers[gCurrent]);
+    const GPUObject* ptr = (const GPUObject*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GPUObject) * n, GL_MAP_READ_BIT);
+    if (ptr == NULL) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        oList->posX[i] = ptr[i].position[0];
+        oList->posY[i] = ptr[i].position[1];
+        oList->posZ[i] = ptr[i].position[2];
+        oList->velX[i] = ptr[i].velocity[0];
+        oList->velY[i] = ptr[i].velocity[1];
+        oList->velZ[i] = ptr[i].velocity[2];
+    }
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return 1;
+}
+
+int gpuStateRequestReadback(void) {
+    if (gCount == 0) return 1;
+    return readbackRequest(gBuffers[gCurrent], sizeof(GPUObject) * gCount);
+}
+
+int gpuStatePoll(ObjectList* oList) {
+    size_t bytes = 0;
+    const GPUObject* ptr = (const GPUObject*)readbackAcquire(&bytes);
+    if (ptr == NULL) return 0;
+    int n = (int)(bytes / sizeof(GPUObject));
+    if (n > oList->size) n = oList->size;
+    for (int i = 0; i < n; i++) {
+        oList->posX[i] = ptr[i].position[0];
+        oList->posY[i] = ptr[i].position[1];
+        oList->posZ[i] = ptr[i].position[2];
+        oList->velX[i] = ptr[i].velocity[0];
+        oList->velY[i] = ptr[i].velocity[1];
+        oList->velZ[i] = ptr[i].velocity[2];
+    }
+    readbackRelease();
+    return 1;
+}
+
+int gpuStateDiagnostics(float G, Diagnostics* out) {
+    if (gCount == 0) return 0;
+    int groups = (gCount + 255) / 256;
+    if (gDiagnosticsProgram == 0) {
+        gDiagnosticsProgram = createComputeProgram("shader/Diagnostics.comp");
+        if (gDiagnosticsProgram == 0) return 0;
+    }
+    if (groups > gPartialCapacity) {
+        if (gPartials == 0) glGenBuffers(1, &gPartials);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gPartials);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(float) * 16 * groups, NULL, GL_DYNAMIC_READ);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        gPartialCapacity = groups;
+    }
+    float* partials = malloc(sizeof(float) * 16 * groups);
+    if (partials == NULL) return 0;
+
+    glUseProgram(gDiagnosticsProgram);
+    glUniform1f(glGetUniformLocation(gDiagnosticsProgram, "G"), G);
+    glUniform1i(glGetUniformLocation(gDiagnosticsProgram, "numObjects"), gCount);
+    glUniform1f(glGetUniformLocation(gDiagnosticsProgram, "softening"), 1.0f);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gBuffers[gCurrent]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gPartials);
+    ProfileZone zone = profileGPUBegin("diagnostics.reduce");
+    glDispatchCompute(groups, 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    profileGPUEnd(zone);
+
+    // Synchronous: only runs every few ticks, and the partials are small
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gPartials);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(float) * 16 * groups, partials);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    double sums[16] = { 0.0 };
+    for (int g = 0; g < groups; g++) {
+        for (int k = 0; k < 16; k++) sums[k] += partials[16 * g + k];
+    }
+    free(partials);
+    out->particles = gCount;
+    out->mass = sums[0];
+    out->kinetic = sums[1];
+    out->potential = sums[2];
+    for (int k = 0; k < 3; k++) {
+        out->momentum[k] = sums[4 + k];
+        out->angularMomentum[k] = sums[8 + k];
+        out->centreOfMass[k] = sums[0] > 0.0 ? sums[12 + k] / sums[0] : 0.0;
+    }
+    return 1;
+}
+
+int gpuStateCount(void) {
+    return gCount;
+}
+
+GLuint gpuStateBuffer(void) {
+    return gBuffers[gCurrent];
+}
+
+void gpuStateRelease(void) {
+    readbackReset();
+    if (gBuffers[0] != 0) glDeleteBuffers(2, gBuffers);
+    if (gProgram != 0) glDeleteProgram(gProgram);
+    if (gDiagnosticsProgram != 0) glDeleteProgram(gDiagnosticsProgram);
+    if (gPartials != 0) glDeleteBuffers(1, &gPartials);
+    gBuffers[0] = gBuffers[1] = 0;
+    gProgram = gDiagnosticsProgram = gPartials = 0;
+    gPartialCapacity = 0;
+    gCurrent = gCount = gCapacity = 0;
+}
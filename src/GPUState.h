@@ -0,0 +1,43 @@
+#ifndef GPU_STATE_H
+#define GPU_STATE_H
+
+#include "particle.h"
+#include "Diagnostics.h"
+
+// GPU-resident particle state: the SSBOs are the source of truth between
+// ticks and the ObjectList is only brought up to date on demand. Uses nothing
+// beyond OpenGL 4.3 core (compute shaders + SSBOs), so it also runs on Mesa's
+// llvmpipe. GPUObject slot i always matches ObjectList slot i.
+
+// Upload slots [first, objList->size) and make the GPU copy `size` long.
+// first == 0 replaces the whole GPU state. Returns 0 on failure.
+int gpuStateUpload(const ObjectList* objList, int first);
+
+// One all-pairs gravity step (shader/gravitation.comp) on the resident buffers
+int gpuStateStep(float deltaTime, float G);
+
+// Copy positions and velocities of all resident particles back into objList.
+// Synchronous: waits for every queued step.
+int gpuStateDownload(ObjectList* objList);
+
+// Asynchronous readback: queue a copy of the current state after a step,
+// then poll later. gpuStatePoll copies the newest finished copy (usually one
+// tick old) into objList and returns 1, or returns 0 without waiting.
+int gpuStateRequestReadback(void);
+int gpuStatePoll(ObjectList* objList);
+
+// Energies, momenta and centre of mass of the resident state, reduced on the
+// GPU (shader/Diagnostics.comp, direct-sum potential) and summed per workgroup
+// in double. Waits for the queued steps. Leaves energy and energyError alone;
+// 0 when nothing is resident or the shader is unavailable.
+int gpuStateDiagnostics(float G, Diagnostics* out);
+
+// Number of particles currently held on the GPU (0 when not resident)
+int gpuStateCount(void);
+
+// SSBO with the latest GPUObject array, for rendering straight from the GPU
+GLuint gpuStateBuffer(void);
+
+void gpuStateRelease(void);
+
+#endif
@@ -1,90 +1,832 @@
 #include "GridSystem.h"
+#include "particle.h"
+#include "JobSystem.h"
+#include <string.h>
 
+// Extra room added on every side when the bounds have to grow, as a fraction of the extent
+#define GRID_GROW_MARGIN 0.25f
 
-Grid* getGrid(ObjectList* objList, float cellSize) {
-	if (!objList || objList->size == 0) return NULL;
+// Smallest number of objects (or cells) worth a job of their own
+#define GRID_JOB_GRAIN 2048
+
+// Per-thread histograms are only used while they stay small relative to the object count
+#define GRID_HISTOGRAM_BUDGET(objects) (8 * (objects) + 65536)
+
+// Cell changes moved in place instead of sorting everything again (dense mode)
+#define GRID_INCREMENTAL_LIMIT(objects) ((objects) / 16 + 64)
+
+// Largest dense grid (in cells) before switching to sparse storage
+#define GRID_DENSE_CELL_LIMIT(objects) (4 * (objects) + 65536)
+
+// Offset that maps signed cell coordinates into the unsigned key range
+#define GRID_KEY_BIAS (1 << (GRID_KEY_BITS - 1))
+
+
+static long denseCellCount(const Grid* grid) {
+	return (long)grid->gridSize.x * (long)grid->gridSize.y * (long)grid->gridSize.z;
+}
+
+int gridCellCount(const Grid* grid) {
+	return grid->sparse ? grid->occupiedCount : (int)denseCellCount(grid);
+}
+
+// Spread the low 21 bits of v so there are two zero bits between each of them
+static inline uint64_t spreadBits3(uint64_t v) {
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffULL;
+	v = (v | v << 16) & 0x1f0000ff0000ffULL;
+	v = (v | v << 8) & 0x100f00f00f00f00fULL;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+	v = (v | v << 2) & 0x1249249249249249ULL;
+	return v;
+}
+
+static inline uint64_t mortonKey(int cx, int cy, int cz) {
+	const int maxCoord = (1 << GRID_KEY_BITS) - 1;
+	cx += GRID_KEY_BIAS;
+	cy += GRID_KEY_BIAS;
+	cz += GRID_KEY_BIAS;
+	cx = cx < 0 ? 0 : (cx > maxCoord ? maxCoord : cx);
+	cy = cy < 0 ? 0 : (cy > maxCoord ? maxCoord : cy);
+	cz = cz < 0 ? 0 : (cz > maxCoord ? maxCoord : cz);
+	return spreadBits3((uint64_t)cx) | spreadBits3((uint64_t)cy) << 1 | spreadBits3((uint64_t)cz) << 2;
+}
+
+// Key of the cell with integer coordinates (cx, cy, cz) = floor(position / cellSize)
+uint64_t gridCellKey(const Grid* grid, int cx, int cy, int cz) {
+	(void)grid;
+	return mortonKey(cx, cy, cz);
+}
+
+uint64_t gridMortonKey(int cx, int cy, int cz) {
+	return mortonKey(cx, cy, cz);
+}
+
+// Index into grid->cells of the occupied cell with the given key, or -1 (sparse mode)
+int gridFindCell(const Grid* grid, uint64_t key) {
+	int lo = 0, hi = grid->occupiedCount - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) >> 1;
+		uint64_t k = grid->cellKeys[mid];
+		if (k == key) return mid;
+		if (k < key) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return -1;
+}
+
+// Cell index of a position, or -1 if it lies outside the grid bounds
+static inline int cellIndexAt(const Grid* grid, float x, float y, float z) {
+	int nx = (int)grid->gridSize.x, ny = (int)grid->gridSize.y, nz = (int)grid->gridSize.z;
+	int cx = (int)floorf((x - grid->origin.x) / grid->cellSize);
+	int cy = (int)floorf((y - grid->origin.y) / grid->cellSize);
+	int cz = (int)floorf((z - grid->origin.z) / grid->cellSize);
+	if (cx < 0 || cy < 0 || cz < 0 || cx >= nx || cy >= ny || cz >= nz) return -1;
+	return cx + nx * (cy + ny * cz);
+}
+
+static int reserveObjects(Grid* grid, int count) {
+	if (count <= grid->objectCapacity) return 1;
+	int newCap = grid->objectCapacity == 0 ? 1024 : grid->objectCapacity;
+	while (newCap < count) newCap *= 2;
+	unsigned int* objIndices = realloc(grid->objIndices, newCap * sizeof(unsigned int));
+	if (objIndices) grid->objIndices = objIndices;
+	int* cellOf = realloc(grid->cellOf, newCap * sizeof(int));
+	if (cellOf) grid->cellOf = cellOf;
+	float* bodies = realloc(grid->bodies, newCap * 4 * sizeof(float));
+	if (bodies) grid->bodies = bodies;
+	int* slotOf = realloc(grid->slotOf, newCap * sizeof(int));
+	if (slotOf) grid->slotOf = slotOf;
+	int* moved = realloc(grid->moved, newCap * 2 * sizeof(int));
+	if (moved) grid->moved = moved;
+	if (!objIndices || !cellOf || !bodies || !slotOf || !moved) return 0;
+	if (grid->sparse) {
+		// One occupied cell per object at most
+		GPUGridCell* cells = realloc(grid->cells, newCap * sizeof(GPUGridCell));
+		if (cells) grid->cells = cells;
+		uint64_t* cellKeys = realloc(grid->cellKeys, newCap * sizeof(uint64_t));
+		if (cellKeys) grid->cellKeys = cellKeys;
+		uint64_t* objKeys = realloc(grid->objKeys, newCap * sizeof(uint64_t));
+		if (objKeys) grid->objKeys = objKeys;
+		uint64_t* sortKeys = realloc(grid->sortKeys, newCap * sizeof(uint64_t));
+		if (sortKeys) grid->sortKeys = sortKeys;
+		unsigned int* sortIndices = realloc(grid->sortIndices, newCap * sizeof(unsigned int));
+		if (sortIndices) grid->sortIndices = sortIndices;
+		if (!cells || !cellKeys || !objKeys || !sortKeys || !sortIndices) return 0;
+		grid->cellCapacity = newCap;
+	}
+	grid->objectCapacity = newCap;
+	return 1;
+}
+
+// Fit the bounds around all objects. When the grid already has bounds they are
+// only ever grown, with some headroom so the next escapes do not trigger this again.
+static int fitBounds(Grid* grid, ObjectList* objList) {
+	const float* px = objList->posX;
+	const float* py = objList->posY;
+	const float* pz = objList->posZ;
+	int n = objList->size;
 
 	// Find bounds
-	Vector3 min = objList->gObjs[0]->position;
-	Vector3 max = objList->gObjs[0]->position;
-	for (int i = 1; i < objList->size; i++) {
-		Vector3 p = objList->gObjs[i]->position;
-		if (p.x < min.x) min.x = p.x;
-		if (p.y < min.y) min.y = p.y;
-		if (p.z < min.z) min.z = p.z;
-		if (p.x > max.x) max.x = p.x;
-		if (p.y > max.y) max.y = p.y;
-		if (p.z > max.z) max.z = p.z;
+	Vector3 min = { px[0], py[0], pz[0] };
+	Vector3 max = min;
+	for (int i = 1; i < n; i++) {
+		if (px[i] < min.x) min.x = px[i];
+		if (py[i] < min.y) min.y = py[i];
+		if (pz[i] < min.z) min.z = pz[i];
+		if (px[i] > max.x) max.x = px[i];
+		if (py[i] > max.y) max.y = py[i];
+		if (pz[i] > max.z) max.z = pz[i];
+	}
+	if (denseCellCount(grid) > 0) {
+		Vector3 oldMax = {
+			grid->origin.x + grid->gridSize.x * grid->cellSize,
+			grid->origin.y + grid->gridSize.y * grid->cellSize,
+			grid->origin.z + grid->gridSize.z * grid->cellSize
+		};
+		min = (Vector3){ fminf(min.x, grid->origin.x), fminf(min.y, grid->origin.y), fminf(min.z, grid->origin.z) };
+		max = (Vector3){ fmaxf(max.x, oldMax.x), fmaxf(max.y, oldMax.y), fmaxf(max.z, oldMax.z) };
+		Vector3 extent = Vector3Subtract(max, min);
+		min = Vector3Subtract(min, Vector3Scale(extent, GRID_GROW_MARGIN));
+		max = Vector3Add(max, Vector3Scale(extent, GRID_GROW_MARGIN));
 	}
 
+	float cellSize = grid->cellSize;
 	int nx = (int)((max.x - min.x) / cellSize + 1);
 	int ny = (int)((max.y - min.y) / cellSize + 1);
 	int nz = (int)((max.z - min.z) / cellSize + 1);
-
-	// Allocate grid and a count array for averaging
-	Grid* grid = (Grid*)malloc(sizeof(Grid));
+	long denseCount = (long)nx * ny * nz;
+	if (denseCount > GRID_DENSE_CELL_LIMIT((long)n)) {
+		// Mostly empty volume: store occupied cells only from now on. Sparse
+		// cell coordinates are absolute, i.e. relative to a zero origin.
+		grid->sparse = 1;
+		grid->origin = (Vector3){0, 0, 0};
+		grid->objectCount = 0;
+		return 1;
+	}
+	int cellCount = (int)denseCount;
+	if (cellCount > grid->cellCapacity) {
+		GPUGridCell* cells = (GPUGridCell*)realloc(grid->cells, cellCount * sizeof(GPUGridCell));
+		if (cells == NULL) return 0;
+		grid->cells = cells;
+		grid->cellCapacity = cellCount;
+	}
+	grid->origin = min;
 	grid->gridSize = (Vector3){nx, ny, nz};
-	grid->cellSize = cellSize;
-	int cellCount = nx * ny * nz;
-	grid->cells = (Cell*)calloc(cellCount, sizeof(Cell));
-	int* counts = (int*)calloc(cellCount, sizeof(int));
-	// Initialize object arrays for each cell
-	for (int i = 0; i < cellCount; i++) {
-		grid->cells[i].objects = NULL;
-		grid->cells[i].objectCount = 0;
-		grid->cells[i].objectCapacity = 0;
-	}
-
-	// Place objects in grid, accumulate mass and position
-	for (int i = 0; i < objList->size; i++) {
-		GravitationalObject* obj = objList->gObjs[i];
-		int x = (int)((obj->position.x - min.x) / cellSize);
-		int y = (int)((obj->position.y - min.y) / cellSize);
-		int z = (int)((obj->position.z - min.z) / cellSize);
-		int idx = x + nx * (y + ny * z);
-		Cell* cell = &grid->cells[idx];
-		cell->mass += obj->element;
-		cell->center.x += obj->position.x;
-		cell->center.y += obj->position.y;
-		cell->center.z += obj->position.z;
-		counts[idx]++;
-		// Add object pointer to cell's object array
-		if (cell->objectCount >= cell->objectCapacity) {
-			int newCap = cell->objectCapacity == 0 ? 4 : cell->objectCapacity * 2;
-			cell->objects = (GravitationalObject**)realloc(cell->objects, newCap * sizeof(GravitationalObject*));
-			cell->objectCapacity = newCap;
-		}
-		cell->objects[cell->objectCount++] = obj;
-	}
-
-	// Average the center for each cell
-	for (int i = 0; i < cellCount; i++) {
-		if (counts[i] > 0) {
-			grid->cells[i].center.x /= counts[i];
-			grid->cells[i].center.y /= counts[i];
-			grid->cells[i].center.z /= counts[i];
-		}
-	}
-	free(counts);
+	grid->objectCount = 0; // every object has to be filed again
+	for (int c = 0; c < cellCount; c++) {
+		grid->cells[c].coord[0] = c % nx;
+		grid->cells[c].coord[1] = (c / nx) % ny;
+		grid->cells[c].coord[2] = c / (nx * ny);
+		grid->cells[c].neighbourStart = 0;
+		grid->cells[c].neighbourCount = 0;
+	}
+	return 1;
+}
 
+// Shared state of the per-object passes run as jobs
+typedef struct ObjectPass {
+	Grid* grid;
+	const ObjectList* objList;
+	int known;             // objects filed at the last update
+	volatile int changed;  // objects that moved to another cell
+	volatile int outside;  // objects outside the bounds
+	volatile int recorded; // entries in grid->movedObjects
+	int recordLimit;
+} ObjectPass;
+
+static void assignCellsRange(void* data, int begin, int end) {
+	ObjectPass* pass = data;
+	Grid* grid = pass->grid;
+	const float* px = pass->objList->posX;
+	const float* py = pass->objList->posY;
+	const float* pz = pass->objList->posZ;
+	int changed = 0, outside = 0;
+	for (int i = begin; i < end; i++) {
+		int idx = cellIndexAt(grid, px[i], py[i], pz[i]);
+		outside |= idx < 0;
+		if (i < pass->known && grid->cellOf[i] != idx) {
+			changed++;
+			// Note the first few for moveChangedObjects; past the limit only count
+			if (jobAtomicAdd(&pass->recorded, 0) < pass->recordLimit) {
+				int k = jobAtomicAdd(&pass->recorded, 1);
+				if (k < pass->recordLimit) {
+					grid->moved[2 * k] = i;
+					grid->moved[2 * k + 1] = grid->cellOf[i];
+				}
+			}
+		}
+		grid->cellOf[i] = idx;
+	}
+	if (changed) jobAtomicAdd(&pass->changed, changed);
+	if (outside) jobAtomicAdd(&pass->outside, 1);
+}
+
+// Pass 1: cell of every object. Returns the number of objects whose cell
+// changed, or -1 if some object lies outside the bounds.
+static int assignCells(Grid* grid, ObjectList* objList) {
+	int n = objList->size;
+	int known = grid->objectCount == n ? n : 0;
+	ObjectPass pass = { grid, objList, known, n - known, 0, 0, GRID_INCREMENTAL_LIMIT(n) };
+	jobParallelFor(n, GRID_JOB_GRAIN, assignCellsRange, &pass);
+	grid->movedCount = pass.recorded < pass.recordLimit ? pass.recorded : pass.recordLimit;
+	return pass.outside ? -1 : pass.changed;
+}
+
+// Counting sort split into `slices` contiguous object ranges, one histogram each
+typedef struct SortPass {
+	Grid* grid;
+	int n;
+	int slices;
+	int cellCount;
+} SortPass;
+
+static void histogramSlices(void* data, int begin, int end) {
+	SortPass* pass = data;
+	for (int t = begin; t < end; t++) {
+		int first = (int)((long)pass->n * t / pass->slices);
+		int last = (int)((long)pass->n * (t + 1) / pass->slices);
+		int* row = pass->grid->histogram + (long)t * pass->cellCount;
+		const int* cellOf = pass->grid->cellOf;
+		memset(row, 0, pass->cellCount * sizeof(int));
+		for (int i = first; i < last; i++) row[cellOf[i]]++;
+	}
+}
+
+static void scatterSlices(void* data, int begin, int end) {
+	SortPass* pass = data;
+	for (int t = begin; t < end; t++) {
+		int first = (int)((long)pass->n * t / pass->slices);
+		int last = (int)((long)pass->n * (t + 1) / pass->slices);
+		int* row = pass->grid->histogram + (long)t * pass->cellCount;
+		const int* cellOf = pass->grid->cellOf;
+		for (int i = first; i < last; i++) {
+			int slot = row[cellOf[i]]++;
+			pass->grid->objIndices[slot] = (unsigned int)i;
+			pass->grid->slotOf[i] = slot;
+		}
+	}
+}
+
+// Pass 2: per-slice histograms, prefix sum and a stable scatter into objIndices
+static int sortByCell(Grid* grid, int n) {
+	int cellCount = gridCellCount(grid);
+	int threads = jobWorkerCount();
+	long budget = GRID_HISTOGRAM_BUDGET((long)n);
+	if ((long)threads * cellCount > budget) threads = (int)(budget / cellCount);
+	if (threads < 1) threads = 1;
+	long histSize = (long)threads * cellCount;
+	if (histSize > grid->histogramCapacity) {
+		int* hist = realloc(grid->histogram, histSize * sizeof(int));
+		if (hist == NULL) return 0;
+		grid->histogram = hist;
+		grid->histogramCapacity = (int)histSize;
+	}
+	int* hist = grid->histogram;
+	SortPass pass = { grid, n, threads, cellCount };
+	jobParallelFor(threads, 1, histogramSlices, &pass);
+
+	// Each slice's run inside a cell follows the previous slice's run
+	unsigned int running = 0;
+	for (int c = 0; c < cellCount; c++) {
+		grid->cells[c].objectStart = running;
+		for (int k = 0; k < threads; k++) {
+			int count = hist[(long)k * cellCount + c];
+			hist[(long)k * cellCount + c] = (int)running;
+			running += count;
+		}
+		grid->cells[c].objectCount = running - grid->cells[c].objectStart;
+	}
+
+	jobParallelFor(threads, 1, scatterSlices, &pass);
+	return 1;
+}
+
+typedef struct AccumulatePass {
+	Grid* grid;
+	const ObjectList* objList;
+	const unsigned int* cells; // cells to refresh, NULL = all of them
+} AccumulatePass;
+
+static void accumulateCellRange(void* data, int begin, int end) {
+	AccumulatePass* pass = data;
+	Grid* grid = pass->grid;
+	const float* px = pass->objList->posX;
+	const float* py = pass->objList->posY;
+	const float* pz = pass->objList->posZ;
+	const float* pm = pass->objList->mass;
+	for (int t = begin; t < end; t++) {
+		GPUGridCell* cell = &grid->cells[pass->cells ? pass->cells[t] : (unsigned int)t];
+		unsigned int end = cell->objectStart + cell->objectCount;
+		float m = 0.0f, mx = 0.0f, my = 0.0f, mz = 0.0f;
+		for (unsigned int k = cell->objectStart; k < end; k++) {
+			unsigned int i = grid->objIndices[k];
+			float* body = &grid->bodies[4 * k];
+			body[0] = px[i];
+			body[1] = py[i];
+			body[2] = pz[i];
+			body[3] = pm[i];
+			m += pm[i];
+			mx += pm[i] * px[i];
+			my += pm[i] * py[i];
+			mz += pm[i] * pz[i];
+		}
+		float inv = m > 0.0f ? 1.0f / m : 0.0f;
+		cell->center[0] = mx * inv;
+		cell->center[1] = my * inv;
+		cell->center[2] = mz * inv;
+		cell->mass = m;
+	}
+}
+
+// Pass 3: mass and centre of mass of every cell from its sorted object range.
+// Also gathers the objects into the cell-sorted bodies array. With
+// occupiedOnly (dense mode, tree current) the empty cells are skipped: their
+// sums were cleared when they emptied. Every position changes every tick, so
+// the occupied cells are summed again rather than adjusted by deltas; the
+// bodies array has to be gathered anyway.
+static void accumulateCells(Grid* grid, ObjectList* objList, int occupiedOnly) {
+	AccumulatePass pass = { grid, objList, NULL };
+	int count = gridCellCount(grid);
+	if (occupiedOnly && !grid->sparse && grid->nodeCount > 0) {
+		pass.cells = grid->treeCells;
+		count = grid->treeCellCount;
+	}
+	jobParallelFor(count, GRID_JOB_GRAIN, accumulateCellRange, &pass);
+}
+
+// Swap the objects at two positions of the cell-sorted order
+static inline void swapSlots(Grid* grid, int a, int b) {
+	unsigned int ia = grid->objIndices[a], ib = grid->objIndices[b];
+	grid->objIndices[a] = ib;
+	grid->objIndices[b] = ia;
+	grid->slotOf[ib] = a;
+	grid->slotOf[ia] = b;
+}
+
+// Move object i from cell `from` to cell `to`, keeping every cell's range
+// contiguous: it leaves through the near end of its range and passes every
+// cell in between by swapping with that cell's far end, shifting it by one.
+static void moveObject(Grid* grid, int i, int from, int to) {
+	GPUGridCell* cells = grid->cells;
+	if (to > from) {
+		swapSlots(grid, grid->slotOf[i], (int)(cells[from].objectStart + cells[from].objectCount - 1));
+		cells[from].objectCount--;
+		for (int c = from + 1; c < to; c++) {
+			// i sits just before c's range
+			if (cells[c].objectCount > 0) swapSlots(grid, (int)cells[c].objectStart - 1, (int)(cells[c].objectStart + cells[c].objectCount - 1));
+			cells[c].objectStart--;
+		}
+		cells[to].objectStart--;
+	} else {
+		swapSlots(grid, grid->slotOf[i], (int)cells[from].objectStart);
+		cells[from].objectStart++;
+		cells[from].objectCount--;
+		for (int c = from - 1; c > to; c--) {
+			// i sits just after c's range
+			if (cells[c].objectCount > 0) swapSlots(grid, (int)(cells[c].objectStart + cells[c].objectCount), (int)cells[c].objectStart);
+			cells[c].objectStart++;
+		}
+	}
+	cells[to].objectCount++;
+}
+
+static int compareMoves(const void* a, const void* b) {
+	return *(const int*)a - *(const int*)b;
+}
+
+// Dense mode: apply the few recorded cell changes to the sorted order in
+// place instead of sorting again. Returns 0 when they were not all recorded
+// or walking them would cost more than a sort; *occupancyChanged is set when
+// a cell emptied or filled, so the cell tree and neighbour lists are stale.
+static int moveChangedObjects(Grid* grid, int changed, int* occupancyChanged) {
+	int moved = grid->movedCount;
+	if (moved != changed || grid->nodeCount == 0) return 0;
+	long steps = 0, budget = (long)grid->objectCount + gridCellCount(grid);
+	for (int k = 0; k < moved; k++) {
+		steps += labs((long)grid->cellOf[grid->moved[2 * k]] - grid->moved[2 * k + 1]);
+		if (steps > budget) return 0;
+	}
+	// Object order, so the layout does not depend on the thread timing
+	qsort(grid->moved, moved, 2 * sizeof(int), compareMoves);
+	*occupancyChanged = 0;
+	for (int k = 0; k < moved; k++) {
+		int i = grid->moved[2 * k], from = grid->moved[2 * k + 1], to = grid->cellOf[i];
+		moveObject(grid, i, from, to);
+		GPUGridCell* left = &grid->cells[from];
+		if (left->objectCount == 0) {
+			// Skipped by accumulateCells from now on
+			left->mass = 0.0f;
+			left->center[0] = left->center[1] = left->center[2] = 0.0f;
+			*occupancyChanged = 1;
+		}
+		if (grid->cells[to].objectCount == 1) *occupancyChanged = 1;
+	}
+	return 1;
+}
+
+static void assignKeysRange(void* data, int begin, int end) {
+	ObjectPass* pass = data;
+	Grid* grid = pass->grid;
+	const float* px = pass->objList->posX;
+	const float* py = pass->objList->posY;
+	const float* pz = pass->objList->posZ;
+	float inv = 1.0f / grid->cellSize;
+	int changed = 0;
+	for (int i = begin; i < end; i++) {
+		uint64_t key = mortonKey((int)floorf(px[i] * inv), (int)floorf(py[i] * inv), (int)floorf(pz[i] * inv));
+		if (i < pass->known && grid->objKeys[i] != key) changed++;
+		grid->objKeys[i] = key;
+	}
+	if (changed) jobAtomicAdd(&pass->changed, changed);
+}
+
+// Sparse pass 1: Morton key of every object. Returns the number of objects whose key changed.
+static int assignKeys(Grid* grid, ObjectList* objList) {
+	int n = objList->size;
+	int known = grid->objectCount == n ? n : 0;
+	ObjectPass pass = { grid, objList, known, n - known, 0, 0, 0 };
+	jobParallelFor(n, GRID_JOB_GRAIN, assignKeysRange, &pass);
+	return pass.changed;
+}
+
+// LSD radix sort of (key, value) pairs over the low `bits` key bits, 8 bits per
+// pass. Passes in which every key has the same digit are skipped. The result
+// is left in keys/values; keysTmp/valuesTmp are scratch of the same size.
+static void radixSortPairs(uint64_t* keys, unsigned int* values, uint64_t* keysTmp, unsigned int* valuesTmp, int n, int bits) {
+	uint64_t* srcK = keys;
+	unsigned int* srcV = values;
+	uint64_t* dstK = keysTmp;
+	unsigned int* dstV = valuesTmp;
+	if (n <= 1) return;
+	for (int shift = 0; shift < bits; shift += 8) {
+		int count[256] = {0};
+		for (int i = 0; i < n; i++) count[(srcK[i] >> shift) & 0xff]++;
+		if (count[(srcK[0] >> shift) & 0xff] == n) continue;
+		int offset = 0;
+		for (int d = 0; d < 256; d++) {
+			int c = count[d];
+			count[d] = offset;
+			offset += c;
+		}
+		for (int i = 0; i < n; i++) {
+			int dst = count[(srcK[i] >> shift) & 0xff]++;
+			dstK[dst] = srcK[i];
+			dstV[dst] = srcV[i];
+		}
+		uint64_t* kSwap = srcK; srcK = dstK; dstK = kSwap;
+		unsigned int* vSwap = srcV; srcV = dstV; dstV = vSwap;
+	}
+	if (srcK != keys) {
+		memcpy(keys, srcK, n * sizeof(uint64_t));
+		memcpy(values, srcV, n * sizeof(unsigned int));
+	}
+}
+
+void gridSortPairs(uint64_t* keys, unsigned int* values, uint64_t* keysTmp, unsigned int* valuesTmp, int n, int bits) {
+	radixSortPairs(keys, values, keysTmp, valuesTmp, n, bits);
+}
+
+// Sparse pass 2: order the objects by key
+static void sortByKey(Grid* grid, int n) {
+	for (int i = 0; i < n; i++) {
+		grid->sortKeys[i] = grid->objKeys[i];
+		grid->objIndices[i] = (unsigned int)i;
+	}
+	// cellKeys is free as scratch until the cells are rebuilt
+	radixSortPairs(grid->sortKeys, grid->objIndices, grid->cellKeys, grid->sortIndices, n, 3 * GRID_KEY_BITS);
+}
+
+// Recover the (biased) cell coordinate of one axis from a Morton key
+static inline int compactBits3(uint64_t v) {
+	v &= 0x1249249249249249ULL;
+	v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3ULL;
+	v = (v ^ (v >> 4)) & 0x100f00f00f00f00fULL;
+	v = (v ^ (v >> 8)) & 0x1f0000ff0000ffULL;
+	v = (v ^ (v >> 16)) & 0x1f00000000ffffULL;
+	v = (v ^ (v >> 32)) & 0x1fffff;
+	return (int)v;
+}
+
+// Sparse pass 3: one cell per run of equal keys
+static void buildOccupiedCells(Grid* grid, int n) {
+	const uint64_t* keys = grid->sortKeys;
+	int cellCount = 0;
+	for (int k = 0; k < n; k++) {
+		if (k == 0 || keys[k] != keys[k - 1]) {
+			GPUGridCell* cell = &grid->cells[cellCount];
+			grid->cellKeys[cellCount] = keys[k];
+			cell->coord[0] = compactBits3(keys[k]) - GRID_KEY_BIAS;
+			cell->coord[1] = compactBits3(keys[k] >> 1) - GRID_KEY_BIAS;
+			cell->coord[2] = compactBits3(keys[k] >> 2) - GRID_KEY_BIAS;
+			cell->objectStart = (unsigned int)k;
+			cell->objectCount = 0;
+			cell->neighbourStart = 0;
+			cell->neighbourCount = 0;
+			cellCount++;
+		}
+		grid->cells[cellCount - 1].objectCount++;
+		grid->cellOf[grid->objIndices[k]] = cellCount - 1;
+	}
+	grid->occupiedCount = cellCount;
+}
+
+static int reserveTree(Grid* grid, int cellCount) {
+	int nodes = 2 * cellCount;
+	if (nodes > grid->nodeCapacity) {
+		GPUCellNode* n = realloc(grid->nodes, nodes * sizeof(GPUCellNode));
+		if (n == NULL) return 0;
+		grid->nodes = n;
+		grid->nodeCapacity = nodes;
+	}
+	if (!grid->sparse && cellCount > grid->treeCapacity) {
+		uint64_t* keys = realloc(grid->treeKeys, cellCount * sizeof(uint64_t));
+		if (keys) grid->treeKeys = keys;
+		unsigned int* cells = realloc(grid->treeCells, cellCount * sizeof(unsigned int));
+		if (cells) grid->treeCells = cells;
+		uint64_t* keysTmp = realloc(grid->treeKeysTmp, cellCount * sizeof(uint64_t));
+		if (keysTmp) grid->treeKeysTmp = keysTmp;
+		unsigned int* cellsTmp = realloc(grid->treeCellsTmp, cellCount * sizeof(unsigned int));
+		if (cellsTmp) grid->treeCellsTmp = cellsTmp;
+		if (!keys || !cells || !keysTmp || !cellsTmp) return 0;
+		grid->treeCapacity = cellCount;
+	}
+	return 1;
+}
+
+// Depth-first node for the occupied cells [begin, end) of the key-sorted list
+static int buildTreeNode(Grid* grid, const uint64_t* keys, const unsigned int* cells, int begin, int end) {
+	int nodeIdx = grid->nodeCount++;
+	GPUCellNode* node = &grid->nodes[nodeIdx];
+	if (end - begin == 1) {
+		uint64_t key = keys[begin];
+		node->minCell[0] = compactBits3(key) - GRID_KEY_BIAS;
+		node->minCell[1] = compactBits3(key >> 1) - GRID_KEY_BIAS;
+		node->minCell[2] = compactBits3(key >> 2) - GRID_KEY_BIAS;
+		node->level = 0;
+		node->cell = cells ? cells[begin] : (unsigned int)begin;
+		node->next = (unsigned int)grid->nodeCount;
+		return nodeIdx;
+	}
+	// Highest octree level at which the keys of the range still differ
+	uint64_t diff = keys[begin] ^ keys[end - 1];
+	int topBit = 63;
+	while (!(diff >> topBit)) topBit--;
+	int digit = topBit / 3;
+	uint64_t prefix = keys[begin] & ~((1ULL << (3 * (digit + 1))) - 1);
+	node->minCell[0] = compactBits3(prefix) - GRID_KEY_BIAS;
+	node->minCell[1] = compactBits3(prefix >> 1) - GRID_KEY_BIAS;
+	node->minCell[2] = compactBits3(prefix >> 2) - GRID_KEY_BIAS;
+	node->level = (unsigned int)(digit + 1);
+	node->cell = GRID_NO_CELL;
+
+	// Children are the runs of equal digits; the first one follows this node directly
+	int childBegin = begin;
+	while (childBegin < end) {
+		uint64_t childDigit = (keys[childBegin] >> (3 * digit)) & 7;
+		int childEnd = childBegin + 1;
+		while (childEnd < end && ((keys[childEnd] >> (3 * digit)) & 7) == childDigit) childEnd++;
+		buildTreeNode(grid, keys, cells, childBegin, childEnd);
+		childBegin = childEnd;
+	}
+	grid->nodes[nodeIdx].next = (unsigned int)grid->nodeCount;
+	return nodeIdx;
+}
+
+// Rebuild the octree topology over the occupied cells
+static void buildCellTree(Grid* grid) {
+	const uint64_t* keys;
+	const unsigned int* cells;
+	int count;
+	if (grid->sparse) {
+		// Occupied cells are already sorted by key
+		count = grid->occupiedCount;
+		if (!reserveTree(grid, count)) { grid->nodeCount = 0; return; }
+		keys = grid->cellKeys;
+		cells = NULL;
+	} else {
+		int nx = (int)grid->gridSize.x, ny = (int)grid->gridSize.y;
+		int cellCount = (int)denseCellCount(grid);
+		count = 0;
+		for (int c = 0; c < cellCount; c++) {
+			if (grid->cells[c].objectCount > 0) count++;
+		}
+		if (!reserveTree(grid, count)) { grid->nodeCount = 0; return; }
+		int k = 0;
+		for (int c = 0; c < cellCount; c++) {
+			if (grid->cells[c].objectCount == 0) continue;
+			grid->treeKeys[k] = mortonKey(c % nx, (c / nx) % ny, c / (nx * ny));
+			grid->treeCells[k] = (unsigned int)c;
+			k++;
+		}
+		radixSortPairs(grid->treeKeys, grid->treeCells, grid->treeKeysTmp, grid->treeCellsTmp, count, 3 * GRID_KEY_BITS);
+		grid->treeCellCount = count;
+		keys = grid->treeKeys;
+		cells = grid->treeCells;
+	}
+	grid->nodeCount = 0;
+	if (count > 0) buildTreeNode(grid, keys, cells, 0, count);
+}
+
+// Mass and centre of mass of every node, children before parents
+static void refreshCellTree(Grid* grid) {
+	for (int i = grid->nodeCount - 1; i >= 0; i--) {
+		GPUCellNode* node = &grid->nodes[i];
+		if (node->level == 0) {
+			const GPUGridCell* cell = &grid->cells[node->cell];
+			memcpy(node->center, cell->center, sizeof(node->center));
+			node->mass = cell->mass;
+			continue;
+		}
+		float m = 0.0f, mx = 0.0f, my = 0.0f, mz = 0.0f;
+		for (unsigned int c = (unsigned int)i + 1; c < node->next; c = grid->nodes[c].next) {
+			const GPUCellNode* child = &grid->nodes[c];
+			m += child->mass;
+			mx += child->mass * child->center[0];
+			my += child->mass * child->center[1];
+			mz += child->mass * child->center[2];
+		}
+		float inv = m > 0.0f ? 1.0f / m : 0.0f;
+		node->center[0] = mx * inv;
+		node->center[1] = my * inv;
+		node->center[2] = mz * inv;
+		node->mass = m;
+	}
+}
+
+// Occupied cell at integer coordinates (x, y, z), or -1
+static inline int occupiedCellAt(const Grid* grid, int x, int y, int z) {
+	if (grid->sparse) return gridFindCell(grid, mortonKey(x, y, z));
+	int nx = (int)grid->gridSize.x, ny = (int)grid->gridSize.y, nz = (int)grid->gridSize.z;
+	if (x < 0 || y < 0 || z < 0 || x >= nx || y >= ny || z >= nz) return -1;
+	int idx = x + nx * (y + ny * z);
+	return grid->cells[idx].objectCount > 0 ? idx : -1;
+}
+
+static void countNeighbours(void* data, int begin, int end) {
+	Grid* grid = data;
+	for (int c = begin; c < end; c++) {
+		GPUGridCell* cell = &grid->cells[c];
+		unsigned int count = 0;
+		if (cell->objectCount > 0) {
+			for (int dz = -1; dz <= 1; dz++)
+				for (int dy = -1; dy <= 1; dy++)
+					for (int dx = -1; dx <= 1; dx++)
+						count += occupiedCellAt(grid, cell->coord[0] + dx, cell->coord[1] + dy, cell->coord[2] + dz) >= 0;
+		}
+		cell->neighbourCount = count;
+	}
+}
+
+static void fillNeighbours(void* data, int begin, int end) {
+	Grid* grid = data;
+	for (int c = begin; c < end; c++) {
+		GPUGridCell* cell = &grid->cells[c];
+		if (cell->neighbourCount == 0) continue;
+		unsigned int out = cell->neighbourStart;
+		for (int dz = -1; dz <= 1; dz++)
+			for (int dy = -1; dy <= 1; dy++)
+				for (int dx = -1; dx <= 1; dx++) {
+					int other = occupiedCellAt(grid, cell->coord[0] + dx, cell->coord[1] + dy, cell->coord[2] + dz);
+					if (other >= 0) grid->neighbourCells[out++] = (unsigned int)other;
+				}
+	}
+}
+
+// 3x3x3 neighbour lists of all occupied cells: count, prefix sum, fill
+static void buildNeighbourLists(Grid* grid) {
+	int cellCount = gridCellCount(grid);
+	jobParallelFor(cellCount, GRID_JOB_GRAIN, countNeighbours, grid);
+	unsigned int total = 0;
+	for (int c = 0; c < cellCount; c++) {
+		grid->cells[c].neighbourStart = total;
+		total += grid->cells[c].neighbourCount;
+	}
+	if ((int)total > grid->neighbourCapacity) {
+		int newCap = grid->neighbourCapacity == 0 ? 4096 : grid->neighbourCapacity;
+		while (newCap < (int)total) newCap *= 2;
+		unsigned int* list = realloc(grid->neighbourCells, newCap * sizeof(unsigned int));
+		if (list == NULL) {
+			grid->neighbourCount = 0;
+			for (int c = 0; c < cellCount; c++) grid->cells[c].neighbourCount = 0;
+			return;
+		}
+		grid->neighbourCells = list;
+		grid->neighbourCapacity = newCap;
+	}
+	jobParallelFor(cellCount, GRID_JOB_GRAIN, fillNeighbours, grid);
+	grid->neighbourCount = (int)total;
+}
+
+// Keep the neighbour lists in step with the cell layout
+static void updateNeighbourLists(Grid* grid, int changed) {
+	if (!grid->buildNeighbours) {
+		if (changed) grid->neighbourCount = 0; // stale from now on
+		return;
+	}
+	if (changed || grid->neighbourCount == 0) buildNeighbourLists(grid);
+}
+
+static void updateSparseGrid(Grid* grid, ObjectList* objList) {
+	int n = objList->size;
+	int changed = assignKeys(grid, objList) > 0;
+	if (changed) {
+		sortByKey(grid, n);
+		buildOccupiedCells(grid, n);
+	}
+	grid->objectCount = n;
+	accumulateCells(grid, objList, 0);
+	if (changed) buildCellTree(grid);
+	refreshCellTree(grid);
+	updateNeighbourLists(grid, changed);
+}
+
+Grid* getGrid(ObjectList* objList, float cellSize) {
+	if (!objList || objList->size == 0) return NULL;
+	Grid* grid = (Grid*)calloc(1, sizeof(Grid));
+	grid->cellSize = cellSize;
+	if (!fitBounds(grid, objList)) {
+		freeGrid(grid);
+		return NULL;
+	}
+	updateGrid(grid, objList);
 	return grid;
 }
 
+// Bring the grid up to date with the object list. When only a few objects
+// changed cells they are moved within the cell-sorted order; more changes
+// sort everything again. The cell tree and neighbour lists follow only when
+// a cell emptied or filled; the cell sums are refreshed every call.
 void updateGrid(Grid* grid, ObjectList* objList) {
-    float cellSize = grid->cellSize;
-	if (grid) {
-		freeGrid(grid);
-		grid = NULL;
+	if (!grid || !objList) return;
+	int n = objList->size;
+	if (n == 0 || !reserveObjects(grid, n)) {
+		grid->objectCount = 0;
+		grid->occupiedCount = 0;
+		grid->nodeCount = 0;
+		grid->neighbourCount = 0;
+		if (!grid->sparse) {
+			int cellCount = (int)denseCellCount(grid);
+			for (int c = 0; c < cellCount; c++) {
+				GPUGridCell* cell = &grid->cells[c];
+				cell->mass = 0.0f;
+				cell->objectStart = cell->objectCount = 0;
+				cell->neighbourStart = cell->neighbourCount = 0;
+			}
+		}
+		return;
 	}
-	grid = getGrid(objList, cellSize);
+	if (grid->sparse) {
+		updateSparseGrid(grid, objList);
+		return;
+	}
+	int changed = assignCells(grid, objList);
+	if (changed < 0) {
+		// Left the bounds: grow them and file everything again
+		if (!fitBounds(grid, objList)) {
+			grid->objectCount = 0;
+			return;
+		}
+		if (grid->sparse) {
+			// The grown bounds were too large for dense storage
+			grid->objectCapacity = 0;
+			if (reserveObjects(grid, n)) updateSparseGrid(grid, objList);
+			return;
+		}
+		if ((changed = assignCells(grid, objList)) < 0) {
+			grid->objectCount = 0;
+			return;
+		}
+	}
+	int occupancyChanged = changed > 0;
+	int incremental = changed > 0 && moveChangedObjects(grid, changed, &occupancyChanged);
+	if (changed > 0 && !incremental && !sortByCell(grid, n)) return;
+	grid->objectCount = n;
+	if (occupancyChanged) buildCellTree(grid);
+	// After a full sort any cell may have emptied, so all of them are summed
+	accumulateCells(grid, objList, changed == 0 || incremental);
+	refreshCellTree(grid);
+	updateNeighbourLists(grid, occupancyChanged);
 }
 
 void freeGrid(Grid* grid) {
 	if (!grid) return;
-	int cellCount = (int)(grid->gridSize.x * grid->gridSize.y * grid->gridSize.z);
-	for (int i = 0; i < cellCount; i++) {
-		free(grid->cells[i].objects);
-	}
 	free(grid->cells);
+	free(grid->objIndices);
+	free(grid->bodies);
+	free(grid->neighbourCells);
+	free(grid->cellOf);
+	free(grid->slotOf);
+	free(grid->moved);
+	free(grid->histogram);
+	free(grid->cellKeys);
+	free(grid->objKeys);
+	free(grid->sortKeys);
+	free(grid->sortIndices);
+	free(grid->nodes);
+	free(grid->treeKeys);
+	free(grid->treeCells);
+	free(grid->treeKeysTmp);
+	free(grid->treeCellsTmp);
 	free(grid);
 }
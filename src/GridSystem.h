@@ -2,29 +2,103 @@
 #define GRID_SYSTEM_H
 
 
-#include <Raylib.h>
+#include <raylib.h>
+#include <stdint.h>
 
 // Forward declarations to avoid circular dependency
-typedef struct GravitationalObject GravitationalObject;
 typedef struct ObjectList ObjectList;
 
-typedef struct Cell {
-    float mass;
-    Vector3 center;
-    GravitationalObject** objects; // Array of pointers to objects in this cell
-    int objectCount;
-    int objectCapacity;
-} Cell;
+// Cell layout shared with shader/GridGravitation.comp and GridNearField.comp (std430, 48 bytes)
+typedef struct GPUGridCell {
+    float center[3];          // Center of mass of the cell
+    float mass;               // Total mass in the cell
+    int coord[3];             // Integer cell coordinates (see Grid.origin)
+    unsigned int objectStart; // Start index in the flat object index array
+    unsigned int objectCount; // Number of objects in this cell
+    unsigned int neighbourStart; // Range in Grid.neighbourCells (only with buildNeighbours)
+    unsigned int neighbourCount;
+    unsigned int _pad;        // Padding for 16-byte alignment (std430)
+} GPUGridCell;
+
+// Node of the octree built over the occupied cells (std430, 48 bytes).
+// Nodes are stored depth-first: the first child directly follows its parent
+// and `next` skips the whole subtree. Leaves are single grid cells.
+typedef struct GPUCellNode {
+    float center[3];      // Center of mass of the subtree
+    float mass;           // Total mass of the subtree
+    int minCell[3];       // Minimum corner of the node's box in integer cell coordinates
+    unsigned int level;   // Box edge is (1 << level) cells; 0 for leaves
+    unsigned int next;    // First node after this subtree
+    unsigned int cell;    // Index into Grid.cells for leaves, GRID_NO_CELL otherwise
+    unsigned int _pad[2]; // Padding for 16-byte alignment (std430)
+} GPUCellNode;
+
+#define GRID_NO_CELL 0xffffffffu
+
+// Bits per axis of a sparse cell coordinate (63-bit Morton keys)
+#define GRID_KEY_BITS 21
 
 typedef struct Grid 
 {
-    Cell* cells; 
+    GPUGridCell* cells;       // Mass, centre of mass and object range of every cell
+    unsigned int* objIndices; // ObjectList indices sorted by cell
+    float* bodies;            // x, y, z, mass of every object in objIndices order
+    int* cellOf;              // Cell of every object at the last update
+    int* slotOf;              // Position of every object in objIndices (dense mode)
+    int* moved;               // (object, previous cell) pairs that changed cells in the last assignment
+    int movedCount;
+    int objectCount;          // Number of objects filed at the last update
+    Vector3 origin;           // World position of the minimum corner of cell (0,0,0), zero in sparse mode
     Vector3 gridSize;
     float cellSize;
+    int cellCapacity;         // Allocated cells, >= gridSize.x * gridSize.y * gridSize.z
+    int objectCapacity;
+    int* histogram;           // Per-thread cell counts, reused as scatter offsets
+    int histogramCapacity;
+
+    // Sparse mode: only occupied cells are stored, sorted by Morton key.
+    // Chosen automatically when a dense grid over the bounds would be too large.
+    int sparse;
+    int occupiedCount;        // Number of entries in cells (sparse mode)
+    uint64_t* cellKeys;       // Morton key of every occupied cell
+    uint64_t* objKeys;        // Morton key of every object at the last update
+    uint64_t* sortKeys;       // Radix sort scratch
+    unsigned int* sortIndices;
+
+    // Cell octree (see GPUCellNode), rebuilt when a cell empties or fills and
+    // re-summed every update. Integer cell coordinates are
+    // floor((position - origin) / cellSize); origin is zero in sparse mode.
+    GPUCellNode* nodes;
+    int nodeCount;
+    int nodeCapacity;
+    uint64_t* treeKeys;       // Dense mode: keys and cells of the occupied cells, sorted
+    unsigned int* treeCells;
+    uint64_t* treeKeysTmp;
+    unsigned int* treeCellsTmp;
+    int treeCapacity;
+    int treeCellCount;        // Dense mode: occupied cells listed in treeCells
+
+    // Occupied cells of every cell's 3x3x3 neighbourhood (itself included),
+    // referenced by GPUGridCell.neighbourStart/neighbourCount
+    int buildNeighbours;      // Set by the caller; lists are only maintained when non-zero
+    unsigned int* neighbourCells;
+    int neighbourCount;
+    int neighbourCapacity;
 } Grid;
 
+// Build a grid covering the current objects. Keep it alive and call updateGrid each tick.
 Grid* getGrid(ObjectList* objList, float cellSize);
 void updateGrid(Grid* grid, ObjectList* objList);
 void freeGrid(Grid* grid);
+int gridCellCount(const Grid* grid);
+uint64_t gridCellKey(const Grid* grid, int cx, int cy, int cz);
+int gridFindCell(const Grid* grid, uint64_t key);
+
+// Morton key of integer cell coordinates (GRID_KEY_BITS per axis, clamped),
+// shared with other spatial sorts
+uint64_t gridMortonKey(int cx, int cy, int cz);
+// LSD radix sort of (key, value) pairs over the low `bits` key bits;
+// keysTmp/valuesTmp are scratch of n entries
+void gridSortPairs(uint64_t* keys, unsigned int* values, uint64_t* keysTmp, unsigned int* valuesTmp, int n, int bits);
 
-#endif
\ No newline at end of file
+#endif
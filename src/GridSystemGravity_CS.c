@@ -2,120 +2,189 @@
 
 #include "GridSystemGravity_CS.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "compute.h" // for GPUObject
+#include "Profiler.h"
 #include <raylib.h>   // for Vector3 if needed
 
-GLuint createGravityComputeShader() {
-    char* computeShaderSrc = LoadFileText("shader/GridGravitation.comp");
-    if (!computeShaderSrc) {
-        printf("[createGravityComputeShader] ERROR: Could not load shader file at 'shader/gravitation.comp'.\n");
-        return 0;
-    }
-    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
-    glShaderSource(shader, 1, (const GLchar* const*)&computeShaderSrc, NULL);
-    glCompileShader(shader);
-    GLint success;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        char infoLog[512];
-        glGetShaderInfoLog(shader, 512, NULL, infoLog);
-        printf("[createGravityComputeShader] Compile error: %s\n", infoLog);
-        glDeleteShader(shader);
-        UnloadFileText(computeShaderSrc);
-        return 0;
-    }
-    GLuint program = glCreateProgram();
-    glAttachShader(program, shader);
-    glLinkProgram(program);
-    glDeleteShader(shader);
-    UnloadFileText(computeShaderSrc);
-    GLint linkOK = 0;
-    glGetProgramiv(program, GL_LINK_STATUS, &linkOK);
-    if (!linkOK) {
-        char infoLog[512];
-        glGetProgramInfoLog(program, 512, NULL, infoLog);
-        printf("[createGravityComputeShader] Link error: %s\n", infoLog);
-        glDeleteProgram(program);
-        return 0;
+GLuint createGridGravityComputeShader() {
+    return createComputeProgram("shader/GridGravitation.comp");
+}
+
+GLuint createGridNearFieldComputeShader() {
+    return createComputeProgram("shader/GridNearField.comp");
+}
+
+// Make sure an SSBO holds at least `count` elements; capacity only grows (geometrically)
+static void reserveBuffer(GLuint* ssbo, int* capacity, size_t elemSize, int count, int minCapacity) {
+    if (*ssbo != 0 && count <= *capacity) return;
+    int newCap = *capacity > 0 ? *capacity : minCapacity;
+    while (newCap < count) newCap *= 2;
+    if (*ssbo != 0) glDeleteBuffers(1, ssbo);
+    glGenBuffers(1, ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, *ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, elemSize * newCap, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    *capacity = newCap;
+}
+
+// Upload `count` elements to the start of a growing SSBO
+static void uploadGrowing(GLuint* ssbo, int* capacity, size_t elemSize, int count, const void* data, int minCapacity) {
+    reserveBuffer(ssbo, capacity, elemSize, count, minCapacity);
+    if (count <= 0) return;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, *ssbo);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, elemSize * count, data);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// Read `size` bytes from the start of an SSBO into dst
+static int readBuffer(GLuint ssbo, size_t size, void* dst) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    void* ptr = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, GL_MAP_READ_BIT);
+    if (ptr) {
+        memcpy(dst, ptr, size);
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
     }
-    return program;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return ptr != NULL;
 }
 
-int computeGridGravity(GPUObject* objects, int numObjects, GPUGridCell* cells, int numCells, unsigned int* objIndices, int numObjIndices, Vector3 gridSize, float cellSize, float deltatime, float G) {
+int computeGridGravity(GPUObject* objects, int numObjects, const Grid* grid, float theta, int nearNeighbours, float deltatime, float G, GridContacts* contacts) {
     static GLuint shaderProgram = 0;
-    static GLuint ssboObjects = 0;
-    static GLuint ssboCells = 0;
-    static GLuint ssboObjIndices = 0;
-    static int prevNumObjects = 0, prevNumCells = 0, prevNumObjIndices = 0;
+    static GLuint nearProgram = 0;
+    static GLuint ssboObjects = 0, ssboCells = 0, ssboObjIndices = 0, ssboObjCells = 0, ssboNodes = 0;
+    static GLuint ssboBodies = 0, ssboNeighbours = 0, ssboNearAccel = 0;
+    static GLuint ssboContactCount = 0, ssboContacts = 0, ssboContactDelta = 0;
+    static int objectCapacity = 0, cellCapacity = 0, objIndexCapacity = 0, objCellCapacity = 0, nodeCapacity = 0;
+    static int bodyCapacity = 0, neighbourCapacity = 0, nearAccelCapacity = 0;
+    static int contactCountCapacity = 0, contactCapacity = 0, contactDeltaCapacity = 0;
+    static unsigned int* contactPairs = NULL; // host copy handed out through contacts->pairs
+    static int contactPairCapacity = 0;
 
     if (shaderProgram == 0) {
-        shaderProgram = createGravityComputeShader();
+        shaderProgram = createGridGravityComputeShader();
         if (shaderProgram == 0) return 0;
     }
-
-    // Allocate or reallocate SSBOs if sizes change
-    if (ssboObjects == 0 || prevNumObjects != numObjects) {
-        if (ssboObjects != 0) { glDeleteBuffers(1, &ssboObjects); ssboObjects = 0; }
-        glGenBuffers(1, &ssboObjects);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboObjects);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GPUObject) * numObjects, objects, GL_DYNAMIC_COPY);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-        prevNumObjects = numObjects;
-    } else {
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboObjects);
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GPUObject) * numObjects, objects);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-    }
-
-    if (ssboCells == 0 || prevNumCells != numCells) {
-        if (ssboCells != 0) { glDeleteBuffers(1, &ssboCells); ssboCells = 0; }
-        glGenBuffers(1, &ssboCells);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboCells);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GPUGridCell) * numCells, cells, GL_DYNAMIC_COPY);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-        prevNumCells = numCells;
-    } else {
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboCells);
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GPUGridCell) * numCells, cells);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    if (nearNeighbours && (!grid->buildNeighbours || grid->neighbourCells == NULL)) nearNeighbours = 0;
+    if (nearNeighbours && nearProgram == 0) {
+        nearProgram = createGridNearFieldComputeShader();
+        if (nearProgram == 0) nearNeighbours = 0;
     }
-
-    if (ssboObjIndices == 0 || prevNumObjIndices != numObjIndices) {
-        if (ssboObjIndices != 0) { glDeleteBuffers(1, &ssboObjIndices); ssboObjIndices = 0; }
-        glGenBuffers(1, &ssboObjIndices);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboObjIndices);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(unsigned int) * numObjIndices, objIndices, GL_DYNAMIC_COPY);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-        prevNumObjIndices = numObjIndices;
-    } else {
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboObjIndices);
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(unsigned int) * numObjIndices, objIndices);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    int numCells = gridCellCount(grid);
+    // Contacts closer than 2 * radius only reach into the neighbour cells while that fits into one cell
+    if (contacts) {
+        contacts->complete = 0;
+        contacts->count = 0;
+        contacts->pairs = contactPairs;
     }
+    int findContacts = contacts && nearNeighbours && contacts->radius > 0.0f
+                    && 2.0f * contacts->radius <= grid->cellSize && grid->objectCount == numObjects;
+    int elastic = findContacts && contacts->elastic;
 
-    glUseProgram(shaderProgram);
-    glUniform1f(glGetUniformLocation(shaderProgram, "deltaTime"), deltatime);
-    glUniform1f(glGetUniformLocation(shaderProgram, "G"), G);
-    glUniform3ui(glGetUniformLocation(shaderProgram, "gridSize"), (unsigned int)gridSize.x, (unsigned int)gridSize.y, (unsigned int)gridSize.z);
-    glUniform1f(glGetUniformLocation(shaderProgram, "cellSize"), cellSize);
+    // Buffers only grow; the shaders read numCells/numNodes instead of the buffer length
+    ProfileZone upload = profileBegin("gpu.upload");
+    uploadGrowing(&ssboObjects, &objectCapacity, sizeof(GPUObject), numObjects, objects, 1024);
+    uploadGrowing(&ssboCells, &cellCapacity, sizeof(GPUGridCell), numCells, grid->cells, 1024);
+    uploadGrowing(&ssboObjIndices, &objIndexCapacity, sizeof(unsigned int), grid->objectCount, grid->objIndices, 1024);
+    uploadGrowing(&ssboObjCells, &objCellCapacity, sizeof(int), numObjects, grid->cellOf, 1024);
+    uploadGrowing(&ssboNodes, &nodeCapacity, sizeof(GPUCellNode), grid->nodeCount, grid->nodes, 2048);
+    // Cell-sorted snapshot of positions and masses, read by both passes
+    uploadGrowing(&ssboBodies, &bodyCapacity, sizeof(float) * 4, grid->objectCount, grid->bodies, 1024);
+    profileEnd(upload);
 
     // Bind buffers to match compute shader bindings
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ssboObjects);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, ssboCells);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ssboObjIndices);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, ssboObjCells);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, ssboNodes);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, ssboBodies);
+
+    // The near-field accelerations are bound even when unused (the far-field shader declares them)
+    reserveBuffer(&ssboNearAccel, &nearAccelCapacity, sizeof(float) * 4, nearNeighbours ? numObjects : 1, 1024);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, ssboNearAccel);
+    // Likewise the bounce, read by the far-field shader when applyContacts is set
+    reserveBuffer(&ssboContactDelta, &contactDeltaCapacity, sizeof(float) * 4, elastic ? 2 * numObjects : 1, 2048);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, ssboContactDelta);
+
+    // Append buffer and its counter; pairs are only read back for the CPU to
+    // merge, elastic steps just count them
+    unsigned int zero = 0;
+    uploadGrowing(&ssboContactCount, &contactCountCapacity, sizeof(unsigned int), 1, &zero, 1);
+    reserveBuffer(&ssboContacts, &contactCapacity, sizeof(unsigned int) * 2, 1, 4096);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, ssboContactCount);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, ssboContacts);
+
+    if (nearNeighbours) {
+        uploadGrowing(&ssboNeighbours, &neighbourCapacity, sizeof(unsigned int), grid->neighbourCount, grid->neighbourCells, 4096);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, ssboNeighbours);
+
+        // Pass 1: near field, one workgroup per occupied cell
+        ProfileZone nearZone = profileGPUBegin("gravity.near_field");
+        glUseProgram(nearProgram);
+        glUniform1f(glGetUniformLocation(nearProgram, "G"), G);
+        glUniform1ui(glGetUniformLocation(nearProgram, "numCells"), (unsigned int)numCells);
+        glUniform1f(glGetUniformLocation(nearProgram, "contactRadius"), findContacts ? contacts->radius : 0.0f);
+        glUniform1i(glGetUniformLocation(nearProgram, "elasticContacts"), elastic);
+        glUniform1ui(glGetUniformLocation(nearProgram, "contactCapacity"), elastic ? 0u : (unsigned int)contactCapacity);
+        glDispatchCompute(numCells < 65535 ? numCells : 65535, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        profileGPUEnd(nearZone);
+    }
+
+    // Pass 2: far field and integration
+    ProfileZone farZone = profileGPUBegin("gravity.far_field");
+    glUseProgram(shaderProgram);
+    glUniform1f(glGetUniformLocation(shaderProgram, "deltaTime"), deltatime);
+    glUniform1f(glGetUniformLocation(shaderProgram, "G"), G);
+    glUniform3f(glGetUniformLocation(shaderProgram, "gridOrigin"), grid->origin.x, grid->origin.y, grid->origin.z);
+    glUniform3ui(glGetUniformLocation(shaderProgram, "gridSize"), (unsigned int)grid->gridSize.x, (unsigned int)grid->gridSize.y, (unsigned int)grid->gridSize.z);
+    glUniform1f(glGetUniformLocation(shaderProgram, "cellSize"), grid->cellSize);
+    glUniform1ui(glGetUniformLocation(shaderProgram, "numObjects"), (unsigned int)numObjects);
+    glUniform1ui(glGetUniformLocation(shaderProgram, "numCells"), (unsigned int)numCells);
+    glUniform1ui(glGetUniformLocation(shaderProgram, "numNodes"), (unsigned int)grid->nodeCount);
+    glUniform1f(glGetUniformLocation(shaderProgram, "theta"), theta);
+    glUniform1i(glGetUniformLocation(shaderProgram, "nearNeighbourhood"), nearNeighbours);
+    glUniform1i(glGetUniformLocation(shaderProgram, "applyContacts"), elastic);
 
     // Dispatch compute shader
     glDispatchCompute((numObjects + 255) / 256, 1, 1);
     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    profileGPUEnd(farZone);
 
-    // Read back results from GPU to CPU (from objects buffer)
+    // Read back results from GPU to CPU (from objects buffer); the map waits for both passes
+    ProfileZone readback = profileBegin("gpu.readback");
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboObjects);
-    GPUObject* ptr = (GPUObject*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
+    GPUObject* ptr = (GPUObject*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GPUObject) * numObjects, GL_MAP_READ_BIT);
     if (ptr) {
         memcpy(objects, ptr, sizeof(GPUObject) * numObjects);
         glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
     }
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    profileEnd(readback);
+
+    if (findContacts) {
+        unsigned int found = 0;
+        if (!readBuffer(ssboContactCount, sizeof(unsigned int), &found)) return 1;
+        contacts->count = (int)found;
+        if (elastic) {
+            contacts->complete = 1;
+        } else if ((int)found > contactCapacity) {
+            // Append buffer overflowed: grow it for the next step, the caller searches on the CPU this time
+            reserveBuffer(&ssboContacts, &contactCapacity, sizeof(unsigned int) * 2, (int)found, 4096);
+        } else if (found > 0) {
+            if ((int)found > contactPairCapacity) {
+                unsigned int* pairs = realloc(contactPairs, sizeof(unsigned int) * 2 * found);
+                if (!pairs) return 1;
+                contactPairs = pairs;
+                contactPairCapacity = (int)found;
+            }
+            contacts->pairs = contactPairs;
+            contacts->complete = readBuffer(ssboContacts, sizeof(unsigned int) * 2 * found, contactPairs);
+        } else {
+            contacts->complete = 1;
+        }
+    }
     return 1;
 }
-
@@ -4,17 +4,28 @@
 #define NOGDI
 #define NOUSER
 #include <GL/gl3w.h>
+#include "compute.h" // for GPUObject
+#include "GridSystem.h" // for GPUGridCell
 
-typedef struct GPUGridCell {
-    float center[3];      // Center of mass of the cell
-    float mass;           // Total mass in the cell
-    unsigned int objectStart; // Start index in the flat object index array
-    unsigned int objectCount; // Number of objects in this cell
-    unsigned int _pad[2];     // Padding for 16-byte alignment (std430)
-} GPUGridCell;
+GLuint createGridGravityComputeShader();
+GLuint createGridNearFieldComputeShader();
 
-GLuint createGravityComputeShader();
+// Contact search fused into the near-field pass: it visits every pair of the
+// 3x3x3 neighbourhood anyway, so all pairs closer than 2 * radius are found
+// as long as that is at most one cell
+typedef struct GridContacts {
+    float radius;              // in: particle radius
+    int elastic;               // in: bounce the pairs within the step on the GPU
+    int complete;              // out: every contact at the start of the step was found
+    int count;                 // out: pairs found
+    const unsigned int* pairs; // out: object indices, two per pair; not read back when elastic,
+                               //      valid until the next call
+} GridContacts;
 
-int computeGridGravity(GPUObject* objects, int numObjects, GPUGridCell* cells, int numCells, unsigned int* objIndices, int numObjIndices, Vector3 gridSize, float cellSize, float deltatime, float G);
+// One gravity step on the GPU. The far field walks grid->nodes; the near field
+// is the object's own cell, or with nearNeighbours (requires grid->buildNeighbours)
+// its 3x3x3 neighbourhood summed in a separate tiled pass.
+// contacts (may be NULL) needs the neighbourhood pass; complete stays 0 without it.
+int computeGridGravity(GPUObject* objects, int numObjects, const Grid* grid, float theta, int nearNeighbours, float deltatime, float G, GridContacts* contacts);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,8 +1,8 @@
 #ifndef INPUT_HANDLER_H
 #define INPUT_HANDLER_H
 
-#include "particle.h"
+#include "Simulation.h"
 
-void handleInput(ObjectList* objList, Camera3D* camera);
+void handleInput(Simulation* sim, Camera3D* camera);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,343 @@
+#include "Integrator.h"
+#include "BarnesHut.h"
+#include "ParticleMesh.h"
+#include "JobSystem.h"
+#include "Profiler.h"
+
+// Smallest number of particles worth a job of their own
+#define INTEGRATOR_JOB_GRAIN 4096
+
+// Per-slot state, kept between steps; buffers only grow
+static float* gAcc = NULL;      // acceleration at the particles' current time, 3 per slot
+static float* gJerk = NULL;     // its time derivative (Hermite schemes)
+static float* gAccNew = NULL;   // latest evaluation, at the predicted state
+static float* gJerkNew = NULL;
+static float* gPredX = NULL;    // predicted positions and velocities (Hermite schemes)
+static float* gPredY = NULL;
+static float* gPredZ = NULL;
+static float* gPredVX = NULL;
+static float* gPredVY = NULL;
+static float* gPredVZ = NULL;
+static int* gLevel = NULL;      // block level: steps of tick / 2^level
+static int* gTime = NULL;       // time reached within the tick, in finest steps
+static int* gActive = NULL;     // slots whose step ends at the current substep
+static int gCapacity = 0;
+
+// gAcc belongs to this list at this generation and size; gJerk and gLevel
+// too when gValidJerk
+static const ObjectList* gValidList = NULL;
+static unsigned int gValidGeneration = 0;
+static int gValidSize = -1;
+static int gValidJerk = 0;
+static int gEvaluations = 0;
+
+static const char* INTEGRATOR_NAMES[INTEGRATOR_COUNT] = { "Euler", "Leapfrog", "Hermite", "Block" };
+
+const char* integratorName(Integrator integrator) {
+    return integrator >= 0 && integrator < INTEGRATOR_COUNT ? INTEGRATOR_NAMES[integrator] : "?";
+}
+
+int integratorLastEvaluations(void) { return gEvaluations; }
+
+void invalidateIntegrator(void) {
+    gValidList = NULL;
+    gValidSize = -1;
+    gValidJerk = 0;
+}
+
+void freeIntegrator(void) {
+    float** floats[] = { &gAcc, &gJerk, &gAccNew, &gJerkNew, &gPredX, &gPredY, &gPredZ, &gPredVX, &gPredVY, &gPredVZ };
+    for (int b = 0; b < (int)(sizeof(floats) / sizeof(floats[0])); b++) {
+        alignedFree(*floats[b]);
+        *floats[b] = NULL;
+    }
+    alignedFree(gLevel);
+    alignedFree(gTime);
+    alignedFree(gActive);
+    gLevel = gTime = gActive = NULL;
+    gCapacity = 0;
+    invalidateIntegrator();
+}
+
+static int reserveState(int count) {
+    if (count <= gCapacity) return 1;
+    int newCap = gCapacity == 0 ? 1024 : gCapacity;
+    while (newCap < count) newCap *= 2;
+    freeIntegrator();
+    gAcc = alignedAlloc(sizeof(float) * 3 * newCap);
+    gJerk = alignedAlloc(sizeof(float) * 3 * newCap);
+    gAccNew = alignedAlloc(sizeof(float) * 3 * newCap);
+    gJerkNew = alignedAlloc(sizeof(float) * 3 * newCap);
+    gPredX = alignedAlloc(sizeof(float) * newCap);
+    gPredY = alignedAlloc(sizeof(float) * newCap);
+    gPredZ = alignedAlloc(sizeof(float) * newCap);
+    gPredVX = alignedAlloc(sizeof(float) * newCap);
+    gPredVY = alignedAlloc(sizeof(float) * newCap);
+    gPredVZ = alignedAlloc(sizeof(float) * newCap);
+    gLevel = alignedAlloc(sizeof(int) * newCap);
+    gTime = alignedAlloc(sizeof(int) * newCap);
+    gActive = alignedAlloc(sizeof(int) * newCap);
+    if (!gAcc || !gJerk || !gAccNew || !gJerkNew || !gPredX || !gPredY || !gPredZ
+        || !gPredVX || !gPredVY || !gPredVZ || !gLevel || !gTime || !gActive) {
+        freeIntegrator();
+        return 0;
+    }
+    gCapacity = newCap;
+    return 1;
+}
+
+static int accelerationsValid(const ObjectList* oList, int needJerk) {
+    return gValidList == oList && gValidGeneration == oList->generation && gValidSize == oList->size
+        && (!needJerk || gValidJerk);
+}
+
+static int evaluateAccelerations(ObjectList* oList, const ForceSolver* solver, float* acc) {
+    ProfileZone zone;
+    int ok;
+    if (solver->particleMesh) {
+        zone = profileBegin("gravity.particle_mesh");
+        ok = computeParticleMeshAccelerations(oList, solver->meshSize, solver->G, acc);
+    } else {
+        zone = profileBegin("gravity.barnes_hut");
+        ok = computeBarnesHutAccelerations(oList, solver->theta, solver->G, acc);
+    }
+    profileEnd(zone);
+    gEvaluations++;
+    return ok;
+}
+
+static int evaluateJerks(const ObjectList* oList, const int* active, int count, const ForceSolver* solver,
+                         float* acc, float* jerk) {
+    ProfileZone zone = profileBegin("gravity.hermite");
+    int ok = computeBarnesHutJerk(oList, active, count, solver->theta, solver->G, acc, jerk);
+    profileEnd(zone);
+    gEvaluations++;
+    return ok;
+}
+
+// --- Euler and leapfrog ---
+
+typedef struct KickDriftPass {
+    ObjectList* oList;
+    float kick;  // velocity += acceleration * kick
+    float drift; // then position += velocity * drift
+} KickDriftPass;
+
+static void kickDriftRange(void* data, int begin, int end) {
+    const KickDriftPass* pass = data;
+    ObjectList* oList = pass->oList;
+    for (int i = begin; i < end; i++) {
+        oList->velX[i] += gAcc[3 * i + 0] * pass->kick;
+        oList->velY[i] += gAcc[3 * i + 1] * pass->kick;
+        oList->velZ[i] += gAcc[3 * i + 2] * pass->kick;
+        oList->posX[i] += oList->velX[i] * pass->drift;
+        oList->posY[i] += oList->velY[i] * pass->drift;
+        oList->posZ[i] += oList->velZ[i] * pass->drift;
+    }
+}
+
+static void kickDrift(ObjectList* oList, float kick, float drift) {
+    ProfileZone zone = profileBegin("move");
+    KickDriftPass pass = { oList, kick, drift };
+    jobParallelFor(oList->size, INTEGRATOR_JOB_GRAIN, kickDriftRange, &pass);
+    profileEnd(zone);
+}
+
+static int eulerStep(ObjectList* oList, const ForceSolver* solver, float dt) {
+    if (!evaluateAccelerations(oList, solver, gAcc)) return 0;
+    kickDrift(oList, dt, dt);
+    // gAcc is from before the drift
+    invalidateIntegrator();
+    return 1;
+}
+
+static int leapfrogStep(ObjectList* oList, const ForceSolver* solver, float dt) {
+    // The closing kick's accelerations open the next step
+    if (!accelerationsValid(oList, 0) && !evaluateAccelerations(oList, solver, gAcc)) return 0;
+    kickDrift(oList, 0.5f * dt, dt);
+    if (!evaluateAccelerations(oList, solver, gAcc)) {
+        invalidateIntegrator();
+        return 0;
+    }
+    kickDrift(oList, 0.5f * dt, 0.0f);
+    gValidList = oList;
+    gValidGeneration = oList->generation;
+    gValidSize = oList->size;
+    gValidJerk = 0;
+    return 1;
+}
+
+// --- Hermite, shared and block steps ---
+
+typedef struct HermitePass {
+    ObjectList* oList;
+    int tickUnits;   // finest steps per tick (1 for the shared step)
+    float unit;      // seconds per finest step
+    int target;      // time the substep ends at, in finest steps
+    int adaptive;    // pick new levels
+    int count;       // active particles
+} HermitePass;
+
+static inline float length3(const float* v) {
+    return sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+}
+
+// Seconds of one step at `level`
+static inline float levelStep(const HermitePass* pass, int level) {
+    return pass->unit * (float)(pass->tickUnits >> level);
+}
+
+// Coarsest level whose step is not longer than dt
+static int levelFor(const HermitePass* pass, float dt) {
+    int level = 0;
+    while (level < BLOCK_MAX_LEVEL && levelStep(pass, level) > dt) level++;
+    return level;
+}
+
+// Predict every particle to the substep's end from its own time
+static void predictRange(void* data, int begin, int end) {
+    const HermitePass* pass = data;
+    const ObjectList* oList = pass->oList;
+    for (int i = begin; i < end; i++) {
+        float dt = (float)(pass->target - gTime[i]) * pass->unit;
+        float dt2 = dt * dt * 0.5f, dt3 = dt * dt * dt / 6.0f;
+        const float* a = &gAcc[3 * i];
+        const float* j = &gJerk[3 * i];
+        gPredX[i] = oList->posX[i] + oList->velX[i] * dt + a[0] * dt2 + j[0] * dt3;
+        gPredY[i] = oList->posY[i] + oList->velY[i] * dt + a[1] * dt2 + j[1] * dt3;
+        gPredZ[i] = oList->posZ[i] + oList->velZ[i] * dt + a[2] * dt2 + j[2] * dt3;
+        gPredVX[i] = oList->velX[i] + a[0] * dt + j[0] * dt2;
+        gPredVY[i] = oList->velY[i] + a[1] * dt + j[1] * dt2;
+        gPredVZ[i] = oList->velZ[i] + a[2] * dt + j[2] * dt2;
+    }
+}
+
+// Hermite corrector for the active particles, then their next level
+static void correctRange(void* data, int begin, int end) {
+    const HermitePass* pass = data;
+    ObjectList* oList = pass->oList;
+    for (int k = begin; k < end; k++) {
+        int i = gActive[k];
+        float dt = (float)(pass->target - gTime[i]) * pass->unit;
+        float* a0 = &gAcc[3 * i];
+        float* j0 = &gJerk[3 * i];
+        const float* a1 = &gAccNew[3 * i];
+        const float* j1 = &gJerkNew[3 * i];
+        float v0[3] = { oList->velX[i], oList->velY[i], oList->velZ[i] };
+        float v1[3], x1[3];
+        float dt12 = dt * dt / 12.0f;
+        for (int c = 0; c < 3; c++) {
+            v1[c] = v0[c] + 0.5f * dt * (a0[c] + a1[c]) + dt12 * (j0[c] - j1[c]);
+        }
+        x1[0] = oList->posX[i] + 0.5f * dt * (v0[0] + v1[0]) + dt12 * (a0[0] - a1[0]);
+        x1[1] = oList->posY[i] + 0.5f * dt * (v0[1] + v1[1]) + dt12 * (a0[1] - a1[1]);
+        x1[2] = oList->posZ[i] + 0.5f * dt * (v0[2] + v1[2]) + dt12 * (a0[2] - a1[2]);
+        oList->posX[i] = x1[0]; oList->posY[i] = x1[1]; oList->posZ[i] = x1[2];
+        oList->velX[i] = v1[0]; oList->velY[i] = v1[1]; oList->velZ[i] = v1[2];
+
+        if (pass->adaptive && dt > 0.0f) {
+            // Aarseth criterion from the snap and crackle the two ends imply
+            float snap[3], crackle[3];
+            for (int c = 0; c < 3; c++) {
+                float da = a0[c] - a1[c];
+                crackle[c] = (12.0f * da + 6.0f * dt * (j0[c] + j1[c])) / (dt * dt * dt);
+                snap[c] = (-6.0f * da - dt * (4.0f * j0[c] + 2.0f * j1[c])) / (dt * dt) + dt * crackle[c];
+            }
+            float a = length3(a1), j = length3(j1), s = length3(snap), c = length3(crackle);
+            float denominator = j * c + s * s;
+            int level = gLevel[i];
+            if (denominator > 0.0f) {
+                float wanted = sqrtf(BLOCK_ETA * (a * s + j * j) / denominator);
+                int fit = levelFor(pass, wanted);
+                if (fit > level) {
+                    level = fit;
+                } else if (fit < level && pass->target % (pass->tickUnits >> (level - 1)) == 0) {
+                    // Coarser only one level at a time, and only where that step starts
+                    level--;
+                }
+            } else if (level > 0 && pass->target % (pass->tickUnits >> (level - 1)) == 0) {
+                level--;
+            }
+            gLevel[i] = level;
+        }
+        for (int c = 0; c < 3; c++) {
+            a0[c] = a1[c];
+            j0[c] = j1[c];
+        }
+        gTime[i] = pass->target;
+    }
+}
+
+static int hermiteStep(ObjectList* oList, const ForceSolver* solver, float dt, int adaptive) {
+    int n = oList->size;
+    HermitePass pass = { oList, adaptive ? 1 << BLOCK_MAX_LEVEL : 1, 0.0f, 0, adaptive, 0 };
+    pass.unit = dt / (float)pass.tickUnits;
+    int fresh = !accelerationsValid(oList, 1);
+    if (fresh && !evaluateJerks(oList, NULL, n, solver, gAcc, gJerk)) return 0;
+    for (int i = 0; i < n; i++) {
+        gTime[i] = 0;
+        if (!adaptive) {
+            gLevel[i] = 0;
+        } else if (fresh) {
+            // First step from |a| / |jerk| alone
+            float a = length3(&gAcc[3 * i]), j = length3(&gJerk[3 * i]);
+            gLevel[i] = j > 0.0f ? levelFor(&pass, BLOCK_ETA_START * a / j) : 0;
+        }
+    }
+
+    // The tree is built over the predicted state of every particle
+    ObjectList predicted = *oList;
+    predicted.posX = gPredX; predicted.posY = gPredY; predicted.posZ = gPredZ;
+    predicted.velX = gPredVX; predicted.velY = gPredVY; predicted.velZ = gPredVZ;
+
+    int now = 0;
+    while (now < pass.tickUnits) {
+        int next = pass.tickUnits;
+        for (int i = 0; i < n; i++) {
+            int end = gTime[i] + (pass.tickUnits >> gLevel[i]);
+            if (end < next) next = end;
+        }
+        pass.count = 0;
+        for (int i = 0; i < n; i++) {
+            if (gTime[i] + (pass.tickUnits >> gLevel[i]) == next) gActive[pass.count++] = i;
+        }
+        pass.target = next;
+
+        ProfileZone predict = profileBegin("integrate");
+        jobParallelFor(n, INTEGRATOR_JOB_GRAIN, predictRange, &pass);
+        profileEnd(predict);
+        if (!evaluateJerks(&predicted, gActive, pass.count, solver, gAccNew, gJerkNew)) {
+            invalidateIntegrator();
+            return 0;
+        }
+        ProfileZone correct = profileBegin("integrate");
+        jobParallelFor(pass.count, INTEGRATOR_JOB_GRAIN, correctRange, &pass);
+        profileEnd(correct);
+        now = next;
+    }
+    gValidList = oList;
+    gValidGeneration = oList->generation;
+    gValidSize = n;
+    gValidJerk = 1;
+    if (DEBUG_MODE && adaptive) printf("[integrateStep] Block step: %d force evaluations\n", gEvaluations);
+    return 1;
+}
+
+int integrateStep(ObjectList* oList, Integrator integrator, const ForceSolver* solver, float deltaTime) {
+    gEvaluations = 0;
+    if (oList->size == 0) return 1;
+    if (!reserveState(oList->size)) {
+        fprintf(stderr, "[ERROR] Could not allocate integrator buffers.\n");
+        return 0;
+    }
+    // PM has no jerk
+    if (solver->particleMesh && (integrator == INTEGRATOR_HERMITE || integrator == INTEGRATOR_BLOCK)) {
+        integrator = INTEGRATOR_LEAPFROG;
+    }
+    switch (integrator) {
+        case INTEGRATOR_LEAPFROG: return leapfrogStep(oList, solver, deltaTime);
+        case INTEGRATOR_HERMITE: return hermiteStep(oList, solver, deltaTime, 0);
+        case INTEGRATOR_BLOCK: return hermiteStep(oList, solver, deltaTime, 1);
+        default: return eulerStep(oList, solver, deltaTime);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "particle.h"
+
+// Time integration of the CPU solvers. The GPU shaders always kick then
+// drift (INTEGRATOR_EULER); the other schemes run on the CPU tree or mesh.
+typedef enum Integrator {
+    INTEGRATOR_EULER,    // kick then drift (symplectic Euler), velocities half a step ahead
+    INTEGRATOR_LEAPFROG, // kick-drift-kick, one force evaluation per step
+    INTEGRATOR_HERMITE,  // 4th-order Hermite predictor-corrector (acceleration and jerk), shared step
+    INTEGRATOR_BLOCK,    // Hermite with per-particle steps of tick / 2^level
+    INTEGRATOR_COUNT
+} Integrator;
+
+// Finest block step: tick / 2^BLOCK_MAX_LEVEL
+#define BLOCK_MAX_LEVEL 8
+// Accuracy parameters of the block steps (Aarseth criterion; first step from |a| / |jerk|)
+#define BLOCK_ETA 0.02f
+#define BLOCK_ETA_START 0.01f
+
+// Where the accelerations come from
+typedef struct ForceSolver {
+    int particleMesh; // PM mesh instead of Barnes-Hut; has no jerk, so the Hermite schemes use leapfrog there
+    int meshSize;
+    float theta;      // Barnes-Hut opening angle, 0 = exact
+    float G;
+} ForceSolver;
+
+// Advance all particles by deltaTime. Accelerations (and jerks) from the end
+// of one step are reused at the start of the next while the particles stay
+// the same. Returns 0 when the solver buffers could not be allocated.
+int integrateStep(ObjectList* objList, Integrator integrator, const ForceSolver* solver, float deltaTime);
+
+// The stored accelerations no longer describe the particles: call after
+// anything but integrateStep moved, merged or removed them, unless it touched
+// the list (touchObjectList), which also drops them
+void invalidateIntegrator(void);
+void freeIntegrator(void);
+
+const char* integratorName(Integrator integrator);
+// Force evaluations of the last step (block steps: one per occupied substep)
+int integratorLastEvaluations(void);
+
+#endif
@@ -0,0 +1,472 @@
+#include "JobSystem.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Thin layer over the platform threads (kept out of the header: windows.h
+// clashes with raylib.h)
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+typedef CRITICAL_SECTION JobMutex;
+typedef CONDITION_VARIABLE JobCond;
+typedef HANDLE JobThread;
+static void mutexInit(JobMutex* m) { InitializeCriticalSection(m); }
+static void mutexDestroy(JobMutex* m) { DeleteCriticalSection(m); }
+static void mutexLock(JobMutex* m) { EnterCriticalSection(m); }
+static void mutexUnlock(JobMutex* m) { LeaveCriticalSection(m); }
+static void condInit(JobCond* c) { InitializeConditionVariable(c); }
+static void condDestroy(JobCond* c) { (void)c; }
+static void condWait(JobCond* c, JobMutex* m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void condBroadcast(JobCond* c) { WakeAllConditionVariable(c); }
+static void yieldThread(void) { SwitchToThread(); }
+static void sleepThread(double seconds) { Sleep((DWORD)(seconds * 1000.0)); }
+static double monotonicSeconds(void) {
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+static int coreCount(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+static int atomicLoad(volatile int* p) { return (int)InterlockedCompareExchange((volatile LONG*)p, 0, 0); }
+int jobAtomicAdd(volatile int* target, int value) { return (int)InterlockedExchangeAdd((volatile LONG*)target, value); }
+int jobAtomicExchange(volatile int* target, int value) { return (int)InterlockedExchange((volatile LONG*)target, value); }
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+typedef pthread_mutex_t JobMutex;
+typedef pthread_cond_t JobCond;
+typedef pthread_t JobThread;
+static void mutexInit(JobMutex* m) { pthread_mutex_init(m, NULL); }
+static void mutexDestroy(JobMutex* m) { pthread_mutex_destroy(m); }
+static void mutexLock(JobMutex* m) { pthread_mutex_lock(m); }
+static void mutexUnlock(JobMutex* m) { pthread_mutex_unlock(m); }
+static void condInit(JobCond* c) { pthread_cond_init(c, NULL); }
+static void condDestroy(JobCond* c) { pthread_cond_destroy(c); }
+static void condWait(JobCond* c, JobMutex* m) { pthread_cond_wait(c, m); }
+static void condBroadcast(JobCond* c) { pthread_cond_broadcast(c); }
+static void yieldThread(void) { sched_yield(); }
+static void sleepThread(double seconds) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+static double monotonicSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+static int coreCount(void) { return (int)sysconf(_SC_NPROCESSORS_ONLN); }
+static int atomicLoad(volatile int* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+int jobAtomicAdd(volatile int* target, int value) { return __atomic_fetch_add(target, value, __ATOMIC_ACQ_REL); }
+int jobAtomicExchange(volatile int* target, int value) { return __atomic_exchange_n(target, value, __ATOMIC_ACQ_REL); }
+#endif
+
+#if defined(_MSC_VER)
+#define JOB_THREAD_LOCAL __declspec(thread)
+#else
+#define JOB_THREAD_LOCAL __thread
+#endif
+
+// Jobs a worker can queue before further ones run inline
+#define JOB_DEQUE_SIZE 1024
+
+typedef struct Job {
+    JobRangeFn fn;
+    void* data;
+    int begin, end;
+    volatile int* pending; // decremented once the job has run
+} Job;
+
+typedef struct Worker {
+    JobMutex lock;
+    Job jobs[JOB_DEQUE_SIZE];
+    int head, tail;        // front (stolen from) and back (owner end), jobs[i % JOB_DEQUE_SIZE]
+    JobThread thread;
+    int index;
+} Worker;
+
+static Worker* gWorkers = NULL;
+static int gWorkerCount = 0;
+static volatile int gQueued = 0;   // jobs sitting in any deque
+static volatile int gShutdown = 0;
+static JobMutex gSleepLock;
+static JobCond gWake;
+static JOB_THREAD_LOCAL int tWorker = 0; // deque of the current thread, 0 = any thread outside the pool
+
+static int pushJob(const Job* job) {
+    if (gWorkerCount == 0) return 0;
+    Worker* w = &gWorkers[tWorker];
+    mutexLock(&w->lock);
+    int ok = w->tail - w->head < JOB_DEQUE_SIZE;
+    if (ok) {
+        w->jobs[w->tail % JOB_DEQUE_SIZE] = *job;
+        w->tail++;
+    }
+    mutexUnlock(&w->lock);
+    if (ok) jobAtomicAdd(&gQueued, 1);
+    return ok;
+}
+
+static void wakeWorkers(void) {
+    mutexLock(&gSleepLock);
+    condBroadcast(&gWake);
+    mutexUnlock(&gSleepLock);
+}
+
+// Newest job of the own deque (hot in cache)
+static int popJob(Job* out) {
+    Worker* w = &gWorkers[tWorker];
+    mutexLock(&w->lock);
+    int ok = w->tail > w->head;
+    if (ok) {
+        w->tail--;
+        *out = w->jobs[w->tail % JOB_DEQUE_SIZE];
+    }
+    mutexUnlock(&w->lock);
+    if (ok) jobAtomicAdd(&gQueued, -1);
+    return ok;
+}
+
+// Oldest job of another worker's deque (usually the largest remaining piece)
+static int stealJob(Job* out) {
+    for (int k = 1; k < gWorkerCount; k++) {
+        Worker* w = &gWorkers[(tWorker + k) % gWorkerCount];
+        mutexLock(&w->lock);
+        int ok = w->tail > w->head;
+        if (ok) {
+            *out = w->jobs[w->head % JOB_DEQUE_SIZE];
+            w->head++;
+        }
+        mutexUnlock(&w->lock);
+        if (ok) {
+            jobAtomicAdd(&gQueued, -1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void runJob(const Job* job) {
+    job->fn(job->data, job->begin, job->end);
+    jobAtomicAdd(job->pending, -1);
+}
+
+static int runOneJob(void) {
+    Job job;
+    if (gWorkerCount == 0) return 0;
+    if (!popJob(&job) && !stealJob(&job)) return 0;
+    runJob(&job);
+    return 1;
+}
+
+// Help out until *pending drops to zero
+static void waitFor(volatile int* pending) {
+    while (atomicLoad(pending) > 0) {
+        if (!runOneJob()) yieldThread();
+    }
+}
+
+static void workerLoop(Worker* self) {
+    tWorker = self->index;
+    while (!atomicLoad(&gShutdown)) {
+        if (runOneJob()) continue;
+        mutexLock(&gSleepLock);
+        while (atomicLoad(&gQueued) == 0 && !atomicLoad(&gShutdown)) condWait(&gWake, &gSleepLock);
+        mutexUnlock(&gSleepLock);
+    }
+}
+
+struct JobThreadHandle {
+    JobThread thread;
+    JobFn fn;
+    void* data;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI workerMain(LPVOID arg) {
+    workerLoop((Worker*)arg);
+    return 0;
+}
+static int startThread(Worker* w) {
+    w->thread = CreateThread(NULL, 0, workerMain, w, 0, NULL);
+    return w->thread != NULL;
+}
+static void joinThread(Worker* w) {
+    WaitForSingleObject(w->thread, INFINITE);
+    CloseHandle(w->thread);
+}
+static DWORD WINAPI handleMain(LPVOID arg) {
+    JobThreadHandle* t = arg;
+    t->fn(t->data);
+    return 0;
+}
+static int startHandle(JobThreadHandle* t) {
+    t->thread = CreateThread(NULL, 0, handleMain, t, 0, NULL);
+    return t->thread != NULL;
+}
+static void joinHandle(JobThreadHandle* t) {
+    WaitForSingleObject(t->thread, INFINITE);
+    CloseHandle(t->thread);
+}
+#else
+static void* workerMain(void* arg) {
+    workerLoop((Worker*)arg);
+    return NULL;
+}
+static int startThread(Worker* w) {
+    return pthread_create(&w->thread, NULL, workerMain, w) == 0;
+}
+static void joinThread(Worker* w) {
+    pthread_join(w->thread, NULL);
+}
+static void* handleMain(void* arg) {
+    JobThreadHandle* t = arg;
+    t->fn(t->data);
+    return NULL;
+}
+static int startHandle(JobThreadHandle* t) {
+    return pthread_create(&t->thread, NULL, handleMain, t) == 0;
+}
+static void joinHandle(JobThreadHandle* t) {
+    pthread_join(t->thread, NULL);
+}
+#endif
+
+void jobSystemInit(int threads) {
+    if (gWorkerCount > 0) return;
+    if (threads <= 0) threads = coreCount();
+    if (threads < 1) threads = 1;
+    gWorkers = calloc((size_t)threads, sizeof(Worker));
+    if (!gWorkers) {
+        threads = 1;
+        gWorkers = calloc(1, sizeof(Worker));
+        if (!gWorkers) return; // jobs then run inline
+    }
+    for (int i = 0; i < threads; i++) {
+        mutexInit(&gWorkers[i].lock);
+        gWorkers[i].index = i;
+    }
+    mutexInit(&gSleepLock);
+    condInit(&gWake);
+    gShutdown = 0;
+    gQueued = 0;
+    tWorker = 0;
+    gWorkerCount = threads;
+    for (int i = 1; i < threads; i++) {
+        if (!startThread(&gWorkers[i])) {
+            // Keep the workers that did start
+            gWorkerCount = i;
+            break;
+        }
+    }
+}
+
+void jobSystemShutdown(void) {
+    if (gWorkerCount == 0) return;
+    jobAtomicAdd(&gShutdown, 1);
+    wakeWorkers();
+    for (int i = 1; i < gWorkerCount; i++) joinThread(&gWorkers[i]);
+    for (int i = 0; i < gWorkerCount; i++) mutexDestroy(&gWorkers[i].lock);
+    mutexDestroy(&gSleepLock);
+    condDestroy(&gWake);
+    free(gWorkers);
+    gWorkers = NULL;
+    gWorkerCount = 0;
+    gShutdown = 0;
+}
+
+int jobWorkerCount(void) {
+    if (gWorkerCount == 0) jobSystemInit(0);
+    return gWorkerCount > 0 ? gWorkerCount : 1;
+}
+
+void jobParallelFor(int count, int grain, JobRangeFn fn, void* data) {
+    if (count <= 0) return;
+    int workers = jobWorkerCount();
+    int chunk = (count + workers * 4 - 1) / (workers * 4);
+    if (grain < chunk) grain = chunk;
+    if (grain < 1) grain = 1;
+    if (workers == 1 || count <= grain) {
+        fn(data, 0, count);
+        return;
+    }
+    volatile int pending = (count + grain - 1) / grain;
+    for (int begin = 0; begin < count; begin += grain) {
+        Job job = { fn, data, begin, begin + grain < count ? begin + grain : count, &pending };
+        if (!pushJob(&job)) runJob(&job);
+    }
+    wakeWorkers();
+    waitFor(&pending);
+}
+
+// --- Task graph ---
+
+typedef struct GraphNode {
+    JobFn fn;
+    void* data;
+    int* dependents;       // jobs waiting for this one
+    int dependentCount;
+    int dependentCapacity;
+    int waitCount;         // number of jobs this one waits for
+    volatile int remaining;
+} GraphNode;
+
+struct JobGraph {
+    GraphNode* nodes;      // [count, capacity) keep their dependents buffers for reuse
+    int count;
+    int capacity;
+    int incomplete;        // an add or a dependency failed since the last reset
+    volatile int pending;  // jobs not finished yet
+};
+
+JobGraph* jobGraphCreate(void) {
+    return calloc(1, sizeof(JobGraph));
+}
+
+void jobGraphReset(JobGraph* graph) {
+    graph->count = 0;
+    graph->incomplete = 0;
+}
+
+int jobGraphAdd(JobGraph* graph, JobFn fn, void* data) {
+    if (graph->count == graph->capacity) {
+        int newCap = graph->capacity > 0 ? graph->capacity * 2 : 8;
+        GraphNode* nodes = realloc(graph->nodes, sizeof(GraphNode) * (size_t)newCap);
+        if (!nodes) {
+            graph->incomplete = 1;
+            return -1;
+        }
+        memset(&nodes[graph->capacity], 0, sizeof(GraphNode) * (size_t)(newCap - graph->capacity));
+        graph->nodes = nodes;
+        graph->capacity = newCap;
+    }
+    GraphNode* node = &graph->nodes[graph->count];
+    node->fn = fn;
+    node->data = data;
+    node->dependentCount = 0;
+    node->waitCount = 0;
+    node->remaining = 0;
+    return graph->count++;
+}
+
+int jobGraphDepend(JobGraph* graph, int job, int before) {
+    if (job < 0 || before < 0 || job >= graph->count || before >= graph->count) {
+        graph->incomplete = 1;
+        return 0;
+    }
+    GraphNode* first = &graph->nodes[before];
+    if (first->dependentCount == first->dependentCapacity) {
+        int newCap = first->dependentCapacity > 0 ? first->dependentCapacity * 2 : 4;
+        int* dependents = realloc(first->dependents, sizeof(int) * (size_t)newCap);
+        if (!dependents) {
+            graph->incomplete = 1;
+            return 0;
+        }
+        first->dependents = dependents;
+        first->dependentCapacity = newCap;
+    }
+    first->dependents[first->dependentCount++] = job;
+    graph->nodes[job].waitCount++;
+    return 1;
+}
+
+static void runGraphNode(void* data, int begin, int end);
+
+static void queueGraphNode(JobGraph* graph, int index) {
+    Job job = { runGraphNode, graph, index, index + 1, &graph->pending };
+    if (!pushJob(&job)) runJob(&job);
+}
+
+// Run one node, then release the jobs that were only waiting for it
+static void runGraphNode(void* data, int begin, int end) {
+    (void)end;
+    JobGraph* graph = data;
+    GraphNode* node = &graph->nodes[begin];
+    node->fn(node->data);
+    int released = 0;
+    for (int d = 0; d < node->dependentCount; d++) {
+        int next = node->dependents[d];
+        if (jobAtomicAdd(&graph->nodes[next].remaining, -1) == 1) {
+            queueGraphNode(graph, next);
+            released = 1;
+        }
+    }
+    if (released) wakeWorkers();
+}
+
+int jobGraphRun(JobGraph* graph) {
+    // A missing job or edge could let a job run without its input
+    if (graph->incomplete) return 0;
+    if (graph->count == 0) return 1;
+    jobWorkerCount();
+    for (int i = 0; i < graph->count; i++) graph->nodes[i].remaining = graph->nodes[i].waitCount;
+    graph->pending = graph->count;
+    for (int i = 0; i < graph->count; i++) {
+        if (graph->nodes[i].waitCount == 0) queueGraphNode(graph, i);
+    }
+    wakeWorkers();
+    waitFor(&graph->pending);
+    return 1;
+}
+
+void jobGraphFree(JobGraph* graph) {
+    if (!graph) return;
+    for (int i = 0; i < graph->capacity; i++) free(graph->nodes[i].dependents);
+    free(graph->nodes);
+    free(graph);
+}
+
+// --- Threads and locks outside the pool ---
+
+JobThreadHandle* jobThreadStart(JobFn fn, void* data) {
+    JobThreadHandle* t = calloc(1, sizeof(JobThreadHandle));
+    if (!t) return NULL;
+    t->fn = fn;
+    t->data = data;
+    if (!startHandle(t)) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void jobThreadJoin(JobThreadHandle* thread) {
+    if (!thread) return;
+    joinHandle(thread);
+    free(thread);
+}
+
+struct JobLock {
+    JobMutex mutex;
+};
+
+JobLock* jobLockCreate(void) {
+    JobLock* lock = malloc(sizeof(JobLock));
+    if (lock) mutexInit(&lock->mutex);
+    return lock;
+}
+
+void jobLockAcquire(JobLock* lock) { mutexLock(&lock->mutex); }
+void jobLockRelease(JobLock* lock) { mutexUnlock(&lock->mutex); }
+
+void jobLockFree(JobLock* lock) {
+    if (!lock) return;
+    mutexDestroy(&lock->mutex);
+    free(lock);
+}
+
+void jobSleep(double seconds) {
+    if (seconds <= 0.0) yieldThread();
+    else sleepThread(seconds);
+}
+
+double jobTime(void) {
+    return monotonicSeconds();
+}
@@ -0,0 +1,56 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+// Small work-stealing job scheduler for the CPU side of a tick. Every worker
+// owns a deque: it pushes and pops its own jobs at the back, idle workers
+// steal from the front of the others. Waiting never blocks a worker, it
+// keeps running queued jobs until the ones it waits for are done, so jobs
+// may start and wait for more jobs themselves.
+// Started lazily with one worker per core (the calling thread included).
+
+// Work on the index range [begin, end)
+typedef void (*JobRangeFn)(void* data, int begin, int end);
+typedef void (*JobFn)(void* data);
+
+// Start with `threads` workers including the calling thread, 0 = one per core.
+// Called implicitly by the first job; a running system is left alone.
+void jobSystemInit(int threads);
+void jobSystemShutdown(void);
+int jobWorkerCount(void);
+
+// Split [0, count) into chunks, a few per worker but never smaller than
+// `grain` indices, and run them on all workers. Returns once every chunk has
+// finished; a range of at most `grain` indices runs inline.
+void jobParallelFor(int count, int grain, JobRangeFn fn, void* data);
+
+// Task graph: jobs run once every job they depend on has finished. A graph
+// kept between runs is emptied with jobGraphReset and reuses its memory.
+// When an add or a dependency fails (out of memory) the graph is incomplete
+// and jobGraphRun refuses it until the next reset.
+typedef struct JobGraph JobGraph;
+JobGraph* jobGraphCreate(void);
+void jobGraphReset(JobGraph* graph);                      // no jobs, complete again
+int  jobGraphAdd(JobGraph* graph, JobFn fn, void* data);  // returns the job's handle, -1 on failure
+int  jobGraphDepend(JobGraph* graph, int job, int before); // `job` waits for `before`; 0 on failure
+int  jobGraphRun(JobGraph* graph);                        // runs all jobs, then returns 1; 0 if incomplete
+void jobGraphFree(JobGraph* graph);
+
+// Atomic fetch-and-add for reductions inside jobs; returns the previous value
+int jobAtomicAdd(volatile int* target, int value);
+int jobAtomicExchange(volatile int* target, int value); // returns the previous value
+
+// Platform helpers for long-running threads next to the pool, e.g. a loop
+// that hands its heavy work to the pool. Threads outside the pool may call
+// jobParallelFor and run graphs; they share the first deque.
+typedef struct JobThreadHandle JobThreadHandle;
+JobThreadHandle* jobThreadStart(JobFn fn, void* data); // NULL on failure
+void jobThreadJoin(JobThreadHandle* thread);           // waits for fn to return, frees the handle
+typedef struct JobLock JobLock;
+JobLock* jobLockCreate(void);
+void jobLockAcquire(JobLock* lock);
+void jobLockRelease(JobLock* lock);
+void jobLockFree(JobLock* lock);
+void jobSleep(double seconds); // <= 0 just yields
+double jobTime(void);          // monotonic seconds; needs no window, unlike raylib's GetTime
+
+#endif
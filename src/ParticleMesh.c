@@ -0,0 +1,457 @@
+#include "ParticleMesh.h"
+#include "JobSystem.h"
+#include <string.h>
+
+#define PM_PI 3.14159265358979323846
+
+// Buffers are kept between steps and rebuilt when the mesh size changes
+static int gMesh = 0;               // M: mesh nodes per axis
+static int gPad = 0;                // P = 2M: padded FFT size per axis
+static float* gWork = NULL;         // P^3 complex values (re, im interleaved)
+static float* gGreen = NULL;        // P^3 complex, transformed Green's function
+static float* gPotential = NULL;    // M^3, potential in mesh units
+static float* gMass = NULL;         // M^3 per slice, CIC mass deposition
+static float* gTwiddle = NULL;      // P/2 complex roots of unity
+static int* gBitReverse = NULL;     // P
+static int gSlices = 0;             // particle slices deposited into their own mesh copy
+
+static inline size_t padIndex(int i, int j, int k) {
+    return ((size_t)k * gPad + j) * gPad + i;
+}
+
+static inline size_t meshIndex(int i, int j, int k) {
+    return ((size_t)k * gMesh + j) * gMesh + i;
+}
+
+// In-place iterative radix-2 FFT of n complex values (n == gPad)
+static void fftLine(float* line, int inverse) {
+    int n = gPad;
+    for (int i = 0; i < n; i++) {
+        int r = gBitReverse[i];
+        if (r > i) {
+            float re = line[2*i], im = line[2*i+1];
+            line[2*i] = line[2*r];
+            line[2*i+1] = line[2*r+1];
+            line[2*r] = re;
+            line[2*r+1] = im;
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        int half = len >> 1;
+        int step = n / len;
+        for (int start = 0; start < n; start += len) {
+            for (int k = 0; k < half; k++) {
+                float wr = gTwiddle[2 * k * step];
+                float wi = inverse ? -gTwiddle[2 * k * step + 1] : gTwiddle[2 * k * step + 1];
+                float* a = &line[2 * (start + k)];
+                float* b = &line[2 * (start + k + half)];
+                float tr = b[0] * wr - b[1] * wi;
+                float ti = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+typedef struct FFTPass {
+    float* data;
+    int axis;
+    int limitA;
+    int inverse;
+} FFTPass;
+
+// Lines [begin, end) of the limitA x limitB set, with a private scratch line
+static void fftLines(void* data, int begin, int end) {
+    const FFTPass* pass = data;
+    int P = gPad;
+    float line[2 * 2 * PM_MAX_MESH_SIZE];
+    float* values = pass->data;
+    for (int l = begin; l < end; l++) {
+        int a = l % pass->limitA, b = l / pass->limitA;
+        size_t base, stride;
+        if (pass->axis == 0)      { base = padIndex(0, a, b); stride = 1; }
+        else if (pass->axis == 1) { base = padIndex(a, 0, b); stride = (size_t)P; }
+        else                      { base = padIndex(a, b, 0); stride = (size_t)P * P; }
+        for (int i = 0; i < P; i++) {
+            line[2*i] = values[2 * (base + i * stride)];
+            line[2*i+1] = values[2 * (base + i * stride) + 1];
+        }
+        fftLine(line, pass->inverse);
+        for (int i = 0; i < P; i++) {
+            values[2 * (base + i * stride)] = line[2*i];
+            values[2 * (base + i * stride) + 1] = line[2*i+1];
+        }
+    }
+}
+
+// FFT along one axis of the padded volume. Only lines whose other two
+// coordinates are below the given limits are transformed; the rest are
+// known to be zero (forward) or not needed (inverse).
+static void fftAxis(float* data, int axis, int limitA, int limitB, int inverse) {
+    FFTPass pass = { data, axis, limitA, inverse };
+    jobParallelFor(limitA * limitB, 16, fftLines, &pass);
+}
+
+static void greenSlabs(void* data, int begin, int end) {
+    (void)data;
+    int P = gPad;
+    for (int k = begin; k < end; k++) {
+        int dk = k <= P / 2 ? k : P - k;
+        for (int j = 0; j < P; j++) {
+            int dj = j <= P / 2 ? j : P - j;
+            for (int i = 0; i < P; i++) {
+                int di = i <= P / 2 ? i : P - i;
+                float r = sqrtf((float)(di*di + dj*dj + dk*dk));
+                size_t idx = padIndex(i, j, k);
+                gGreen[2*idx] = 1.0f / (r < 1.0f ? 1.0f : r);
+                gGreen[2*idx+1] = 0.0f;
+            }
+        }
+    }
+}
+
+// Free-space Green's function 1/r in mesh units, softened to one spacing and
+// wrapped onto the padded mesh, then transformed once per mesh size
+static void buildGreen(void) {
+    int P = gPad;
+    jobParallelFor(P, 1, greenSlabs, NULL);
+    fftAxis(gGreen, 0, P, P, 0);
+    fftAxis(gGreen, 1, P, P, 0);
+    fftAxis(gGreen, 2, P, P, 0);
+}
+
+static int reserveMesh(int meshSize) {
+    int slices = jobWorkerCount();
+    if (meshSize == gMesh && slices <= gSlices) return 1;
+    freeParticleMesh();
+
+    int M = meshSize, P = 2 * meshSize;
+    size_t padCount = (size_t)P * P * P;
+    size_t meshCount = (size_t)M * M * M;
+    gWork = alignedAlloc(sizeof(float) * 2 * padCount);
+    gGreen = alignedAlloc(sizeof(float) * 2 * padCount);
+    gPotential = alignedAlloc(sizeof(float) * meshCount);
+    gMass = alignedAlloc(sizeof(float) * meshCount * slices);
+    gTwiddle = alignedAlloc(sizeof(float) * P);
+    gBitReverse = alignedAlloc(sizeof(int) * P);
+    if (!gWork || !gGreen || !gPotential || !gMass || !gTwiddle || !gBitReverse) {
+        freeParticleMesh();
+        return 0;
+    }
+    gMesh = M;
+    gPad = P;
+    gSlices = slices;
+
+    int bits = 0;
+    while ((1 << bits) < P) bits++;
+    for (int i = 0; i < P; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+        gBitReverse[i] = r;
+    }
+    for (int k = 0; k < P / 2; k++) {
+        double angle = -2.0 * PM_PI * k / P;
+        gTwiddle[2*k] = (float)cos(angle);
+        gTwiddle[2*k+1] = (float)sin(angle);
+    }
+    buildGreen();
+    return 1;
+}
+
+// Mesh coordinates of one particle: base node and CIC weights along one axis
+static inline void cicAxis(float u, int* i, float* w0, float* w1) {
+    int base = (int)u;
+    float f = u - (float)base;
+    *i = base;
+    *w0 = 1.0f - f;
+    *w1 = f;
+}
+
+typedef struct DepositPass {
+    const ObjectList* oList;
+    float ox, oy, oz, invH;
+    int slices;
+} DepositPass;
+
+// Particles of one slice into that slice's copy of the mesh
+static void depositSlices(void* data, int begin, int end) {
+    const DepositPass* pass = data;
+    const ObjectList* oList = pass->oList;
+    int n = oList->size, M = gMesh;
+    size_t meshCount = (size_t)M * M * M;
+    const float* px = oList->posX;
+    const float* py = oList->posY;
+    const float* pz = oList->posZ;
+    const float* pm = oList->mass;
+    for (int t = begin; t < end; t++) {
+        float* mass = &gMass[meshCount * t];
+        memset(mass, 0, sizeof(float) * meshCount);
+        int first = (int)((long)n * t / pass->slices);
+        int last = (int)((long)n * (t + 1) / pass->slices);
+        for (int p = first; p < last; p++) {
+            int i, j, k;
+            float wx0, wx1, wy0, wy1, wz0, wz1;
+            cicAxis((px[p] - pass->ox) * pass->invH, &i, &wx0, &wx1);
+            cicAxis((py[p] - pass->oy) * pass->invH, &j, &wy0, &wy1);
+            cicAxis((pz[p] - pass->oz) * pass->invH, &k, &wz0, &wz1);
+            float m = pm[p];
+            float* c = &mass[meshIndex(i, j, k)];
+            c[0]             += m * wx0 * wy0 * wz0;
+            c[1]             += m * wx1 * wy0 * wz0;
+            c[M]             += m * wx0 * wy1 * wz0;
+            c[M + 1]         += m * wx1 * wy1 * wz0;
+            c[M*M]           += m * wx0 * wy0 * wz1;
+            c[M*M + 1]       += m * wx1 * wy0 * wz1;
+            c[M*M + M]       += m * wx0 * wy1 * wz1;
+            c[M*M + M + 1]   += m * wx1 * wy1 * wz1;
+        }
+    }
+}
+
+// Reduce the slice copies into the first one, split by z slabs
+static void reduceSlabs(void* data, int begin, int end) {
+    const DepositPass* pass = data;
+    int M = gMesh;
+    size_t meshCount = (size_t)M * M * M;
+    for (int k = begin; k < end; k++) {
+        float* dst = &gMass[(size_t)k * M * M];
+        for (int other = 1; other < pass->slices; other++) {
+            const float* src = &gMass[meshCount * other + (size_t)k * M * M];
+            for (int c = 0; c < M * M; c++) dst[c] += src[c];
+        }
+    }
+}
+
+// Cloud-in-cell deposition; every slice of the particles fills its own copy of the mesh
+static void depositMass(const ObjectList* oList, float ox, float oy, float oz, float invH) {
+    DepositPass pass = { oList, ox, oy, oz, invH, gSlices };
+    jobParallelFor(gSlices, 1, depositSlices, &pass);
+    jobParallelFor(gMesh, 1, reduceSlabs, &pass);
+}
+
+static void copyMassSlabs(void* data, int begin, int end) {
+    (void)data;
+    int M = gMesh;
+    for (int k = begin; k < end; k++)
+        for (int j = 0; j < M; j++)
+            for (int i = 0; i < M; i++)
+                gWork[2 * padIndex(i, j, k)] = gMass[meshIndex(i, j, k)];
+}
+
+static void multiplyGreen(void* data, int begin, int end) {
+    (void)data;
+    for (long c = begin; c < end; c++) {
+        float ar = gWork[2*c], ai = gWork[2*c+1];
+        float br = gGreen[2*c], bi = gGreen[2*c+1];
+        gWork[2*c] = ar * br - ai * bi;
+        gWork[2*c+1] = ar * bi + ai * br;
+    }
+}
+
+static void copyPotentialSlabs(void* data, int begin, int end) {
+    float scale = *(const float*)data;
+    int M = gMesh;
+    for (int k = begin; k < end; k++)
+        for (int j = 0; j < M; j++)
+            for (int i = 0; i < M; i++)
+                gPotential[meshIndex(i, j, k)] = gWork[2 * padIndex(i, j, k)] * scale;
+}
+
+// Potential in mesh units: phi = -(mass (*) 1/r), the convolution done by FFT
+static void solvePotential(void) {
+    int M = gMesh, P = gPad;
+    size_t padCount = (size_t)P * P * P;
+    memset(gWork, 0, sizeof(float) * 2 * padCount);
+    jobParallelFor(M, 1, copyMassSlabs, NULL);
+
+    // Forward: the mass only occupies the first octant of the padded mesh
+    fftAxis(gWork, 0, M, M, 0);
+    fftAxis(gWork, 1, P, M, 0);
+    fftAxis(gWork, 2, P, P, 0);
+
+    jobParallelFor((int)padCount, 4096, multiplyGreen, NULL);
+
+    // Inverse: only the first octant is read back
+    fftAxis(gWork, 2, P, P, 1);
+    fftAxis(gWork, 1, P, M, 1);
+    fftAxis(gWork, 0, M, M, 1);
+
+    float scale = -1.0f / (float)padCount;
+    jobParallelFor(M, 1, copyPotentialSlabs, &scale);
+}
+
+// Potential gradient at a mesh node by central differences (one-sided at the border)
+static inline float gradientAt(int i, int j, int k, int axis) {
+    int M = gMesh;
+    int c[3] = { i, j, k };
+    int lo[3] = { i, j, k }, hi[3] = { i, j, k };
+    lo[axis] = c[axis] > 0 ? c[axis] - 1 : c[axis];
+    hi[axis] = c[axis] < M - 1 ? c[axis] + 1 : c[axis];
+    float span = (float)(hi[axis] - lo[axis]);
+    return (gPotential[meshIndex(hi[0], hi[1], hi[2])] - gPotential[meshIndex(lo[0], lo[1], lo[2])]) / span;
+}
+
+typedef struct KickPass {
+    ObjectList* oList;
+    float ox, oy, oz, invH;
+    float kick;
+    float* acc;            // not NULL: store kick * gradient here (3 per slot) instead of kicking
+} KickPass;
+
+static void kickRange(void* data, int begin, int end) {
+    const KickPass* pass = data;
+    ObjectList* oList = pass->oList;
+    float invH = pass->invH;
+    for (int p = begin; p < end; p++) {
+        int i, j, k;
+        float wx[2], wy[2], wz[2];
+        cicAxis((oList->posX[p] - pass->ox) * invH, &i, &wx[0], &wx[1]);
+        cicAxis((oList->posY[p] - pass->oy) * invH, &j, &wy[0], &wy[1]);
+        cicAxis((oList->posZ[p] - pass->oz) * invH, &k, &wz[0], &wz[1]);
+        float gx = 0.0f, gy = 0.0f, gz = 0.0f;
+        for (int c = 0; c < 8; c++) {
+            int dx = c & 1, dy = (c >> 1) & 1, dz = c >> 2;
+            float w = wx[dx] * wy[dy] * wz[dz];
+            gx += w * gradientAt(i + dx, j + dy, k + dz, 0);
+            gy += w * gradientAt(i + dx, j + dy, k + dz, 1);
+            gz += w * gradientAt(i + dx, j + dy, k + dz, 2);
+        }
+        if (pass->acc) {
+            pass->acc[3 * p + 0] = pass->kick * gx;
+            pass->acc[3 * p + 1] = pass->kick * gy;
+            pass->acc[3 * p + 2] = pass->kick * gz;
+        } else {
+            oList->velX[p] += pass->kick * gx;
+            oList->velY[p] += pass->kick * gy;
+            oList->velZ[p] += pass->kick * gz;
+        }
+    }
+}
+
+// Deposit the current particles and solve their potential; the mesh
+// placement goes to pass. 0 when out of memory.
+static int solveMesh(ObjectList* oList, int meshSize, KickPass* pass) {
+    int n = oList->size;
+    int m = PM_MIN_MESH_SIZE;
+    while (m < meshSize && m < PM_MAX_MESH_SIZE) m *= 2;
+    if (!reserveMesh(m)) {
+        fprintf(stderr, "[ERROR] Could not allocate Particle-Mesh buffers.\n");
+        return 0;
+    }
+    int M = gMesh;
+
+    // Bounding cube; one spare node on each side keeps the CIC stencil and
+    // the central differences inside the mesh
+    float minX = oList->posX[0], maxX = minX;
+    float minY = oList->posY[0], maxY = minY;
+    float minZ = oList->posZ[0], maxZ = minZ;
+    for (int i = 1; i < n; i++) {
+        float x = oList->posX[i], y = oList->posY[i], z = oList->posZ[i];
+        if (x < minX) minX = x;
+        if (y < minY) minY = y;
+        if (z < minZ) minZ = z;
+        if (x > maxX) maxX = x;
+        if (y > maxY) maxY = y;
+        if (z > maxZ) maxZ = z;
+    }
+    float extent = fmaxf(maxX - minX, fmaxf(maxY - minY, maxZ - minZ));
+    float h = extent > 0.0f ? extent * 1.001f / (float)(M - 4) : 1.0f;
+    float invH = 1.0f / h;
+    float ox = minX - h, oy = minY - h, oz = minZ - h;
+
+    depositMass(oList, ox, oy, oz, invH);
+    solvePotential();
+
+    *pass = (KickPass){ oList, ox, oy, oz, invH, 0.0f, NULL };
+    if (DEBUG_MODE) printf("[computeParticleMeshGravity] %d bodies, mesh %d^3, spacing %.3f\n", n, M, h);
+    return 1;
+}
+
+// Solve the potential and interpolate the acceleration back to every
+// particle: as a kick of length deltaTime, or, when acc is not NULL,
+// written there times deltaTime. 0 when out of memory.
+static int kickMesh(ObjectList* oList, int meshSize, float deltaTime, float G, float* acc) {
+    if (oList->size == 0) return 1;
+    KickPass pass;
+    if (!solveMesh(oList, meshSize, &pass)) return 0;
+
+    // Interpolate a = -grad(phi) back with the same CIC weights.
+    // Mesh units: phi_world = G / h * phi_mesh, gradient another 1 / h.
+    pass.kick = -G * pass.invH * pass.invH * deltaTime;
+    pass.acc = acc;
+    jobParallelFor(oList->size, 1024, kickRange, &pass);
+    return 1;
+}
+
+void computeParticleMeshGravity(ObjectList* oList, int meshSize, float deltaTime, float G) {
+    kickMesh(oList, meshSize, deltaTime, G, NULL);
+}
+
+int computeParticleMeshAccelerations(ObjectList* oList, int meshSize, float G, float* acc) {
+    return kickMesh(oList, meshSize, 1.0f, G, acc);
+}
+
+// Fixed particle slices, so the sum does not depend on the worker count
+#define PM_POTENTIAL_SLICES 64
+
+typedef struct PotentialPass {
+    const KickPass* mesh;
+    double sums[PM_POTENTIAL_SLICES]; // sum of m * phi_mesh per slice
+} PotentialPass;
+
+static void potentialSlices(void* data, int begin, int end) {
+    PotentialPass* pass = data;
+    const KickPass* mesh = pass->mesh;
+    const ObjectList* oList = mesh->oList;
+    int n = oList->size;
+    for (int t = begin; t < end; t++) {
+        int first = (int)((long)n * t / PM_POTENTIAL_SLICES);
+        int last = (int)((long)n * (t + 1) / PM_POTENTIAL_SLICES);
+        double sum = 0.0;
+        for (int p = first; p < last; p++) {
+            int i, j, k;
+            float wx[2], wy[2], wz[2];
+            cicAxis((oList->posX[p] - mesh->ox) * mesh->invH, &i, &wx[0], &wx[1]);
+            cicAxis((oList->posY[p] - mesh->oy) * mesh->invH, &j, &wy[0], &wy[1]);
+            cicAxis((oList->posZ[p] - mesh->oz) * mesh->invH, &k, &wz[0], &wz[1]);
+            float phi = 0.0f;
+            for (int c = 0; c < 8; c++) {
+                int dx = c & 1, dy = (c >> 1) & 1, dz = c >> 2;
+                phi += wx[dx] * wy[dy] * wz[dz] * gPotential[meshIndex(i + dx, j + dy, k + dz)];
+            }
+            sum += (double)oList->mass[p] * phi;
+        }
+        pass->sums[t] = sum;
+    }
+}
+
+int computeParticleMeshPotential(ObjectList* oList, int meshSize, float G, double* energy) {
+    *energy = 0.0;
+    if (oList->size == 0) return 1;
+    KickPass mesh;
+    if (!solveMesh(oList, meshSize, &mesh)) return 0;
+
+    PotentialPass pass;
+    pass.mesh = &mesh;
+    jobParallelFor(PM_POTENTIAL_SLICES, 1, potentialSlices, &pass);
+    double sum = 0.0;
+    for (int t = 0; t < PM_POTENTIAL_SLICES; t++) sum += pass.sums[t];
+    // Every pair counted from both sides; phi_world = G / h * phi_mesh
+    *energy = 0.5 * (double)G * (double)mesh.invH * sum;
+    return 1;
+}
+
+void freeParticleMesh(void) {
+    alignedFree(gWork);
+    alignedFree(gGreen);
+    alignedFree(gPotential);
+    alignedFree(gMass);
+    alignedFree(gTwiddle);
+    alignedFree(gBitReverse);
+    gWork = gGreen = gPotential = gMass = gTwiddle = NULL;
+    gBitReverse = NULL;
+    gMesh = gPad = gSlices = 0;
+}
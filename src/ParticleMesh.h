@@ -0,0 +1,33 @@
+#ifndef PARTICLE_MESH_H
+#define PARTICLE_MESH_H
+
+#include "particle.h"
+
+// Mesh nodes per axis covering the particles' bounding cube. Must be a power
+// of two; the FFT runs on a zero-padded mesh of twice that size (isolated
+// boundaries), so memory grows with 8 * size^3.
+#define PM_DEFAULT_MESH_SIZE 64
+#define PM_MIN_MESH_SIZE 16
+#define PM_MAX_MESH_SIZE 128
+
+// Particle-Mesh gravity: cloud-in-cell mass deposition, FFT Poisson solve
+// against the free-space Green's function, central-difference gradients and
+// CIC interpolation back to the particles. Applies one kick of length
+// deltaTime to every velocity; positions are not changed. Forces are softened
+// to roughly one mesh spacing, so close encounters are not resolved.
+void computeParticleMeshGravity(ObjectList* objList, int meshSize, float deltaTime, float G);
+
+// The same accelerations written to acc (3 floats per slot) instead of applied;
+// 0 when the mesh could not be allocated
+int computeParticleMeshAccelerations(ObjectList* objList, int meshSize, float G, float* acc);
+
+// Total potential energy 0.5 * sum m_i phi_i, phi interpolated from the mesh
+// with the CIC weights. Includes each particle's softened interaction with
+// its own deposited cloud, so it sits below the tree value by a roughly
+// constant offset. 0 when the mesh could not be allocated.
+int computeParticleMeshPotential(ObjectList* objList, int meshSize, float G, double* energy);
+
+// Release the mesh buffers kept between calls
+void freeParticleMesh(void);
+
+#endif
@@ -0,0 +1,253 @@
+#include "Profiler.h"
+#include "JobSystem.h"
+#include "compute.h" // gl3w for the timer queries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// GPU zones in flight (begin/end query pairs), collected in order
+#define PROFILER_GPU_QUERIES 128
+
+#if defined(_MSC_VER)
+#define PROFILER_THREAD_LOCAL __declspec(thread)
+#else
+#define PROFILER_THREAD_LOCAL __thread
+#endif
+
+typedef struct ProfilerZoneInfo {
+    const char* name;
+    int gpu;
+    double frameMs;                  // accumulated in the open frame
+    float history[PROFILER_HISTORY]; // ring, newest at historyHead - 1
+    int historyHead;
+    int historyCount;
+} ProfilerZoneInfo;
+
+typedef struct TraceEvent {
+    int zone;
+    int thread;                      // 0 = GPU
+    double start;                    // seconds (jobTime)
+    double duration;
+} TraceEvent;
+
+typedef struct GPUQuerySlot {
+    int zone;
+    int ended;
+    double cpuStart;
+} GPUQuerySlot;
+
+static volatile int gLock = 0;       // spin lock over zones and trace
+static int gEnabled = 1;
+static int gGPUEnabled = 0;
+static ProfilerZoneInfo gZones[PROFILER_MAX_ZONES];
+static volatile int gZoneCount = 0;
+static TraceEvent gTrace[PROFILER_TRACE_EVENTS];
+static long gTraceCount = 0;         // events ever recorded; the ring keeps the newest
+static volatile int gNextThread = 0;
+static PROFILER_THREAD_LOCAL int tThread = 0;
+
+static GLuint gQueries[2 * PROFILER_GPU_QUERIES];
+static GPUQuerySlot gQuerySlots[PROFILER_GPU_QUERIES];
+static int gQueriesReady = 0;
+static unsigned int gQueryHead = 0;  // next slot to begin
+static unsigned int gQueryTail = 0;  // oldest slot not collected
+
+static void lockProfiler(void) {
+    while (jobAtomicExchange(&gLock, 1)) jobSleep(0.0);
+}
+
+static void unlockProfiler(void) {
+    jobAtomicExchange(&gLock, 0);
+}
+
+// Small id of the calling thread, 1 upwards
+static int threadId(void) {
+    if (tThread == 0) tThread = jobAtomicAdd(&gNextThread, 1) + 1;
+    return tThread;
+}
+
+// Index of the zone, registered on first use; -1 when the table is full
+static int findZone(const char* name, int gpu) {
+    int count = jobAtomicAdd(&gZoneCount, 0);
+    for (int z = 0; z < count; z++) {
+        if (gZones[z].gpu == gpu && (gZones[z].name == name || strcmp(gZones[z].name, name) == 0)) return z;
+    }
+    lockProfiler();
+    int zone = -1;
+    for (int z = 0; z < gZoneCount; z++) {
+        if (gZones[z].gpu == gpu && strcmp(gZones[z].name, name) == 0) zone = z;
+    }
+    if (zone < 0 && gZoneCount < PROFILER_MAX_ZONES) {
+        zone = gZoneCount;
+        memset(&gZones[zone], 0, sizeof(ProfilerZoneInfo));
+        gZones[zone].name = name;
+        gZones[zone].gpu = gpu;
+        jobAtomicExchange(&gZoneCount, gZoneCount + 1); // published after the entry is filled
+    }
+    unlockProfiler();
+    return zone;
+}
+
+// Add a finished zone to its frame total and to the trace (caller holds the lock)
+static void recordZone(int zone, int thread, double start, double duration) {
+    gZones[zone].frameMs += duration * 1000.0;
+    TraceEvent* event = &gTrace[gTraceCount % PROFILER_TRACE_EVENTS];
+    event->zone = zone;
+    event->thread = thread;
+    event->start = start;
+    event->duration = duration;
+    gTraceCount++;
+}
+
+void profilerSetEnabled(int enabled) { gEnabled = enabled ? 1 : 0; }
+int profilerIsEnabled(void) { return gEnabled; }
+void profilerEnableGPU(int enabled) { gGPUEnabled = enabled ? 1 : 0; }
+
+ProfileZone profileBegin(const char* name) {
+    ProfileZone zone = { -1, -1, 0.0 };
+    if (!gEnabled) return zone;
+    zone.zone = findZone(name, 0);
+    zone.start = jobTime();
+    return zone;
+}
+
+void profileEnd(ProfileZone zone) {
+    if (zone.zone < 0) return;
+    double end = jobTime();
+    int thread = threadId();
+    lockProfiler();
+    recordZone(zone.zone, thread, zone.start, end - zone.start);
+    unlockProfiler();
+}
+
+ProfileZone profileGPUBegin(const char* name) {
+    ProfileZone zone = { -1, -1, 0.0 };
+    if (!gEnabled || !gGPUEnabled) return zone;
+    if (!gQueriesReady) {
+        glGenQueries(2 * PROFILER_GPU_QUERIES, gQueries);
+        gQueriesReady = 1;
+    }
+    // All slots in flight: drop this zone rather than wait
+    if (gQueryHead - gQueryTail >= PROFILER_GPU_QUERIES) return zone;
+    zone.zone = findZone(name, 1);
+    if (zone.zone < 0) return zone;
+    zone.query = (int)(gQueryHead++ % PROFILER_GPU_QUERIES);
+    zone.start = jobTime();
+    GPUQuerySlot* slot = &gQuerySlots[zone.query];
+    slot->zone = zone.zone;
+    slot->ended = 0;
+    slot->cpuStart = zone.start;
+    glQueryCounter(gQueries[2 * zone.query], GL_TIMESTAMP);
+    return zone;
+}
+
+void profileGPUEnd(ProfileZone zone) {
+    if (zone.query < 0) return;
+    glQueryCounter(gQueries[2 * zone.query + 1], GL_TIMESTAMP);
+    gQuerySlots[zone.query].ended = 1;
+}
+
+// Read the GPU zones whose queries have landed, oldest first
+static void collectGPUQueries(void) {
+    while (gQueryTail != gQueryHead) {
+        int s = (int)(gQueryTail % PROFILER_GPU_QUERIES);
+        GPUQuerySlot* slot = &gQuerySlots[s];
+        if (!slot->ended) break;
+        GLint available = 0;
+        glGetQueryObjectiv(gQueries[2 * s + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) break;
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(gQueries[2 * s], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(gQueries[2 * s + 1], GL_QUERY_RESULT, &end);
+        // GPU clock in ns; placed at the CPU time the zone was issued
+        double duration = end > begin ? (double)(end - begin) * 1e-9 : 0.0;
+        lockProfiler();
+        recordZone(slot->zone, 0, slot->cpuStart, duration);
+        unlockProfiler();
+        gQueryTail++;
+    }
+}
+
+void profilerFrame(void) {
+    if (gQueriesReady) collectGPUQueries();
+    lockProfiler();
+    for (int z = 0; z < gZoneCount; z++) {
+        ProfilerZoneInfo* info = &gZones[z];
+        info->history[info->historyHead] = (float)info->frameMs;
+        info->historyHead = (info->historyHead + 1) % PROFILER_HISTORY;
+        if (info->historyCount < PROFILER_HISTORY) info->historyCount++;
+        info->frameMs = 0.0;
+    }
+    unlockProfiler();
+}
+
+int profilerZoneCount(void) { return jobAtomicAdd(&gZoneCount, 0); }
+const char* profilerZoneName(int zone) { return gZones[zone].name; }
+int profilerZoneIsGPU(int zone) { return gZones[zone].gpu; }
+
+int profilerZoneHistory(int zone, float* out) {
+    lockProfiler();
+    const ProfilerZoneInfo* info = &gZones[zone];
+    int count = info->historyCount;
+    int first = (info->historyHead - count + PROFILER_HISTORY) % PROFILER_HISTORY;
+    for (int i = 0; i < count; i++) out[i] = info->history[(first + i) % PROFILER_HISTORY];
+    unlockProfiler();
+    return count;
+}
+
+// Zone names are code literals, but keep the JSON valid whatever they hold
+static void writeJSONString(FILE* file, const char* text) {
+    fputc('"', file);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') fputc('\\', file);
+        if ((unsigned char)*text >= 0x20) fputc(*text, file);
+    }
+    fputc('"', file);
+}
+
+int profilerWriteTrace(const char* path) {
+    // Copy the ring so other threads are not held up by the file writing
+    TraceEvent* events = malloc(sizeof(TraceEvent) * PROFILER_TRACE_EVENTS);
+    if (!events) return 0;
+    lockProfiler();
+    long total = gTraceCount;
+    int count = total < PROFILER_TRACE_EVENTS ? (int)total : PROFILER_TRACE_EVENTS;
+    long first = total - count;
+    for (int i = 0; i < count; i++) events[i] = gTrace[(first + i) % PROFILER_TRACE_EVENTS];
+    int threads = gNextThread;
+    unlockProfiler();
+
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        free(events);
+        return 0;
+    }
+    double origin = count > 0 ? events[0].start : 0.0;
+    for (int i = 1; i < count; i++) {
+        if (events[i].start < origin) origin = events[i].start;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"GPU\"}}");
+    for (int t = 1; t <= threads; t++) {
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Thread %d\"}}", t, t);
+    }
+    for (int i = 0; i < count; i++) {
+        const TraceEvent* event = &events[i];
+        fprintf(file, ",\n{\"name\":");
+        writeJSONString(file, gZones[event->zone].name);
+        fprintf(file, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                gZones[event->zone].gpu ? "gpu" : "cpu", event->thread,
+                (event->start - origin) * 1e6, event->duration * 1e6);
+    }
+    fprintf(file, "\n]}\n");
+    int ok = !ferror(file);
+    fclose(file);
+    free(events);
+    return ok;
+}
+
+void profilerShutdown(void) {
+    if (gQueriesReady) glDeleteQueries(2 * PROFILER_GPU_QUERIES, gQueries);
+    gQueriesReady = 0;
+    gQueryHead = gQueryTail = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Phase timers for frames and ticks. CPU zones work on any thread and need
+// no window; GPU zones bracket GL work with GL_TIMESTAMP queries that are
+// collected a few frames later, so they never stall. Every zone keeps its
+// time per frame over the last PROFILER_HISTORY frames (for the overlay),
+// and the most recent zones can be written as a Chrome trace.
+//
+//     ProfileZone zone = profileBegin("grid.update");
+//     ...
+//     profileEnd(zone);
+
+#define PROFILER_MAX_ZONES 64         // distinct zone names
+#define PROFILER_HISTORY 120          // frames of history per zone
+#define PROFILER_TRACE_EVENTS 65536   // most recent zones kept for the trace
+
+typedef struct ProfileZone {
+    int zone;      // -1: not recorded
+    int query;     // GPU query pair, -1 for CPU zones
+    double start;  // jobTime() at the start
+} ProfileZone;
+
+void profilerSetEnabled(int enabled); // on by default
+int  profilerIsEnabled(void);
+// GPU zones need a current context with timer queries (GL 3.3); until this
+// is called they are not recorded, e.g. headless
+void profilerEnableGPU(int enabled);
+
+// name must stay valid (a string literal)
+ProfileZone profileBegin(const char* name);
+void profileEnd(ProfileZone zone);
+// On the GL thread only; the CPU start is kept to place the zone in the trace
+ProfileZone profileGPUBegin(const char* name);
+void profileGPUEnd(ProfileZone zone);
+
+// Once per frame (on the GL thread when GPU zones are used): moves the frame's
+// totals into the histories and collects the finished GPU queries
+void profilerFrame(void);
+
+int profilerZoneCount(void);
+const char* profilerZoneName(int zone);
+int profilerZoneIsGPU(int zone);
+// ms per frame, oldest first, into out[PROFILER_HISTORY]; returns the number of frames
+int profilerZoneHistory(int zone, float* out);
+
+// Recorded zones as Chrome trace JSON (chrome://tracing, Perfetto); 0 on failure
+int profilerWriteTrace(const char* path);
+// Releases the GPU queries (GL thread, before the context goes)
+void profilerShutdown(void);
+
+#endif
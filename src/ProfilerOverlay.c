@@ -0,0 +1,50 @@
+#include "ProfilerOverlay.h"
+#include "Profiler.h"
+#include <raylib.h>
+#define RAYGUI_IMPLEMENTATION
+#include <raygui.h>
+
+#define OVERLAY_WIDTH 620
+#define OVERLAY_ROW 20
+#define OVERLAY_NAME_WIDTH 170
+#define OVERLAY_BAR_WIDTH 2 // px per frame of history
+
+void DrawProfilerOverlay(int x, int y) {
+    int zones = profilerZoneCount();
+    int height = 34 + (zones > 0 ? zones : 1) * OVERLAY_ROW;
+    GuiPanel((Rectangle){ (float)x, (float)y, OVERLAY_WIDTH, (float)height }, "Profiler: ms per frame  (O: hide, T: trace)");
+    if (zones == 0) {
+        GuiLabel((Rectangle){ (float)x + 8, (float)y + 28, OVERLAY_WIDTH - 16, OVERLAY_ROW }, "No zones recorded yet");
+        return;
+    }
+    float history[PROFILER_HISTORY];
+    int rowY = y + 30;
+    for (int z = 0; z < zones; z++, rowY += OVERLAY_ROW) {
+        int frames = profilerZoneHistory(z, history);
+        float last = frames > 0 ? history[frames - 1] : 0.0f;
+        float worst = 0.0f, sum = 0.0f;
+        for (int i = 0; i < frames; i++) {
+            sum += history[i];
+            if (history[i] > worst) worst = history[i];
+        }
+        float mean = frames > 0 ? sum / frames : 0.0f;
+
+        int gpu = profilerZoneIsGPU(z);
+        GuiLabel((Rectangle){ (float)x + 8, (float)rowY, OVERLAY_NAME_WIDTH, OVERLAY_ROW },
+                 TextFormat("%s%s", profilerZoneName(z), gpu ? " (GPU)" : ""));
+
+        // Bars scaled to the row's worst frame, newest on the right
+        int barX = x + 8 + OVERLAY_NAME_WIDTH;
+        int barHeight = OVERLAY_ROW - 4;
+        DrawRectangle(barX, rowY + 2, PROFILER_HISTORY * OVERLAY_BAR_WIDTH, barHeight, Fade(DARKGRAY, 0.5f));
+        Color color = gpu ? ORANGE : SKYBLUE;
+        int offset = PROFILER_HISTORY - frames;
+        for (int i = 0; i < frames && worst > 0.0f; i++) {
+            int h = (int)(history[i] / worst * barHeight + 0.5f);
+            if (h > 0) DrawRectangle(barX + (offset + i) * OVERLAY_BAR_WIDTH, rowY + 2 + barHeight - h, OVERLAY_BAR_WIDTH, h, color);
+        }
+
+        GuiLabel((Rectangle){ (float)barX + PROFILER_HISTORY * OVERLAY_BAR_WIDTH + 8, (float)rowY, 190, OVERLAY_ROW },
+                 TextFormat("%6.2f  avg %6.2f  max %6.2f", last, mean, worst));
+    }
+}
@@ -0,0 +1,8 @@
+#ifndef PROFILER_OVERLAY_H
+#define PROFILER_OVERLAY_H
+
+// Panel with one row per profiler zone: the last PROFILER_HISTORY frames as
+// bars, plus the latest, mean and worst time. Call between BeginDrawing/EndDrawing.
+void DrawProfilerOverlay(int x, int y);
+
+#endif
@@ -0,0 +1,337 @@
+#include "SimdKernels.h"
+#include "JobSystem.h"
+#include <math.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#else
+#define SIMD_X86 0
+#endif
+
+// GCC and Clang only emit AVX code inside functions that ask for it, so the
+// rest of the program still runs on any x86 CPU. MSVC needs no attribute.
+#if defined(__GNUC__) || defined(__clang__)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
+typedef void (*GravityBlockFn)(const float*, const float*, const float*, const float*, int,
+                               float, float, float, float*);
+typedef int (*CullSpheresFn)(const float (*)[4], float, const float*, const float*, const float*,
+                             const unsigned int*, int, int, int*);
+
+static volatile int gDetected = -1; // set once the kernels below are selected
+static SimdLevel gLevel = SIMD_SCALAR;
+static GravityBlockFn gGravityBlock = NULL;
+static CullSpheresFn gCullSpheres = NULL;
+
+// --- Scalar reference versions ---
+
+void gravityBlockScalar(const float* x, const float* y, const float* z, const float* m, int count,
+                        float px, float py, float pz, float* acc) {
+    float ax = 0.0f, ay = 0.0f, az = 0.0f;
+    for (int j = 0; j < count; j++) {
+        float dx = x[j] - px;
+        float dy = y[j] - py;
+        float dz = z[j] - pz;
+        float distSqr = dx*dx + dy*dy + dz*dz;
+        if (distSqr < 1.0f) distSqr = 1.0f;
+        float invDist = 1.0f / sqrtf(distSqr);
+        float f = m[j] * invDist * invDist * invDist;
+        ax += f * dx;
+        ay += f * dy;
+        az += f * dz;
+    }
+    acc[0] += ax;
+    acc[1] += ay;
+    acc[2] += az;
+}
+
+int cullSpheresScalar(const float (*planes)[4], float radius, const float* x, const float* y, const float* z,
+                      const unsigned int* indices, int first, int count, int* visible) {
+    int n = 0;
+    for (int j = first; j < first + count; j++) {
+        int i = indices ? (int)indices[j] : j;
+        int inside = 1;
+        for (int k = 0; k < 6 && inside; k++) {
+            const float* p = planes[k];
+            inside = p[0] * x[i] + p[1] * y[i] + p[2] * z[i] + p[3] >= -radius;
+        }
+        if (inside) visible[n++] = i;
+    }
+    return n;
+}
+
+#if SIMD_X86
+
+static inline int lowestBit(unsigned int bits) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return (int)index;
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+
+// Append the lanes set in `bits` of the block starting at j
+static inline int emitVisible(unsigned int bits, const unsigned int* indices, int j, int* visible, int n) {
+    while (bits) {
+        int lane = lowestBit(bits);
+        visible[n++] = indices ? (int)indices[j + lane] : j + lane;
+        bits &= bits - 1;
+    }
+    return n;
+}
+
+// --- AVX2 + FMA: 8 lanes ---
+
+SIMD_TARGET("avx2,fma")
+static inline float sumAVX2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+SIMD_TARGET("avx2,fma")
+static void gravityBlockAVX2(const float* x, const float* y, const float* z, const float* m, int count,
+                             float px, float py, float pz, float* acc) {
+    const __m256 vpx = _mm256_set1_ps(px), vpy = _mm256_set1_ps(py), vpz = _mm256_set1_ps(pz);
+    const __m256 one = _mm256_set1_ps(1.0f), half = _mm256_set1_ps(0.5f), threeHalves = _mm256_set1_ps(1.5f);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 ax = _mm256_setzero_ps(), ay = _mm256_setzero_ps(), az = _mm256_setzero_ps();
+    for (int j = 0; j < count; j += 8) {
+        __m256 bx, by, bz, bm;
+        if (j + 8 <= count) {
+            bx = _mm256_loadu_ps(x + j);
+            by = _mm256_loadu_ps(y + j);
+            bz = _mm256_loadu_ps(z + j);
+            bm = _mm256_loadu_ps(m + j);
+        } else {
+            // Tail: missing lanes load zero mass and add nothing
+            __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - j), lanes);
+            bx = _mm256_maskload_ps(x + j, mask);
+            by = _mm256_maskload_ps(y + j, mask);
+            bz = _mm256_maskload_ps(z + j, mask);
+            bm = _mm256_maskload_ps(m + j, mask);
+        }
+        __m256 dx = _mm256_sub_ps(bx, vpx);
+        __m256 dy = _mm256_sub_ps(by, vpy);
+        __m256 dz = _mm256_sub_ps(bz, vpz);
+        __m256 d2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+        d2 = _mm256_max_ps(d2, one);
+        // rsqrt (12 bits) plus one Newton step: r *= 1.5 - 0.5 * d2 * r * r
+        __m256 r = _mm256_rsqrt_ps(d2);
+        r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(_mm256_mul_ps(half, d2), r), r, threeHalves));
+        __m256 f = _mm256_mul_ps(bm, _mm256_mul_ps(r, _mm256_mul_ps(r, r)));
+        ax = _mm256_fmadd_ps(f, dx, ax);
+        ay = _mm256_fmadd_ps(f, dy, ay);
+        az = _mm256_fmadd_ps(f, dz, az);
+    }
+    acc[0] += sumAVX2(ax);
+    acc[1] += sumAVX2(ay);
+    acc[2] += sumAVX2(az);
+}
+
+SIMD_TARGET("avx2,fma")
+static int cullSpheresAVX2(const float (*planes)[4], float radius, const float* x, const float* y, const float* z,
+                           const unsigned int* indices, int first, int count, int* visible) {
+    __m256 pa[6], pb[6], pc[6], pd[6];
+    for (int k = 0; k < 6; k++) {
+        pa[k] = _mm256_set1_ps(planes[k][0]);
+        pb[k] = _mm256_set1_ps(planes[k][1]);
+        pc[k] = _mm256_set1_ps(planes[k][2]);
+        pd[k] = _mm256_set1_ps(planes[k][3] + radius); // inside when dot + d + radius >= 0
+    }
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int n = 0;
+    for (int j = first; j < first + count; j += 8) {
+        int rest = first + count - j;
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), lanes);
+        unsigned int laneBits = rest >= 8 ? 0xffu : (1u << rest) - 1u;
+        __m256 bx, by, bz;
+        if (indices) {
+            __m256i idx = _mm256_maskload_epi32((const int*)(indices + j), mask);
+            __m256 maskPs = _mm256_castsi256_ps(mask);
+            bx = _mm256_mask_i32gather_ps(zero, x, idx, maskPs, 4);
+            by = _mm256_mask_i32gather_ps(zero, y, idx, maskPs, 4);
+            bz = _mm256_mask_i32gather_ps(zero, z, idx, maskPs, 4);
+        } else {
+            bx = _mm256_maskload_ps(x + j, mask);
+            by = _mm256_maskload_ps(y + j, mask);
+            bz = _mm256_maskload_ps(z + j, mask);
+        }
+        __m256 in = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int k = 0; k < 6; k++) {
+            __m256 dist = _mm256_fmadd_ps(pa[k], bx, _mm256_fmadd_ps(pb[k], by, _mm256_fmadd_ps(pc[k], bz, pd[k])));
+            in = _mm256_and_ps(in, _mm256_cmp_ps(dist, zero, _CMP_GE_OQ));
+        }
+        unsigned int bits = (unsigned int)_mm256_movemask_ps(in) & laneBits;
+        n = emitVisible(bits, indices, j, visible, n);
+    }
+    return n;
+}
+
+// --- AVX-512F: 16 lanes ---
+
+SIMD_TARGET("avx512f")
+static void gravityBlockAVX512(const float* x, const float* y, const float* z, const float* m, int count,
+                               float px, float py, float pz, float* acc) {
+    const __m512 vpx = _mm512_set1_ps(px), vpy = _mm512_set1_ps(py), vpz = _mm512_set1_ps(pz);
+    const __m512 one = _mm512_set1_ps(1.0f), half = _mm512_set1_ps(0.5f), threeHalves = _mm512_set1_ps(1.5f);
+    __m512 ax = _mm512_setzero_ps(), ay = _mm512_setzero_ps(), az = _mm512_setzero_ps();
+    for (int j = 0; j < count; j += 16) {
+        int rest = count - j;
+        __mmask16 k = rest >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << rest) - 1u);
+        __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(k, x + j), vpx);
+        __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(k, y + j), vpy);
+        __m512 dz = _mm512_sub_ps(_mm512_maskz_loadu_ps(k, z + j), vpz);
+        __m512 bm = _mm512_maskz_loadu_ps(k, m + j);
+        __m512 d2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+        d2 = _mm512_max_ps(d2, one);
+        // rsqrt14 plus one Newton step
+        __m512 r = _mm512_rsqrt14_ps(d2);
+        r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(_mm512_mul_ps(half, d2), r), r, threeHalves));
+        __m512 f = _mm512_mul_ps(bm, _mm512_mul_ps(r, _mm512_mul_ps(r, r)));
+        ax = _mm512_fmadd_ps(f, dx, ax);
+        ay = _mm512_fmadd_ps(f, dy, ay);
+        az = _mm512_fmadd_ps(f, dz, az);
+    }
+    acc[0] += _mm512_reduce_add_ps(ax);
+    acc[1] += _mm512_reduce_add_ps(ay);
+    acc[2] += _mm512_reduce_add_ps(az);
+}
+
+SIMD_TARGET("avx512f")
+static int cullSpheresAVX512(const float (*planes)[4], float radius, const float* x, const float* y, const float* z,
+                             const unsigned int* indices, int first, int count, int* visible) {
+    __m512 pa[6], pb[6], pc[6], pd[6];
+    for (int k = 0; k < 6; k++) {
+        pa[k] = _mm512_set1_ps(planes[k][0]);
+        pb[k] = _mm512_set1_ps(planes[k][1]);
+        pc[k] = _mm512_set1_ps(planes[k][2]);
+        pd[k] = _mm512_set1_ps(planes[k][3] + radius);
+    }
+    const __m512 zero = _mm512_setzero_ps();
+    int n = 0;
+    for (int j = first; j < first + count; j += 16) {
+        int rest = first + count - j;
+        __mmask16 k = rest >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << rest) - 1u);
+        __m512 bx, by, bz;
+        if (indices) {
+            __m512i idx = _mm512_maskz_loadu_epi32(k, indices + j);
+            bx = _mm512_mask_i32gather_ps(zero, k, idx, x, 4);
+            by = _mm512_mask_i32gather_ps(zero, k, idx, y, 4);
+            bz = _mm512_mask_i32gather_ps(zero, k, idx, z, 4);
+        } else {
+            bx = _mm512_maskz_loadu_ps(k, x + j);
+            by = _mm512_maskz_loadu_ps(k, y + j);
+            bz = _mm512_maskz_loadu_ps(k, z + j);
+        }
+        __mmask16 in = k;
+        for (int p = 0; p < 6; p++) {
+            __m512 dist = _mm512_fmadd_ps(pa[p], bx, _mm512_fmadd_ps(pb[p], by, _mm512_fmadd_ps(pc[p], bz, pd[p])));
+            in = _mm512_mask_cmp_ps_mask(in, dist, zero, _CMP_GE_OQ);
+        }
+        n = emitVisible((unsigned int)in, indices, j, visible, n);
+    }
+    return n;
+}
+
+#if defined(_MSC_VER) && !defined(__clang__)
+// CPUID leaf 7 feature bits plus the OS saving the wider registers (XCR0)
+static SimdLevel detectLevel(void) {
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return SIMD_SCALAR;
+    __cpuid(info, 1);
+    int osxsave = (info[2] >> 27) & 1, fma = (info[2] >> 12) & 1;
+    if (!osxsave) return SIMD_SCALAR;
+    unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    int avx2 = (info[1] >> 5) & 1, avx512f = (info[1] >> 16) & 1;
+    if (avx512f && (xcr0 & 0xe6) == 0xe6) return SIMD_AVX512;
+    if (avx2 && fma && (xcr0 & 0x6) == 0x6) return SIMD_AVX2;
+    return SIMD_SCALAR;
+}
+#else
+static SimdLevel detectLevel(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMD_AVX2;
+    return SIMD_SCALAR;
+}
+#endif
+
+#else
+
+static SimdLevel detectLevel(void) {
+    return SIMD_SCALAR;
+}
+
+#endif
+
+static void selectKernels(SimdLevel level) {
+    gLevel = level;
+    gGravityBlock = gravityBlockScalar;
+    gCullSpheres = cullSpheresScalar;
+#if SIMD_X86
+    if (level == SIMD_AVX512) {
+        gGravityBlock = gravityBlockAVX512;
+        gCullSpheres = cullSpheresAVX512;
+    } else if (level == SIMD_AVX2) {
+        gGravityBlock = gravityBlockAVX2;
+        gCullSpheres = cullSpheresAVX2;
+    }
+#endif
+}
+
+SimdLevel simdDetectedLevel(void) {
+    if (gDetected < 0) {
+        // Kernels first: a thread that sees gDetected set skips straight to them.
+        // Racing threads select the same kernels.
+        SimdLevel level = detectLevel();
+        selectKernels(level);
+        jobAtomicExchange(&gDetected, (int)level);
+    }
+    return (SimdLevel)gDetected;
+}
+
+SimdLevel simdLevel(void) {
+    simdDetectedLevel();
+    return gLevel;
+}
+
+void simdSetLevel(SimdLevel level) {
+    SimdLevel best = simdDetectedLevel();
+    if (level < SIMD_SCALAR) level = SIMD_SCALAR;
+    selectKernels(level > best ? best : level);
+}
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SIMD_AVX2:   return "AVX2";
+        case SIMD_AVX512: return "AVX-512";
+        default:          return "Scalar";
+    }
+}
+
+void gravityBlock(const float* x, const float* y, const float* z, const float* m, int count,
+                  float px, float py, float pz, float* acc) {
+    if (!gGravityBlock) simdDetectedLevel();
+    gGravityBlock(x, y, z, m, count, px, py, pz, acc);
+}
+
+int cullSpheres(const float (*planes)[4], float radius, const float* x, const float* y, const float* z,
+                const unsigned int* indices, int first, int count, int* visible) {
+    if (!gCullSpheres) simdDetectedLevel();
+    return gCullSpheres(planes, radius, x, y, z, indices, first, count, visible);
+}
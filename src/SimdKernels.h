@@ -0,0 +1,42 @@
+#ifndef SIMD_KERNELS_H
+#define SIMD_KERNELS_H
+
+// Vectorised CPU kernels over structure-of-arrays particle blocks. The
+// instruction set is picked at runtime (AVX-512, AVX2 + FMA or scalar) on
+// x86 with GCC, Clang or MSVC; other targets always use the scalar versions.
+// The scalar versions stay available as the reference for correctness checks.
+
+typedef enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_AVX2,   // 8 lanes, needs AVX2 + FMA
+    SIMD_AVX512, // 16 lanes, needs AVX-512F
+    SIMD_LEVEL_COUNT
+} SimdLevel;
+
+// Best level this CPU supports (detected once)
+SimdLevel simdDetectedLevel(void);
+// Level used by the kernels: the detected one unless lowered with simdSetLevel
+SimdLevel simdLevel(void);
+void simdSetLevel(SimdLevel level); // clamped to the detected level
+const char* simdLevelName(SimdLevel level);
+
+// Add the softened gravity of `count` point masses on the point p to acc[3]
+// (without G): sum m * d / max(|d|^2, 1)^1.5 with d = pos - p. A mass at p
+// itself contributes nothing. The vector versions use rsqrt plus one Newton
+// step (about 1e-6 relative error).
+void gravityBlock(const float* x, const float* y, const float* z, const float* m, int count,
+                  float px, float py, float pz, float* acc);
+void gravityBlockScalar(const float* x, const float* y, const float* z, const float* m, int count,
+                        float px, float py, float pz, float* acc);
+
+// Sphere-vs-frustum test of particles first..first+count-1, or of
+// indices[first..first+count-1] when indices is not NULL. planes hold six
+// normalised (a, b, c, d) planes, inside where a*x + b*y + c*z + d >= 0.
+// Writes the slots of the visible particles to `visible` (room for count)
+// and returns how many there are.
+int cullSpheres(const float (*planes)[4], float radius, const float* x, const float* y, const float* z,
+                const unsigned int* indices, int first, int count, int* visible);
+int cullSpheresScalar(const float (*planes)[4], float radius, const float* x, const float* y, const float* z,
+                      const unsigned int* indices, int first, int count, int* visible);
+
+#endif
@@ -0,0 +1,346 @@
+#include "Simulation.h"
+#include "Calculations.h"
+#include "JobSystem.h"
+#include <string.h>
+
+// Ticks run in one go to catch up; a longer backlog is dropped, so a
+// simulation slower than real time falls behind instead of spiralling
+#define SIM_MAX_CATCHUP_TICKS 8
+
+// `middle` holds the index of the shared snapshot, plus SNAPSHOT_FRESH until
+// the render thread takes it
+#define SNAPSHOT_INDEX 3
+#define SNAPSHOT_FRESH 4
+
+// Particles after a tick and where they were one tick earlier
+typedef struct SimSnapshot {
+    ObjectList* state;     // positions, masses, elements and ids; no velocities or id table
+    float* prevX;
+    float* prevY;
+    float* prevZ;
+    int prevCapacity;
+    double time;           // wall-clock time it was handed over
+    float tickMs;
+    float maxStep;         // farthest any particle moved from prev to state
+    unsigned long tick;    // tickCount it was taken after
+    Diagnostics diagnostics;
+    unsigned long diagnosticsTick; // tick the diagnostics were measured after, 0 = none yet
+} SimSnapshot;
+
+struct Simulation {
+    ObjectList* objList;   // touched only by the side holding `lock`
+    float tick;
+    int particleRadius;
+    JobLock* lock;         // held while ticking and by lockSimulation
+    volatile int waiting;  // render threads waiting for `lock`
+    JobThreadHandle* thread;
+    volatile int stop;
+    double nextTick;       // wall-clock time the next tick is due
+    unsigned long tickCount;
+    float tickMs;
+    Diagnostics diagnostics; // newest measurement (SetDiagnosticsInterval)
+    unsigned long diagnosticsTick;
+    // Start-of-tick positions by particle id (xyz), for the blend
+    float* prevById;
+    unsigned int prevIdCapacity;
+    unsigned int prevIdLimit; // ids from here on were spawned after the positions were taken
+    // Spawn queue, filled by the render thread
+    JobLock* spawnLock;
+    GravitationalObject* spawns;
+    int spawnCount;
+    int spawnCapacity;
+    // Triple buffer: the ticking side fills `back`, the render thread reads `front`
+    SimSnapshot snapshots[3];
+    int back;
+    volatile int middle;
+    int front;
+    ObjectList* frame;     // blended particles handed to the renderer
+    float frameAlpha;      // blend weight of the newest tick in `frame`
+};
+
+// GPU gravity and the resident state need the GL context of the render thread
+static int needsRenderThread(void) {
+    return (IsUseGPU() && !IsUseParticleMesh()) || IsStateOnGPU();
+}
+
+static void applySpawns(Simulation* sim) {
+    jobLockAcquire(sim->spawnLock);
+    for (int i = 0; i < sim->spawnCount; i++) addObjectList(&sim->spawns[i], sim->objList);
+    sim->spawnCount = 0;
+    jobLockRelease(sim->spawnLock);
+}
+
+// Note where every particle starts the tick
+static void rememberPositions(Simulation* sim) {
+    const ObjectList* list = sim->objList;
+    unsigned int idLimit = list->nextId;
+    if (idLimit > sim->prevIdCapacity) {
+        unsigned int newCap = sim->prevIdCapacity > 0 ? sim->prevIdCapacity : 1024;
+        while (newCap < idLimit) newCap *= 2;
+        float* table = realloc(sim->prevById, sizeof(float) * 3 * newCap);
+        if (!table) {
+            sim->prevIdLimit = 0; // blend nothing this tick
+            return;
+        }
+        sim->prevById = table;
+        sim->prevIdCapacity = newCap;
+    }
+    for (int i = 0; i < list->size; i++) {
+        float* prev = &sim->prevById[3 * list->ids[i]];
+        prev[0] = list->posX[i];
+        prev[1] = list->posY[i];
+        prev[2] = list->posZ[i];
+    }
+    sim->prevIdLimit = idLimit;
+}
+
+static void runTick(Simulation* sim) {
+    double start = GetTime();
+    applySpawns(sim);
+    rememberPositions(sim);
+    ComputeGravitationWithShader(sim->objList, sim->tick);
+    CalculateCollision(sim->objList, sim->particleRadius);
+    sim->tickCount++;
+    sim->tickMs = (float)((GetTime() - start) * 1000.0);
+    // Not part of tickMs: the measurement reports its own time
+    int interval = GetDiagnosticsInterval();
+    if (interval > 0 && sim->tickCount % (unsigned long)interval == 0 &&
+        MeasureDiagnostics(sim->objList, &sim->diagnostics)) {
+        sim->diagnosticsTick = sim->tickCount;
+    }
+}
+
+static int reservePrevious(SimSnapshot* snap, int count) {
+    if (count <= snap->prevCapacity) return 1;
+    int newCap = snap->prevCapacity > 0 ? snap->prevCapacity : 1024;
+    while (newCap < count) newCap *= 2;
+    float* x = realloc(snap->prevX, sizeof(float) * newCap);
+    if (x) snap->prevX = x;
+    float* y = realloc(snap->prevY, sizeof(float) * newCap);
+    if (y) snap->prevY = y;
+    float* z = realloc(snap->prevZ, sizeof(float) * newCap);
+    if (z) snap->prevZ = z;
+    if (!x || !y || !z) return 0;
+    snap->prevCapacity = newCap;
+    return 1;
+}
+
+// Copy the state into the back snapshot and swap it into the middle
+static void publishSnapshot(Simulation* sim, double time) {
+    SimSnapshot* snap = &sim->snapshots[sim->back];
+    const ObjectList* list = sim->objList;
+    int n = list->size;
+    // Out of memory: the render thread keeps the previous snapshot
+    if (!reserveObjectList(snap->state, n) || !reservePrevious(snap, n)) return;
+    ObjectList* state = snap->state;
+    memcpy(state->posX, list->posX, sizeof(float) * n);
+    memcpy(state->posY, list->posY, sizeof(float) * n);
+    memcpy(state->posZ, list->posZ, sizeof(float) * n);
+    memcpy(state->mass, list->mass, sizeof(float) * n);
+    memcpy(state->element, list->element, sizeof(enum element) * n);
+    memcpy(state->ids, list->ids, sizeof(unsigned int) * n);
+    state->size = n;
+    float maxStep2 = 0.0f;
+    for (int i = 0; i < n; i++) {
+        unsigned int id = list->ids[i];
+        if (id < sim->prevIdLimit) {
+            snap->prevX[i] = sim->prevById[3 * id];
+            snap->prevY[i] = sim->prevById[3 * id + 1];
+            snap->prevZ[i] = sim->prevById[3 * id + 2];
+            float dx = list->posX[i] - snap->prevX[i];
+            float dy = list->posY[i] - snap->prevY[i];
+            float dz = list->posZ[i] - snap->prevZ[i];
+            float d2 = dx*dx + dy*dy + dz*dz;
+            if (d2 > maxStep2) maxStep2 = d2;
+        } else {
+            // Spawned during the tick: no earlier position
+            snap->prevX[i] = list->posX[i];
+            snap->prevY[i] = list->posY[i];
+            snap->prevZ[i] = list->posZ[i];
+        }
+    }
+    snap->maxStep = sqrtf(maxStep2);
+    snap->tick = sim->tickCount;
+    snap->time = time;
+    snap->tickMs = sim->tickMs;
+    snap->diagnostics = sim->diagnostics;
+    snap->diagnosticsTick = sim->diagnosticsTick;
+    sim->back = jobAtomicExchange(&sim->middle, sim->back | SNAPSHOT_FRESH) & SNAPSHOT_INDEX;
+}
+
+// Run the ticks that are due, then publish the newest state
+static void runDueTicks(Simulation* sim) {
+    double now = GetTime();
+    int ticks = 0;
+    while (now >= sim->nextTick && ticks < SIM_MAX_CATCHUP_TICKS) {
+        runTick(sim);
+        sim->nextTick += sim->tick;
+        ticks++;
+    }
+    if (ticks == 0) return;
+    // Too far behind: drop the backlog and carry on from now
+    if (now >= sim->nextTick) sim->nextTick = now + sim->tick;
+    // The resident state is drawn from the GPU buffer, not from snapshots.
+    // Stamped with the hand-over time, the blend starts exactly where the
+    // previous snapshot's ended, however long the tick took.
+    if (!IsStateOnGPU()) publishSnapshot(sim, GetTime());
+}
+
+static void simulationLoop(void* data) {
+    Simulation* sim = data;
+    while (!jobAtomicAdd(&sim->stop, 0)) {
+        // A waiting render thread goes first
+        while (jobAtomicAdd(&sim->waiting, 0) > 0) jobSleep(0.0);
+        jobLockAcquire(sim->lock);
+        double wait = sim->tick * 0.25; // idle while the render thread ticks
+        if (!needsRenderThread()) {
+            runDueTicks(sim);
+            wait = sim->nextTick - GetTime();
+        }
+        jobLockRelease(sim->lock);
+        jobSleep(wait);
+    }
+}
+
+Simulation* createSimulation(ObjectList* objList, float tick, int particleRadius) {
+    Simulation* sim = calloc(1, sizeof(Simulation));
+    if (!sim) return NULL;
+    sim->objList = objList;
+    sim->tick = tick;
+    sim->particleRadius = particleRadius;
+    sim->lock = jobLockCreate();
+    sim->spawnLock = jobLockCreate();
+    sim->frame = createObjectList();
+    int ok = sim->lock && sim->spawnLock && sim->frame;
+    for (int i = 0; i < 3; i++) {
+        sim->snapshots[i].state = createObjectList();
+        ok = ok && sim->snapshots[i].state;
+    }
+    if (!ok) {
+        freeSimulation(sim);
+        return NULL;
+    }
+    // Without compute shaders the GPU path would only fall back to the CPU,
+    // on the render thread; start on the CPU solver instead
+    if (!computeAvailable()) SetUseGPU(0);
+    jobWorkerCount(); // start the pool here, not racing from two threads
+    sim->front = 0;
+    sim->middle = 1;
+    sim->back = 2;
+    double now = GetTime();
+    publishSnapshot(sim, now);
+    sim->nextTick = now + tick;
+    sim->thread = jobThreadStart(simulationLoop, sim);
+    if (!sim->thread && DEBUG_MODE) printf("[createSimulation] No simulation thread, ticking on the render thread.\n");
+    return sim;
+}
+
+void freeSimulation(Simulation* sim) {
+    if (!sim) return;
+    if (sim->thread) {
+        jobAtomicExchange(&sim->stop, 1);
+        jobThreadJoin(sim->thread);
+    }
+    if (sim->spawnLock) applySpawns(sim);
+    for (int i = 0; i < 3; i++) {
+        freeObjectList(sim->snapshots[i].state);
+        free(sim->snapshots[i].prevX);
+        free(sim->snapshots[i].prevY);
+        free(sim->snapshots[i].prevZ);
+    }
+    freeObjectList(sim->frame);
+    free(sim->prevById);
+    free(sim->spawns);
+    jobLockFree(sim->lock);
+    jobLockFree(sim->spawnLock);
+    free(sim);
+}
+
+void simulationSpawn(Simulation* sim, const GravitationalObject* obj) {
+    jobLockAcquire(sim->spawnLock);
+    if (sim->spawnCount == sim->spawnCapacity) {
+        int newCap = sim->spawnCapacity > 0 ? sim->spawnCapacity * 2 : 16;
+        GravitationalObject* spawns = realloc(sim->spawns, sizeof(GravitationalObject) * newCap);
+        if (spawns) {
+            sim->spawns = spawns;
+            sim->spawnCapacity = newCap;
+        }
+    }
+    if (sim->spawnCount < sim->spawnCapacity) sim->spawns[sim->spawnCount++] = *obj;
+    jobLockRelease(sim->spawnLock);
+}
+
+void lockSimulation(Simulation* sim) {
+    jobAtomicAdd(&sim->waiting, 1);
+    jobLockAcquire(sim->lock);
+    jobAtomicAdd(&sim->waiting, -1);
+}
+
+void unlockSimulation(Simulation* sim) {
+    jobLockRelease(sim->lock);
+}
+
+// Blend the newest snapshot with the tick before it
+ObjectList* updateSimulation(Simulation* sim, int* live) {
+    if (!sim->thread || needsRenderThread()) {
+        lockSimulation(sim);
+        runDueTicks(sim);
+        unlockSimulation(sim);
+    }
+    *live = IsStateOnGPU();
+    if (*live) return sim->objList;
+
+    if (jobAtomicAdd(&sim->middle, 0) & SNAPSHOT_FRESH) {
+        sim->front = jobAtomicExchange(&sim->middle, sim->front) & SNAPSHOT_INDEX;
+    }
+    const SimSnapshot* snap = &sim->snapshots[sim->front];
+    const ObjectList* state = snap->state;
+    int n = state->size;
+    ObjectList* frame = sim->frame;
+    sim->frameAlpha = 1.0f;
+    if (!reserveObjectList(frame, n)) return snap->state;
+    // A tick behind the hand-over: alpha 0 is the previous tick, 1 the newest
+    float alpha = (float)((GetTime() - snap->time) / sim->tick);
+    if (alpha < 0.0f) alpha = 0.0f;
+    if (alpha > 1.0f) alpha = 1.0f;
+    sim->frameAlpha = alpha;
+    for (int i = 0; i < n; i++) {
+        frame->posX[i] = snap->prevX[i] + (state->posX[i] - snap->prevX[i]) * alpha;
+        frame->posY[i] = snap->prevY[i] + (state->posY[i] - snap->prevY[i]) * alpha;
+        frame->posZ[i] = snap->prevZ[i] + (state->posZ[i] - snap->prevZ[i]) * alpha;
+    }
+    memcpy(frame->mass, state->mass, sizeof(float) * n);
+    memcpy(frame->element, state->element, sizeof(enum element) * n);
+    memcpy(frame->ids, state->ids, sizeof(unsigned int) * n);
+    frame->size = n;
+    return frame;
+}
+
+int simulationIsThreaded(const Simulation* sim) {
+    return sim->thread != NULL && !needsRenderThread();
+}
+
+const Grid* simulationFrameGrid(const Simulation* sim, float* drift) {
+    // The simulation thread would refile the particles during the draw
+    if (simulationIsThreaded(sim)) return NULL;
+    // The grid holds the slots of the newest tick only
+    const SimSnapshot* snap = &sim->snapshots[sim->front];
+    if (snap->tick != sim->tickCount) return NULL;
+    float gridDrift = 0.0f;
+    const Grid* grid = GetSpatialGrid(snap->state, &gridDrift);
+    if (!grid) return NULL;
+    // The blend trails the newest positions by up to (1 - alpha) of the tick's step
+    *drift = gridDrift + (1.0f - sim->frameAlpha) * snap->maxStep;
+    return grid;
+}
+
+float simulationTickMs(const Simulation* sim) {
+    return sim->snapshots[sim->front].tickMs;
+}
+
+const Diagnostics* simulationDiagnostics(const Simulation* sim) {
+    // The resident state ticks on the render thread and publishes no snapshots
+    if (IsStateOnGPU()) return sim->diagnosticsTick > 0 ? &sim->diagnostics : NULL;
+    const SimSnapshot* snap = &sim->snapshots[sim->front];
+    return snap->diagnosticsTick > 0 ? &snap->diagnostics : NULL;
+}
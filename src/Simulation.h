@@ -0,0 +1,47 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include "particle.h"
+#include "Diagnostics.h"
+#include "GridSystem.h"
+
+// Fixed-rate physics, decoupled from the frame rate. Ticks of a fixed length
+// run on a dedicated thread, several in a row to catch up after a slow one,
+// and hand a snapshot of the particles to the render thread through a
+// lock-free triple buffer. The render thread draws a blend of the last two
+// ticks, one tick behind real time.
+// Solvers that need the GL context (GPU gravity, the resident state) tick on
+// the render thread instead, from updateSimulation, with the same catch-up
+// and blending.
+typedef struct Simulation Simulation;
+
+// Takes over objList until freeSimulation; particleRadius is the collision radius
+Simulation* createSimulation(ObjectList* objList, float tick, int particleRadius);
+// Stops the thread; queued spawns are appended and objList is the caller's again
+void freeSimulation(Simulation* sim);
+
+// Queue a particle, appended before the next tick (never waits for a tick)
+void simulationSpawn(Simulation* sim, const GravitationalObject* obj);
+
+// Exclusive access to the ObjectList and the gravitation toggles of
+// Calculations.h; waits for the running ticks
+void lockSimulation(Simulation* sim);
+void unlockSimulation(Simulation* sim);
+
+// Once per frame on the render thread: runs the due ticks if they need the GL
+// context, then returns the particles to draw. *live is set when that is the
+// simulated ObjectList itself (while IsStateOnGPU(), drawn with
+// DrawParticles); otherwise it is a blended copy for DrawParticleFrame.
+ObjectList* updateSimulation(Simulation* sim, int* live);
+
+int   simulationIsThreaded(const Simulation* sim); // ticks currently run on the simulation thread
+// Gravity grid matching the slots of the last blended frame, for culling it
+// with DrawParticleFrame; NULL while the simulation thread ticks or when the
+// newest tick built none. *drift covers both the tick and the blend.
+const Grid* simulationFrameGrid(const Simulation* sim, float* drift);
+float simulationTickMs(const Simulation* sim);     // duration of the newest drawn tick
+// Newest conservation diagnostics (SetDiagnosticsInterval) that reached the
+// render thread; NULL before the first measurement. Render thread only.
+const Diagnostics* simulationDiagnostics(const Simulation* sim);
+
+#endif
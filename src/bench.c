@@ -0,0 +1,474 @@
+// Benchmarks of the physics core: grid build and update, the CPU gravity
+// solvers and kernels, collisions, culling and a full CPU tick, over several
+// particle counts and start distributions generated from fixed seeds.
+// Results go to stdout as a table and to a JSON file (min, median, p99).
+// The integrator ticks evolve one state over all samples and also report the
+// relative energy drift, so their speed can be compared at equal accuracy.
+#include "Calculations.h"
+#include "BarnesHut.h"
+#include "ParticleMesh.h"
+#include "SimdKernels.h"
+#include "JobSystem.h"
+#include "Profiler.h"
+#include <string.h>
+
+#define BENCH_G 6.67430e-11f      // as in Calculations.c
+#define BENCH_DT (1.0f / 90.0f)   // the interactive app's tick
+#define BENCH_CELL_SIZE 20.0f     // gravity grid cell, as in Calculations.c
+#define BENCH_RADIUS 1.0f         // particle radius
+#define BENCH_TARGETS 256         // points per gravityBlock sample
+#define BENCH_MIN_SAMPLES 3
+#define BENCH_MAX_SIZES 16
+
+// Particles of one distribution, kept to reset the ObjectList between samples
+typedef struct BenchParticles {
+    const char* distribution;
+    int count;
+    float* pos;               // xyz
+    float* vel;               // xyz
+    enum element* element;
+} BenchParticles;
+
+typedef struct BenchState {
+    const BenchParticles* particles;
+    ObjectList* list;
+    Grid* grid;
+    int* visible;
+    float planes[6][4];
+} BenchState;
+
+typedef void (*BenchFn)(BenchState* state);
+
+typedef struct BenchCase {
+    const char* name;
+    BenchFn setup;            // untimed, before every sample (may be NULL)
+    BenchFn run;              // timed
+    int energy;               // report the energy drift over the timed runs (collisions off)
+} BenchCase;
+
+typedef struct BenchOptions {
+    int sizes[BENCH_MAX_SIZES];
+    int sizeCount;
+    const char* distributions;
+    const char* filter;       // substring of the benchmark names to run
+    const char* out;
+    unsigned long long seed;
+    int samples;              // at most this many samples per run
+    double budget;            // seconds per run, at least BENCH_MIN_SAMPLES samples
+    int threads;
+} BenchOptions;
+
+// xorshift64*: the same sequence on every platform, unlike rand()
+static unsigned long long gRandomState;
+
+static double benchRandom(void) {
+    gRandomState ^= gRandomState >> 12;
+    gRandomState ^= gRandomState << 25;
+    gRandomState ^= gRandomState >> 27;
+    return (double)((gRandomState * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void randomDirection(double r, float* out) {
+    double z = 2.0 * benchRandom() - 1.0;
+    double phi = 2.0 * PI * benchRandom();
+    double s = sqrt(1.0 - z * z);
+    out[0] = (float)(r * s * cos(phi));
+    out[1] = (float)(r * s * sin(phi));
+    out[2] = (float)(r * z);
+}
+
+// Uniform in the cube the interactive app spawns into
+static void sampleUniform(float* pos) {
+    for (int k = 0; k < 3; k++) pos[k] = (float)((2.0 * benchRandom() - 1.0) * 10000.0);
+}
+
+// Plummer sphere (scale radius 1000), truncated at 20 scale radii
+static void samplePlummer(float* pos) {
+    const double a = 1000.0;
+    double r;
+    do {
+        double u = benchRandom();
+        r = u > 0.0 ? a / sqrt(pow(u, -2.0 / 3.0) - 1.0) : 0.0;
+    } while (r > 20.0 * a);
+    randomDirection(r, pos);
+}
+
+// Exponential disk (scale length 3000, about 100 thick), truncated at 10 scale lengths
+static void sampleDisk(float* pos) {
+    const double scale = 3000.0;
+    double r;
+    do {
+        r = -scale * log((1.0 - benchRandom()) * (1.0 - benchRandom()));
+    } while (r > 10.0 * scale);
+    double phi = 2.0 * PI * benchRandom();
+    double z = 0.0;
+    for (int k = 0; k < 4; k++) z += benchRandom() - 0.5;
+    pos[0] = (float)(r * cos(phi));
+    pos[1] = (float)(z * 100.0);
+    pos[2] = (float)(r * sin(phi));
+}
+
+static int generateParticles(BenchParticles* out, const char* distribution, int count, unsigned long long seed) {
+    void (*sample)(float*) = NULL;
+    if (strcmp(distribution, "uniform") == 0) sample = sampleUniform;
+    else if (strcmp(distribution, "plummer") == 0) sample = samplePlummer;
+    else if (strcmp(distribution, "disk") == 0) sample = sampleDisk;
+    else return 0;
+    out->distribution = distribution;
+    out->count = count;
+    out->pos = malloc(sizeof(float) * 3 * count);
+    out->vel = malloc(sizeof(float) * 3 * count);
+    out->element = malloc(sizeof(enum element) * count);
+    if (!out->pos || !out->vel || !out->element) return 0;
+    // Every (distribution, count) pair starts from the same seed
+    gRandomState = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (int i = 0; i < count; i++) {
+        sample(&out->pos[3 * i]);
+        for (int k = 0; k < 3; k++) out->vel[3 * i + k] = (float)(2.0 * benchRandom() - 1.0);
+        out->element[i] = elementAt((int)(benchRandom() * ELEMENT_COUNT));
+    }
+    return 1;
+}
+
+static void freeParticles(BenchParticles* particles) {
+    free(particles->pos);
+    free(particles->vel);
+    free(particles->element);
+}
+
+// Fresh ObjectList holding the generated particles (ids 0..count-1)
+static void resetList(BenchState* state) {
+    const BenchParticles* p = state->particles;
+    freeObjectList(state->list);
+    state->list = createObjectList();
+    if (!state->list || !reserveObjectList(state->list, p->count)) return;
+    for (int i = 0; i < p->count; i++) {
+        GravitationalObject obj;
+        obj.name = "Bench";
+        obj.element = p->element[i];
+        obj.position = (Vector3){ p->pos[3 * i], p->pos[3 * i + 1], p->pos[3 * i + 2] };
+        obj.velocity = (Vector3){ p->vel[3 * i], p->vel[3 * i + 1], p->vel[3 * i + 2] };
+        addObjectList(&obj, state->list);
+    }
+}
+
+// --- Benchmarks ---
+
+static void setupGridBuild(BenchState* state) {
+    freeGrid(state->grid);
+    state->grid = NULL;
+}
+
+static void runGridBuild(BenchState* state) {
+    state->grid = getGrid(state->list, BENCH_CELL_SIZE);
+}
+
+// One tick's worth of movement, so the update sees the usual few cell changes
+static void driftGrid(BenchState* state, int neighbours) {
+    ObjectList* list = state->list;
+    if (!state->grid) {
+        state->grid = getGrid(list, BENCH_CELL_SIZE);
+        if (state->grid && neighbours) {
+            // As in the GPU path with the 3x3x3 near field
+            state->grid->buildNeighbours = 1;
+            updateGrid(state->grid, list);
+        }
+    }
+    for (int i = 0; i < list->size; i++) {
+        list->posX[i] += list->velX[i] * BENCH_DT;
+        list->posY[i] += list->velY[i] * BENCH_DT;
+        list->posZ[i] += list->velZ[i] * BENCH_DT;
+    }
+}
+
+static void setupGridUpdate(BenchState* state) { driftGrid(state, 0); }
+static void setupGridNeighbours(BenchState* state) { driftGrid(state, 1); }
+
+static void runGridUpdate(BenchState* state) {
+    if (state->grid) updateGrid(state->grid, state->list);
+}
+
+static void runBarnesHut(BenchState* state) {
+    computeBarnesHutGravity(state->list, BH_DEFAULT_THETA, BENCH_DT, BENCH_G);
+}
+
+static void runParticleMesh(BenchState* state) {
+    computeParticleMeshGravity(state->list, PM_DEFAULT_MESH_SIZE, BENCH_DT, BENCH_G);
+}
+
+// Results nobody reads, so the compiler cannot drop the work
+static volatile float gSink;
+
+// Direct summation of all particles on BENCH_TARGETS of them
+static void gravityTargets(BenchState* state, int scalar) {
+    const ObjectList* list = state->list;
+    int targets = list->size < BENCH_TARGETS ? list->size : BENCH_TARGETS;
+    for (int t = 0; t < targets; t++) {
+        float acc[3] = { 0.0f, 0.0f, 0.0f };
+        if (scalar) gravityBlockScalar(list->posX, list->posY, list->posZ, list->mass, list->size,
+                                       list->posX[t], list->posY[t], list->posZ[t], acc);
+        else gravityBlock(list->posX, list->posY, list->posZ, list->mass, list->size,
+                          list->posX[t], list->posY[t], list->posZ[t], acc);
+        gSink += acc[0] + acc[1] + acc[2];
+    }
+}
+
+static void runGravityBlock(BenchState* state) { gravityTargets(state, 0); }
+static void runGravityBlockScalar(BenchState* state) { gravityTargets(state, 1); }
+
+static void runCollisionMerge(BenchState* state) {
+    resolveCollisions(state->list, BENCH_RADIUS, COLLISION_MERGE);
+}
+
+static void runCollisionElastic(BenchState* state) {
+    resolveCollisions(state->list, BENCH_RADIUS, COLLISION_ELASTIC);
+}
+
+static void runCullSpheres(BenchState* state) {
+    const ObjectList* list = state->list;
+    cullSpheres((const float (*)[4])state->planes, BENCH_RADIUS, list->posX, list->posY, list->posZ,
+                NULL, 0, list->size, state->visible);
+}
+
+static void runTick(BenchState* state) {
+    ComputeGravitationWithShader(state->list, BENCH_DT);
+    CalculateCollision(state->list, (int)BENCH_RADIUS);
+}
+
+// The state keeps evolving from sample to sample, as in the app
+static void setupTickEuler(BenchState* state) { (void)state; SetIntegrator(INTEGRATOR_EULER); }
+static void setupTickLeapfrog(BenchState* state) { (void)state; SetIntegrator(INTEGRATOR_LEAPFROG); }
+static void setupTickHermite(BenchState* state) { (void)state; SetIntegrator(INTEGRATOR_HERMITE); }
+static void setupTickBlock(BenchState* state) { (void)state; SetIntegrator(INTEGRATOR_BLOCK); }
+
+static const BenchCase BENCH_CASES[] = {
+    { "grid.build",             setupGridBuild,      runGridBuild,          0 },
+    { "grid.update",            setupGridUpdate,     runGridUpdate,         0 },
+    { "grid.update_neighbours", setupGridNeighbours, runGridUpdate,         0 },
+    { "gravity.barnes_hut",     NULL,                runBarnesHut,          0 },
+    { "gravity.particle_mesh",  NULL,                runParticleMesh,       0 },
+    { "kernel.gravity_block",   NULL,                runGravityBlock,       0 },
+    { "kernel.gravity_scalar",  NULL,                runGravityBlockScalar, 0 },
+    { "collision.merge",        resetList,           runCollisionMerge,     0 },
+    { "collision.elastic",      NULL,                runCollisionElastic,   0 },
+    { "cull.spheres",           NULL,                runCullSpheres,        0 },
+    { "tick.cpu",               resetList,           runTick,               0 },
+    { "tick.euler",             setupTickEuler,      runTick,               1 },
+    { "tick.leapfrog",          setupTickLeapfrog,   runTick,               1 },
+    { "tick.hermite",           setupTickHermite,    runTick,               1 },
+    { "tick.block",             setupTickBlock,      runTick,               1 },
+};
+
+// --- Statistics and output ---
+
+typedef struct BenchResult {
+    int samples;
+    double min, median, p99, mean; // milliseconds
+    double energyError;            // |dE / E| over warm-up and samples, -1 when not measured
+} BenchResult;
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile(const double* sorted, int count, double p) {
+    int rank = (int)ceil(p * count);
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+static BenchResult measure(const BenchCase* bench, BenchState* state, const BenchOptions* opt, double* times) {
+    BenchResult result = { 0 };
+    result.energyError = -1.0;
+    Diagnostics diag;
+    int energy = 0;
+    if (bench->energy) {
+        SetCollisionMode(COLLISION_OFF);
+        ResetDiagnosticsReference();
+        energy = MeasureDiagnostics(state->list, &diag);
+    }
+    // Warm-up: first-touch allocations and caches
+    if (bench->setup) bench->setup(state);
+    bench->run(state);
+    double total = 0.0;
+    while (result.samples < opt->samples && (result.samples < BENCH_MIN_SAMPLES || total < opt->budget)) {
+        if (bench->setup) bench->setup(state);
+        double start = jobTime();
+        bench->run(state);
+        double seconds = jobTime() - start;
+        times[result.samples++] = seconds * 1000.0;
+        total += seconds;
+    }
+    if (energy && MeasureDiagnostics(state->list, &diag)) result.energyError = fabs(diag.energyError);
+    qsort(times, result.samples, sizeof(double), compareDoubles);
+    result.min = times[0];
+    result.median = result.samples % 2 ? times[result.samples / 2]
+                                       : 0.5 * (times[result.samples / 2 - 1] + times[result.samples / 2]);
+    result.p99 = percentile(times, result.samples, 0.99);
+    for (int s = 0; s < result.samples; s++) result.mean += times[s];
+    result.mean /= result.samples;
+    return result;
+}
+
+static int parseSizes(const char* text, BenchOptions* opt) {
+    opt->sizeCount = 0;
+    while (*text && opt->sizeCount < BENCH_MAX_SIZES) {
+        char* end;
+        long n = strtol(text, &end, 10);
+        if (end == text || n <= 0) return 0;
+        if (*end == 'k' || *end == 'K') { n *= 1000; end++; }
+        else if (*end == 'm' || *end == 'M') { n *= 1000000; end++; }
+        opt->sizes[opt->sizeCount++] = (int)n;
+        text = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') return 0;
+    }
+    return opt->sizeCount > 0;
+}
+
+static void printUsage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "      --sizes LIST      particle counts, e.g. 1k,10k,100k,1m (the default)\n"
+        "      --dist LIST       uniform, plummer, disk (default all three)\n"
+        "      --filter TEXT     only benchmarks whose name contains TEXT\n"
+        "      --seed N          seed of the start distributions (default 1)\n"
+        "      --samples N       samples per run at most (default 30)\n"
+        "      --budget SECONDS  time per run, at least %d samples (default 2)\n"
+        "      --threads N       worker threads, 0 = one per core (default 0)\n"
+        "      --out FILE        JSON results (default graviton_bench.json)\n",
+        program, BENCH_MIN_SAMPLES);
+}
+
+static int parseOptions(int argc, char** argv, BenchOptions* opt) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) return 0;
+        if (i + 1 >= argc) {
+            fprintf(stderr, "[ERROR] Missing value for %s\n", arg);
+            return 0;
+        }
+        const char* value = argv[++i];
+        if (strcmp(arg, "--sizes") == 0) {
+            if (!parseSizes(value, opt)) {
+                fprintf(stderr, "[ERROR] Bad size list '%s'\n", value);
+                return 0;
+            }
+        }
+        else if (strcmp(arg, "--dist") == 0) opt->distributions = value;
+        else if (strcmp(arg, "--filter") == 0) opt->filter = value;
+        else if (strcmp(arg, "--seed") == 0) opt->seed = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--samples") == 0) opt->samples = atoi(value);
+        else if (strcmp(arg, "--budget") == 0) opt->budget = atof(value);
+        else if (strcmp(arg, "--threads") == 0) opt->threads = atoi(value);
+        else if (strcmp(arg, "--out") == 0) opt->out = value;
+        else {
+            fprintf(stderr, "[ERROR] Unknown option %s\n", arg);
+            return 0;
+        }
+    }
+    if (opt->samples < BENCH_MIN_SAMPLES) opt->samples = BENCH_MIN_SAMPLES;
+    if (opt->threads < 0) opt->threads = 0;
+    return 1;
+}
+
+// Next name of a comma-separated list into buffer; returns the rest, NULL at the end
+static const char* nextName(const char* list, char* buffer, int size) {
+    if (!list || !*list) return NULL;
+    int n = 0;
+    while (*list && *list != ',') {
+        if (n < size - 1) buffer[n++] = *list;
+        list++;
+    }
+    buffer[n] = '\0';
+    return *list == ',' ? list + 1 : list;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions opt = { { 1000, 10000, 100000, 1000000 }, 4, "uniform,plummer,disk", NULL,
+                         "graviton_bench.json", 1ULL, 30, 2.0, 0 };
+    if (!parseOptions(argc, argv, &opt)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    FILE* json = fopen(opt.out, "w");
+    if (!json) {
+        fprintf(stderr, "[ERROR] Could not write %s\n", opt.out);
+        return 1;
+    }
+
+    // The CPU paths only, as in graviton_headless
+    SetUseGPU(0);
+    SetGPUResident(0);
+    SetUseParticleMesh(0);
+    SetCollisionMode(COLLISION_MERGE);
+    profilerSetEnabled(0); // the cases time themselves
+    jobSystemInit(opt.threads);
+    double* times = malloc(sizeof(double) * opt.samples);
+    if (!times) return 1;
+
+    fprintf(json, "{\n  \"threads\": %d,\n  \"simd\": \"%s\",\n  \"seed\": %llu,\n  \"results\": [",
+            jobWorkerCount(), simdLevelName(simdLevel()), opt.seed);
+    printf("%-24s %-8s %8s %7s %10s %10s %10s %10s\n", "benchmark", "dist", "n", "samples", "min ms", "median ms", "p99 ms", "|dE/E|");
+    int first = 1;
+    char distribution[32];
+    const char* rest = opt.distributions;
+    while ((rest = nextName(rest, distribution, sizeof(distribution))) != NULL) {
+        for (int s = 0; s < opt.sizeCount; s++) {
+            BenchParticles particles = { 0 };
+            if (!generateParticles(&particles, distribution, opt.sizes[s], opt.seed)) {
+                fprintf(stderr, "[ERROR] Unknown distribution '%s' or out of memory\n", distribution);
+                freeParticles(&particles);
+                break;
+            }
+            BenchState state = { 0 };
+            state.particles = &particles;
+            state.visible = malloc(sizeof(int) * particles.count);
+            // Axis-aligned box of +-5000 around the origin as the view volume
+            for (int p = 0; p < 6; p++) {
+                for (int k = 0; k < 3; k++) state.planes[p][k] = 0.0f;
+                state.planes[p][p / 2] = p % 2 ? -1.0f : 1.0f;
+                state.planes[p][3] = 5000.0f;
+            }
+            for (int b = 0; b < (int)(sizeof(BENCH_CASES) / sizeof(BENCH_CASES[0])); b++) {
+                const BenchCase* bench = &BENCH_CASES[b];
+                if (opt.filter && !strstr(bench->name, opt.filter)) continue;
+                // Every benchmark starts from the generated particles and a clean solver state
+                resetList(&state);
+                if (!state.list || state.list->size != particles.count || !state.visible) {
+                    fprintf(stderr, "[ERROR] Out of memory at n = %d\n", particles.count);
+                    break;
+                }
+                BenchResult r = measure(bench, &state, &opt, times);
+                char drift[16] = "-";
+                if (r.energyError >= 0.0) snprintf(drift, sizeof(drift), "%.3e", r.energyError);
+                printf("%-24s %-8s %8d %7d %10.3f %10.3f %10.3f %10s\n", bench->name, distribution, particles.count,
+                       r.samples, r.min, r.median, r.p99, drift);
+                fflush(stdout);
+                fprintf(json, "%s\n    { \"benchmark\": \"%s\", \"distribution\": \"%s\", \"n\": %d, \"samples\": %d, "
+                              "\"min_ms\": %.6f, \"median_ms\": %.6f, \"p99_ms\": %.6f, \"mean_ms\": %.6f",
+                        first ? "" : ",", bench->name, distribution, particles.count, r.samples,
+                        r.min, r.median, r.p99, r.mean);
+                if (r.energyError >= 0.0) fprintf(json, ", \"energy_error\": %.6e", r.energyError);
+                fprintf(json, " }");
+                first = 0;
+                freeGrid(state.grid);
+                state.grid = NULL;
+                ShutdownGravitation();
+                SetIntegrator(INTEGRATOR_LEAPFROG);
+                SetCollisionMode(COLLISION_MERGE);
+            }
+            freeObjectList(state.list);
+            free(state.visible);
+            freeParticles(&particles);
+        }
+    }
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+    printf("results written to %s\n", opt.out);
+
+    free(times);
+    jobSystemShutdown();
+    return 0;
+}
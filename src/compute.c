@@ -12,55 +12,64 @@ int computeAvailable(void) {
     return available;
 }
 
-GLuint createGravityComputeShader() {
-    const GLubyte* glVersion = glGetString(GL_VERSION);
-    char* computeShaderSrc = LoadFileText("shader/gravitation.comp");
+// Read a whole text file, NULL if it cannot be read (release with free).
+// Plain stdio instead of raylib's LoadFileText keeps graviton_core free of raylib.
+static char* loadShaderSource(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    char* text = NULL;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long size = ftell(file);
+        if (size >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+            text = malloc((size_t)size + 1);
+            if (text) text[fread(text, 1, (size_t)size, file)] = '\0';
+        }
+    }
+    fclose(file);
+    return text;
+}
+
+// Compile and link a compute shader program from a file
+GLuint createComputeProgram(const char* path) {
+    char* computeShaderSrc = loadShaderSource(path);
     if (!computeShaderSrc) {
-        printf("[createGravityComputeShader] ERROR: Could not load shader file at 'shader/gravitation.comp'.\n");
+        printf("[createComputeProgram] ERROR: Could not load shader file at '%s'.\n", path);
         return 0;
     }
     GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
-    if (shader == 0) {
-        printf("[createGravityComputeShader] ERROR: glCreateShader(GL_COMPUTE_SHADER) returned 0!\n");
-        UnloadFileText(computeShaderSrc);
-        return 0;
-    }
-    const GLchar* const srcs[] = { (const GLchar*)computeShaderSrc };
-    glShaderSource(shader, 1, srcs, NULL);
+    glShaderSource(shader, 1, (const GLchar* const*)&computeShaderSrc, NULL);
     glCompileShader(shader);
     GLint success;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if(!success) {
+    if (!success) {
         char infoLog[512];
         glGetShaderInfoLog(shader, 512, NULL, infoLog);
+        printf("[createComputeProgram] Compile error in %s: %s\n", path, infoLog);
         glDeleteShader(shader);
-        UnloadFileText(computeShaderSrc);
+        free(computeShaderSrc);
         return 0;
-    } else {
     }
     GLuint program = glCreateProgram();
-    if (program == 0) {
-        glDeleteShader(shader);
-        UnloadFileText(computeShaderSrc);
-        return 0;
-    }
     glAttachShader(program, shader);
     glLinkProgram(program);
     glDeleteShader(shader);
-    UnloadFileText(computeShaderSrc);
-
-    // Check link success
+    free(computeShaderSrc);
     GLint linkOK = 0;
     glGetProgramiv(program, GL_LINK_STATUS, &linkOK);
     if (!linkOK) {
         char infoLog[512];
         glGetProgramInfoLog(program, 512, NULL, infoLog);
+        printf("[createComputeProgram] Link error in %s: %s\n", path, infoLog);
         glDeleteProgram(program);
         return 0;
     }
     return program;
 }
 
+GLuint createGravityComputeShader() {
+    return createComputeProgram("shader/gravitation.comp");
+}
+
 int computeGravity(GPUObject* objects, int numObjects, float deltatime) {
     static GLuint shaderProgram = 0; // Handle to the compute shader program
     static GLuint ssboIn = 0;        // Input buffer (binding = 0)
@@ -104,9 +113,7 @@ int computeGravity(GPUObject* objects, int numObjects, float deltatime) {
     glUniform1f(glGetUniformLocation(shaderProgram, "deltaTime"), deltatime);
     glUniform1f(glGetUniformLocation(shaderProgram, "G"), 6.67430e-11f);
     glUniform1i(glGetUniformLocation(shaderProgram, "numObjects"), numObjects);
-    glUniform1f(glGetUniformLocation(shaderProgram, "softening"), 0);
-    glUniform1f(glGetUniformLocation(shaderProgram, "maxSpeed"), 1000.0f);
-    glUniform1f(glGetUniformLocation(shaderProgram, "maxPos"), 100000.0f);
+    glUniform1f(glGetUniformLocation(shaderProgram, "softening"), 1.0f);
 
     // Bind buffers to match compute shader bindings
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ssboIn);
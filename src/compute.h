@@ -13,7 +13,8 @@
 typedef struct GPUObject {
     float position[3]; float _padPos;   // 16 bytes
     float velocity[3]; float _padVel;   // 16 bytes
-    float mass;        float _padTail[3]; // 16 bytes
+    float mass;        float element;   // element: elementIndex(), for the renderer
+    float _padTail[2];                  // 16 bytes with mass and element
 } GPUObject;
 
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
@@ -23,6 +24,9 @@ _Static_assert(sizeof(GPUObject) == 48, "GPUObject must be 48 bytes (std430 vec3
 // Returns non-zero if compute path is usable on this machine (GL 4.3+ and context ready)
 int computeAvailable(void);
 
+// Compile and link the compute shader in `path`, 0 on failure (errors are printed)
+GLuint createComputeProgram(const char* path);
+
 GLuint createGravityComputeShader();
 
 // Returns 1 on success, 0 on failure (caller can fall back to CPU path)
@@ -0,0 +1,260 @@
+// Batch runs without a window or GPU: spawns N random particles and steps
+// them with one of the CPU solvers as fast as the machine allows.
+#include "Calculations.h"
+#include "JobSystem.h"
+#include "Profiler.h"
+#include <string.h>
+#include <ctype.h>
+
+#define PARTICLERADIUS 1 // in km, as in the interactive app
+#define HEADLESS_CSV_INTERVAL 10 // diagnostics cadence of --csv without --diagnostics
+
+typedef struct HeadlessOptions {
+    int particles;
+    int steps;
+    const char* solver;   // bh, exact or pm
+    unsigned int seed;
+    float dt;
+    float room;           // particles start in [-room, room]^3
+    float theta;
+    CollisionMode collisions;
+    Integrator integrator;
+    int threads;          // 0 = one per core
+    int progress;         // print a line every this many steps, 0 = only the summary
+    const char* trace;    // Chrome trace of the last steps, NULL = none
+    int diagnostics;      // conservation diagnostics every this many steps, 0 = off
+    const char* csv;      // one line per diagnostics measurement, NULL = none
+} HeadlessOptions;
+
+static void printUsage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -n, --particles N     particles to spawn (default 100000)\n"
+        "  -s, --steps N         ticks to run (default 1000)\n"
+        "      --solver NAME     bh (Barnes-Hut), exact (theta 0) or pm (particle mesh), default bh\n"
+        "      --seed N          random seed (default 1)\n"
+        "      --dt SECONDS      tick length (default 1/90)\n"
+        "      --room R          half extent of the start cube (default 10000)\n"
+        "      --theta T         Barnes-Hut opening angle (default %.2f)\n"
+        "      --collisions M    off, merge or elastic (default merge)\n"
+        "      --integrator I    euler, leapfrog, hermite or block (default leapfrog; pm uses leapfrog for the Hermite ones)\n"
+        "      --threads N       worker threads, 0 = one per core (default 0)\n"
+        "      --progress N      report every N steps (default 0: summary only)\n"
+        "      --trace FILE      write a Chrome trace of the phases and print their mean times\n"
+        "      --diagnostics N   measure energy, momenta and centre of mass every N steps (default 0: off)\n"
+        "      --csv FILE        write the diagnostics as CSV (every %d steps unless --diagnostics is given)\n",
+        program, GetTheta(), HEADLESS_CSV_INTERVAL);
+}
+
+// Case-insensitive, so "merge" matches collisionModeName's "Merge"
+static int sameName(const char* a, const char* b) {
+    for (; *a && *b; a++, b++) {
+        if (tolower((unsigned char)*a) != tolower((unsigned char)*b)) return 0;
+    }
+    return *a == *b;
+}
+
+static int parseCollisionMode(const char* name, CollisionMode* mode) {
+    for (int m = 0; m < COLLISION_MODE_COUNT; m++) {
+        if (sameName(name, collisionModeName((CollisionMode)m))) {
+            *mode = (CollisionMode)m;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int parseIntegrator(const char* name, Integrator* integrator) {
+    for (int i = 0; i < INTEGRATOR_COUNT; i++) {
+        if (sameName(name, integratorName((Integrator)i))) {
+            *integrator = (Integrator)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns 0 on a bad argument
+static int parseOptions(int argc, char** argv, HeadlessOptions* opt) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) return 0;
+        if (i + 1 >= argc) {
+            fprintf(stderr, "[ERROR] Missing value for %s\n", arg);
+            return 0;
+        }
+        const char* value = argv[++i];
+        if (strcmp(arg, "-n") == 0 || strcmp(arg, "--particles") == 0) opt->particles = atoi(value);
+        else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--steps") == 0) opt->steps = atoi(value);
+        else if (strcmp(arg, "--solver") == 0) opt->solver = value;
+        else if (strcmp(arg, "--seed") == 0) opt->seed = (unsigned int)strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--dt") == 0) opt->dt = (float)atof(value);
+        else if (strcmp(arg, "--room") == 0) opt->room = (float)atof(value);
+        else if (strcmp(arg, "--theta") == 0) opt->theta = (float)atof(value);
+        else if (strcmp(arg, "--threads") == 0) opt->threads = atoi(value);
+        else if (strcmp(arg, "--progress") == 0) opt->progress = atoi(value);
+        else if (strcmp(arg, "--trace") == 0) opt->trace = value;
+        else if (strcmp(arg, "--diagnostics") == 0) opt->diagnostics = atoi(value);
+        else if (strcmp(arg, "--csv") == 0) opt->csv = value;
+        else if (strcmp(arg, "--collisions") == 0) {
+            if (!parseCollisionMode(value, &opt->collisions)) {
+                fprintf(stderr, "[ERROR] Unknown collision mode '%s'\n", value);
+                return 0;
+            }
+        } else if (strcmp(arg, "--integrator") == 0) {
+            if (!parseIntegrator(value, &opt->integrator)) {
+                fprintf(stderr, "[ERROR] Unknown integrator '%s'\n", value);
+                return 0;
+            }
+        } else {
+            fprintf(stderr, "[ERROR] Unknown option %s\n", arg);
+            return 0;
+        }
+    }
+    if (strcmp(opt->solver, "bh") != 0 && strcmp(opt->solver, "exact") != 0 && strcmp(opt->solver, "pm") != 0) {
+        fprintf(stderr, "[ERROR] Unknown solver '%s'\n", opt->solver);
+        return 0;
+    }
+    if (opt->particles < 0 || opt->steps < 0 || opt->dt <= 0.0f || opt->threads < 0 || opt->diagnostics < 0) {
+        fprintf(stderr, "[ERROR] Particles, steps, threads and diagnostics must not be negative, dt must be positive\n");
+        return 0;
+    }
+    if (opt->csv && opt->diagnostics == 0) opt->diagnostics = HEADLESS_CSV_INTERVAL;
+    return 1;
+}
+
+// Total mass and centre of mass, to compare runs
+static void printState(const ObjectList* list) {
+    double mass = 0.0, x = 0.0, y = 0.0, z = 0.0;
+    for (int i = 0; i < list->size; i++) {
+        mass += list->mass[i];
+        x += (double)list->mass[i] * list->posX[i];
+        y += (double)list->mass[i] * list->posY[i];
+        z += (double)list->mass[i] * list->posZ[i];
+    }
+    if (mass > 0.0) {
+        x /= mass; y /= mass; z /= mass;
+    }
+    printf("particles %d  mass %.6e  centre of mass (%.6f, %.6f, %.6f)\n", list->size, mass, x, y, z);
+}
+
+static void writeCSVHeader(FILE* file) {
+    fprintf(file, "step,time,particles,mass,kinetic,potential,energy,energy_error,"
+                  "px,py,pz,lx,ly,lz,comx,comy,comz,ms\n");
+}
+
+static void writeCSVRow(FILE* file, int step, double time, const Diagnostics* d) {
+    fprintf(file, "%d,%.6f,%d,%.9e,%.9e,%.9e,%.9e,%.6e,%.9e,%.9e,%.9e,%.9e,%.9e,%.9e,%.6f,%.6f,%.6f,%.3f\n",
+            step, time, d->particles, d->mass, d->kinetic, d->potential, d->energy, d->energyError,
+            d->momentum[0], d->momentum[1], d->momentum[2],
+            d->angularMomentum[0], d->angularMomentum[1], d->angularMomentum[2],
+            d->centreOfMass[0], d->centreOfMass[1], d->centreOfMass[2], d->ms);
+}
+
+// Mean time of each profiled phase over the last PROFILER_HISTORY steps
+static void printPhases(void) {
+    float history[PROFILER_HISTORY];
+    for (int z = 0; z < profilerZoneCount(); z++) {
+        int steps = profilerZoneHistory(z, history);
+        double sum = 0.0;
+        for (int i = 0; i < steps; i++) sum += history[i];
+        printf("  %-24s %8.3f ms/step\n", profilerZoneName(z), steps > 0 ? sum / steps : 0.0);
+    }
+}
+
+int main(int argc, char** argv) {
+    HeadlessOptions opt = { 100000, 1000, "bh", 1u, 1.0f / 90.0f, 10000.0f, GetTheta(), COLLISION_MERGE, INTEGRATOR_LEAPFROG, 0, 0, NULL, 0, NULL };
+    if (!parseOptions(argc, argv, &opt)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // CPU solvers only: there is no GL context
+    SetUseGPU(0);
+    SetGPUResident(0);
+    SetUseParticleMesh(strcmp(opt.solver, "pm") == 0);
+    SetTheta(strcmp(opt.solver, "exact") == 0 ? 0.0f : opt.theta);
+    SetCollisionMode(opt.collisions);
+    SetIntegrator(opt.integrator);
+    profilerSetEnabled(opt.trace != NULL);
+    jobSystemInit(opt.threads);
+
+    srand(opt.seed);
+    ObjectList* objectList = createObjectList();
+    if (!objectList) {
+        fprintf(stderr, "[ERROR] Could not allocate the particle list.\n");
+        return 1;
+    }
+    double start = jobTime();
+    randomObjectsFor(opt.particles, objectList, (Vector3){ opt.room, opt.room, opt.room });
+    double spawned = jobTime();
+    printf("solver %s  theta %.2f  integrator %s  collisions %s  threads %d  seed %u  dt %g\n",
+           opt.solver, GetTheta(), integratorName(opt.integrator), collisionModeName(opt.collisions),
+           jobWorkerCount(), opt.seed, opt.dt);
+    printf("spawned %d particles in %.1f ms\n", objectList->size, (spawned - start) * 1000.0);
+
+    FILE* csv = NULL;
+    if (opt.csv) {
+        csv = fopen(opt.csv, "w");
+        if (!csv) {
+            fprintf(stderr, "[ERROR] Could not write %s\n", opt.csv);
+            freeObjectList(objectList);
+            return 1;
+        }
+        writeCSVHeader(csv);
+    }
+    // Diagnostics are timed on their own and left out of ms/step
+    Diagnostics diag;
+    double diagSeconds = 0.0, worstError = 0.0;
+    int measured = 0;
+    if (opt.diagnostics > 0 && MeasureDiagnostics(objectList, &diag)) {
+        if (csv) writeCSVRow(csv, 0, 0.0, &diag);
+        measured++;
+    }
+    spawned = jobTime();
+
+    for (int step = 1; step <= opt.steps; step++) {
+        ComputeGravitationWithShader(objectList, opt.dt);
+        CalculateCollision(objectList, PARTICLERADIUS);
+        if (opt.diagnostics > 0 && step % opt.diagnostics == 0) {
+            double before = jobTime();
+            if (MeasureDiagnostics(objectList, &diag)) {
+                if (csv) writeCSVRow(csv, step, step * (double)opt.dt, &diag);
+                if (fabs(diag.energyError) > worstError) worstError = fabs(diag.energyError);
+                measured++;
+            }
+            diagSeconds += jobTime() - before;
+        }
+        profilerFrame();
+        if (opt.progress > 0 && step % opt.progress == 0) {
+            double elapsed = jobTime() - spawned - diagSeconds;
+            printf("step %d  particles %d  %.2f ms/step\n", step, objectList->size, elapsed * 1000.0 / step);
+            fflush(stdout);
+        }
+    }
+    double seconds = jobTime() - spawned - diagSeconds;
+
+    printState(objectList);
+    if (measured > 0) {
+        printf("energy %.9e (%s potential)  final dE/E %+.3e  max |dE/E| %.3e  %d measurements, %.2f ms each\n",
+               diag.energy, diag.potentialSource, diag.energyError, worstError, measured,
+               measured > 1 ? diagSeconds * 1000.0 / (measured - 1) : diag.ms);
+    }
+    if (csv) {
+        if (ferror(csv)) fprintf(stderr, "[ERROR] Could not write %s\n", opt.csv);
+        else printf("diagnostics written to %s\n", opt.csv);
+        fclose(csv);
+    }
+    printf("%d steps in %.3f s  %.3f ms/step  %.1f steps/s\n", opt.steps, seconds,
+           opt.steps > 0 ? seconds * 1000.0 / opt.steps : 0.0, seconds > 0.0 ? opt.steps / seconds : 0.0);
+    if (opt.trace) {
+        printPhases();
+        if (profilerWriteTrace(opt.trace)) printf("trace written to %s\n", opt.trace);
+        else fprintf(stderr, "[ERROR] Could not write %s\n", opt.trace);
+    }
+
+    ShutdownGravitation();
+    jobSystemShutdown();
+    freeObjectList(objectList);
+    return 0;
+}
@@ -4,8 +4,40 @@
 #include "Calculations.h"
 #include "Draw.h"
 #include "InputHandler.h"
+#include "JobSystem.h"
+#include "Profiler.h"
+#include "ProfilerOverlay.h"
+#include "SimdKernels.h"
+#include "Simulation.h"
 
 #define PARTICLERADIUS 1 // in km
+#define TRACE_FILE "graviton_trace.json"
+#define DIAGNOSTICS_INTERVAL 60 // ticks between conservation diagnostics while on (M)
+
+// Toggles read by the physics ticks, applied while the simulation is locked
+static const int SIMULATION_KEYS[] = { KEY_G, KEY_R, KEY_P, KEY_LEFT_BRACKET, KEY_RIGHT_BRACKET, KEY_N, KEY_K, KEY_I, KEY_M };
+
+static void handleSimulationToggles(Simulation* sim) {
+    int pressed = 0;
+    for (int i = 0; i < (int)(sizeof(SIMULATION_KEYS) / sizeof(SIMULATION_KEYS[0])); i++) {
+        if (IsKeyPressed(SIMULATION_KEYS[i])) pressed = 1;
+    }
+    if (!pressed) return;
+    lockSimulation(sim);
+    if (IsKeyPressed(KEY_G)) SetUseGPU(!IsUseGPU());
+    if (IsKeyPressed(KEY_R)) SetGPUResident(!IsGPUResident());
+    if (IsKeyPressed(KEY_P)) SetUseParticleMesh(!IsUseParticleMesh());
+    if (IsKeyPressed(KEY_LEFT_BRACKET)) SetTheta(GetTheta() - 0.1f);
+    if (IsKeyPressed(KEY_RIGHT_BRACKET)) SetTheta(GetTheta() + 0.1f);
+    if (IsKeyPressed(KEY_N)) SetNearFieldNeighbours(!IsNearFieldNeighbours());
+    if (IsKeyPressed(KEY_K)) SetCollisionMode((GetCollisionMode() + 1) % COLLISION_MODE_COUNT);
+    if (IsKeyPressed(KEY_I)) SetIntegrator((GetIntegrator() + 1) % INTEGRATOR_COUNT);
+    if (IsKeyPressed(KEY_M)) {
+        SetDiagnosticsInterval(GetDiagnosticsInterval() > 0 ? 0 : DIAGNOSTICS_INTERVAL);
+        ResetDiagnosticsReference();
+    }
+    unlockSimulation(sim);
+}
 
 
 int main(){
@@ -19,7 +51,11 @@ int main(){
     // Initialize OpenGL function loader (gl3w) AFTER the context is created
     if (gl3wInit()) {
         fprintf(stderr, "[ERROR] gl3wInit failed to initialize OpenGL loader.\n");
+    } else {
+        // GPU phases are timed with GL_TIMESTAMP queries (GL 3.3)
+        profilerEnableGPU(gl3wIsSupported(3, 3));
     }
+    int showProfiler = 0;
 
     Camera3D camera = { 0 };
     camera.position = (Vector3){ 100.0f, 100.0f, 10.0f };
@@ -35,50 +71,76 @@ int main(){
 
     randomObjectsFor(100000, objectList, (Vector3){10000, 10000, 10000});
 
-    //loop
-    float t_delta = 0;
+    // Pick the SIMD kernels before the simulation thread can reach them
+    simdDetectedLevel();
+
+    // Physics at a fixed tick on its own thread, drawn blended between ticks
     float t_tick = 1.0f / 90.0f; // physics tick
-    float t_temp = 0;
-    int frameCounter = 0;
+    Simulation* simulation = createSimulation(objectList, t_tick, PARTICLERADIUS);
+    if (!simulation) {
+        fprintf(stderr, "[ERROR] Could not start the simulation.\n");
+        CloseWindow();
+        freeObjectList(objectList);
+        return 1;
+    }
 
+    //loop
     while(!WindowShouldClose()){
-        
-        t_delta = GetFrameTime();
-        t_temp += t_delta;
 
         UpdateCamera(&camera, CAMERA_FREE);
 
-        handleInput(objectList, &camera);
+        handleInput(simulation, &camera);
         // Runtime toggles
-        if (IsKeyPressed(KEY_G)) SetUseGPU(!IsUseGPU());
+        handleSimulationToggles(simulation);
         if (IsKeyPressed(KEY_C)) SetCullingEnabled(!IsCullingEnabled());
-
-        // At most one physics substep per frame
-        if (t_temp >= t_tick) {
-            ComputeGravitationWithShader(objectList, t_tick);
-            // Throttle collision checks (every 5 frames)
-            if ((frameCounter % 5) == 0) {
-                CalculateCollision(objectList, PARTICLERADIUS);
-            }
-            t_temp -= t_tick;
+        if (IsKeyPressed(KEY_V)) SetRenderMode((GetRenderMode() + 1) % RENDER_MODE_COUNT);
+        if (IsKeyPressed(KEY_MINUS)) SetLODDistance(GetLODDistance() / 1.25f);
+        if (IsKeyPressed(KEY_EQUAL)) SetLODDistance(GetLODDistance() * 1.25f);
+        if (IsKeyPressed(KEY_O)) showProfiler = !showProfiler;
+        if (IsKeyPressed(KEY_T)) {
+            if (profilerWriteTrace(TRACE_FILE)) printf("[Profiler] Trace written to %s\n", TRACE_FILE);
+            else fprintf(stderr, "[ERROR] Could not write %s\n", TRACE_FILE);
         }
-        
+
+        // Due ticks (unless the simulation thread runs them) and this frame's particles
+        int live = 0;
+        ObjectList* frame = updateSimulation(simulation, &live);
+        float frameDrift = 0.0f;
+        const Grid* frameGrid = live ? NULL : simulationFrameGrid(simulation, &frameDrift);
+
         BeginDrawing();
             ClearBackground(BLACK);
             BeginMode3D(camera);
                 DrawGrid(200, 10.0f);
-                DrawParticles(objectList, &camera);
+                if (live) DrawParticles(frame, &camera);
+                else DrawParticleFrame(frame, &camera, frameGrid, frameDrift);
             EndMode3D();
             // HUD
-            DrawText(TextFormat("Mode: %s  Culling: %s  Objects: %d FPS: %.5i", IsUseGPU()?"GPU":"CPU", IsCullingEnabled()?"On":"Off", objectList->size, GetFPS()), 10, 10, 20, RAYWHITE);
+            DrawText(TextFormat("Mode: %s  Culling: %s  Objects: %d FPS: %.5i", IsUseParticleMesh()?"PM":(IsUseGPU()?"GPU":"CPU"), IsCullingEnabled()?"On":"Off", frame->size, GetFPS()), 10, 10, 20, RAYWHITE);
+            DrawText(TextFormat("Theta: %.2f  ([ / ])  Near field: %s (N)  Resident: %s (R)  Integrator: %s (I)", GetTheta(), IsNearFieldNeighbours()?"3x3x3":"cell", IsStateOnGPU()?"On":"Off", (IsUseGPU() && !IsUseParticleMesh()) ? "Euler (GPU)" : integratorName(GetIntegrator())), 10, 35, 20, RAYWHITE);
+            DrawText(TextFormat("Render: %s (V)  LOD distance: %.0f (- / =)", GetRenderMode() == RENDER_MODE_DENSITY ? "Density" : "LOD", GetLODDistance()), 10, 60, 20, RAYWHITE);
+            DrawText(TextFormat("Tick: %.1f ms of %.1f ms  (%s)  Collisions: %s (K)", simulationTickMs(simulation), t_tick * 1000.0f, simulationIsThreaded(simulation) ? "physics thread" : "render thread", collisionModeName(GetCollisionMode())), 10, 85, 20, RAYWHITE);
+            const Diagnostics* diag = GetDiagnosticsInterval() > 0 ? simulationDiagnostics(simulation) : NULL;
+            if (diag) {
+                double p = sqrt(diag->momentum[0] * diag->momentum[0] + diag->momentum[1] * diag->momentum[1] + diag->momentum[2] * diag->momentum[2]);
+                double l = sqrt(diag->angularMomentum[0] * diag->angularMomentum[0] + diag->angularMomentum[1] * diag->angularMomentum[1] + diag->angularMomentum[2] * diag->angularMomentum[2]);
+                DrawText(TextFormat("E: %.4e (%s)  dE/E: %+.2e  |p|: %.3e  |L|: %.3e  COM: %.1f %.1f %.1f  (M, %.1f ms)", diag->energy, diag->potentialSource, diag->energyError, p, l, diag->centreOfMass[0], diag->centreOfMass[1], diag->centreOfMass[2], diag->ms), 10, 110, 20, RAYWHITE);
+            } else {
+                DrawText(GetDiagnosticsInterval() > 0 ? "Diagnostics: waiting for the first measurement (M)" : "Diagnostics: off (M)", 10, 110, 20, RAYWHITE);
+            }
+            if (showProfiler) DrawProfilerOverlay(10, 140);
         EndDrawing();
+        profilerFrame();
 
-        frameCounter++;
-       
     }
 
     //end
+    freeSimulation(simulation);
+    SyncGravitationToCPU(objectList);
     ShutdownParticleRender();
+    ShutdownGravitation();
+    profilerShutdown();
+    jobSystemShutdown();
     CloseWindow();
 
     freeObjectList(objectList);
@@ -1,99 +1,263 @@
-
 #include "particle.h"
+#include <string.h>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+#define OBJECTLIST_MIN_CAPACITY 1024
+
+
+// Random float in [min, max]
+float rand_range(float min, float max) {
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+// Random integer in [min, max] from rand(), so srand() alone fixes a run
+// (raylib's GetRandomValue keeps its own generator)
+static int rand_int(int min, int max) {
+    if (min > max) {
+        int t = min; min = max; max = t;
+    }
+    return min + (int)((double)rand() / ((double)RAND_MAX + 1.0) * (double)(max - min + 1));
+}
+
+// Allocate memory aligned to PARTICLE_ALIGNMENT (release with alignedFree)
+void* alignedAlloc(size_t bytes) {
+    if (bytes == 0) bytes = PARTICLE_ALIGNMENT;
+#if defined(_WIN32)
+    return _aligned_malloc(bytes, PARTICLE_ALIGNMENT);
+#else
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, PARTICLE_ALIGNMENT, bytes) != 0) return NULL;
+    return ptr;
+#endif
+}
+
+void alignedFree(void* ptr) {
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+// Move one per-particle array into a bigger aligned block
+static int growArray(void** array, size_t elemSize, int used, int newCapacity) {
+    void* block = alignedAlloc(elemSize * (size_t)newCapacity);
+    if (block == NULL) return 0;
+    if (*array != NULL) {
+        memcpy(block, *array, elemSize * (size_t)used);
+        alignedFree(*array);
+    }
+    *array = block;
+    return 1;
+}
+
+// Grow the slot arrays geometrically so appends stay amortised O(1)
+static int reserveSlots(ObjectList* list, int minCapacity) {
+    if (minCapacity <= list->capacity) return 1;
+    int newCap = list->capacity < OBJECTLIST_MIN_CAPACITY ? OBJECTLIST_MIN_CAPACITY : list->capacity;
+    while (newCap < minCapacity) newCap *= 2;
+
+    int n = list->size;
+    if (!growArray((void**)&list->posX, sizeof(float), n, newCap) ||
+        !growArray((void**)&list->posY, sizeof(float), n, newCap) ||
+        !growArray((void**)&list->posZ, sizeof(float), n, newCap) ||
+        !growArray((void**)&list->velX, sizeof(float), n, newCap) ||
+        !growArray((void**)&list->velY, sizeof(float), n, newCap) ||
+        !growArray((void**)&list->velZ, sizeof(float), n, newCap) ||
+        !growArray((void**)&list->mass, sizeof(float), n, newCap) ||
+        !growArray((void**)&list->element, sizeof(enum element), n, newCap) ||
+        !growArray((void**)&list->ids, sizeof(unsigned int), n, newCap)) {
+        return 0;
+    }
+    list->capacity = newCap;
+    return 1;
+}
+
+// Grow the id -> slot table so that `id` is a valid index
+static int reserveIds(ObjectList* list, unsigned int id) {
+    if (id < list->idCapacity) return 1;
+    unsigned int newCap = list->idCapacity < OBJECTLIST_MIN_CAPACITY ? OBJECTLIST_MIN_CAPACITY : list->idCapacity;
+    while (newCap <= id) newCap *= 2;
+    int* table = realloc(list->slotOfId, newCap * sizeof(int));
+    if (table == NULL) return 0;
+    for (unsigned int i = list->idCapacity; i < newCap; i++) table[i] = -1;
+    list->slotOfId = table;
+    list->idCapacity = newCap;
+    return 1;
+}
+
+// Hand out a free id, recycled if possible; the slot table is grown to hold it
+static int takeId(ObjectList* list, unsigned int* id) {
+    if (list->freeIdCount > 0) {
+        *id = list->freeIds[--list->freeIdCount];
+        return 1;
+    }
+    if (!reserveIds(list, list->nextId)) return 0;
+    *id = list->nextId++;
+    return 1;
+}
+
+// Put the id of a removed particle on the free list. Without memory for it the
+// id is simply never reused.
+static void releaseId(ObjectList* list, unsigned int id) {
+    if (list->freeIdCount == list->freeIdCapacity) {
+        int newCap = list->freeIdCapacity > 0 ? list->freeIdCapacity * 2 : OBJECTLIST_MIN_CAPACITY;
+        unsigned int* ids = realloc(list->freeIds, sizeof(unsigned int) * newCap);
+        if (ids == NULL) return;
+        list->freeIds = ids;
+        list->freeIdCapacity = newCap;
+    }
+    list->freeIds[list->freeIdCount++] = id;
+}
+
+static const enum element ELEMENT_ORDER[ELEMENT_COUNT] = {hydrogen, helium, oxygen, carbon, neon, iron};
 
+// Position of an element in the lookup-table order
+int elementIndex(enum element element) {
+    switch (element) {
+        case hydrogen: return 0;
+        case helium:   return 1;
+        case oxygen:   return 2;
+        case carbon:   return 3;
+        case neon:     return 4;
+        case iron:     return 5;
+    }
+    return 0;
+}
 
-// Convert mouse position to a 3D world point at a given distance from the camera
-Vector3 GetMouseWorldPoint(const Camera3D *camera, float distance) {
-    Ray ray = GetMouseRay(GetMousePosition(), *camera);
-    Vector3 point = {
-        ray.position.x + ray.direction.x * distance,
-        ray.position.y + ray.direction.y * distance,
-        ray.position.z + ray.direction.z * distance
-    };
-    return point;
+enum element elementAt(int index) {
+    return ELEMENT_ORDER[index];
+}
+
+// Source of ObjectList.generation, shared by all lists so that a list
+// re-created at the same address never looks unchanged
+static unsigned int gNextGeneration = 0;
+
+void touchObjectList(ObjectList* oList) {
+    oList->generation = ++gNextGeneration;
 }
 
 // Create a new, empty object list
 ObjectList* createObjectList() {
-    ObjectList* list = malloc(sizeof(ObjectList));
-    list->gObjs = NULL;
-    list->size = 0;
+    ObjectList* list = calloc(1, sizeof(ObjectList));
+    if (list) touchObjectList(list);
     return list;
 }
 
-// Add a new object to the object list
-void addObjectList(GravitationalObject* obj, ObjectList* oList) {
-    GravitationalObject** temp_array = realloc(oList->gObjs, (oList->size+1) * sizeof(GravitationalObject*));
-    if (temp_array == NULL) {
+// Append a particle to the object list, returns its stable id (or (unsigned)-1 on failure)
+unsigned int addObjectList(const GravitationalObject* obj, ObjectList* oList) {
+    unsigned int id;
+    if (!reserveSlots(oList, oList->size + 1) || !takeId(oList, &id)) {
         fprintf(stderr, "[ERROR] Could not allocate memory for new object.\n");
-        return;
+        return (unsigned int)-1;
     }
-    oList->gObjs = temp_array;
-    oList->gObjs[oList->size] = obj;
+    int i = oList->size;
+    oList->posX[i] = obj->position.x;
+    oList->posY[i] = obj->position.y;
+    oList->posZ[i] = obj->position.z;
+    oList->velX[i] = obj->velocity.x;
+    oList->velY[i] = obj->velocity.y;
+    oList->velZ[i] = obj->velocity.z;
+    oList->mass[i] = (float)obj->element;
+    oList->element[i] = obj->element;
+    oList->ids[i] = id;
+    oList->slotOfId[id] = i;
     oList->size++;
+    return id;
 }
 
-// Free all memory used by the object list and its objects
-void freeObjectList(ObjectList* oList) {
-    for (int i = 0; i < oList->size; i++) {
-        free(oList->gObjs[i]);
+// Make room for `capacity` slots without adding particles (e.g. for copies
+// that fill the slot arrays directly)
+int reserveObjectList(ObjectList* oList, int capacity) {
+    return reserveSlots(oList, capacity);
+}
+
+// Remove an object at a specific index; the last object takes its slot
+void removeObjectAtIndex(ObjectList* list, int index) {
+    if (index < 0 || index >= list->size) return;
+    int last = list->size - 1;
+    list->slotOfId[list->ids[index]] = -1;
+    releaseId(list, list->ids[index]);
+    if (index != last) {
+        list->posX[index] = list->posX[last];
+        list->posY[index] = list->posY[last];
+        list->posZ[index] = list->posZ[last];
+        list->velX[index] = list->velX[last];
+        list->velY[index] = list->velY[last];
+        list->velZ[index] = list->velZ[last];
+        list->mass[index] = list->mass[last];
+        list->element[index] = list->element[last];
+        list->ids[index] = list->ids[last];
+        list->slotOfId[list->ids[index]] = index;
     }
-    free(oList->gObjs);
+    list->size--;
+}
+
+// Current slot of the particle with the given id, or -1 if it no longer exists
+int indexOfObjectId(const ObjectList* list, unsigned int id) {
+    if (id >= list->idCapacity) return -1;
+    return list->slotOfId[id];
+}
+
+// Copy the particle in slot `index` out of the store
+GravitationalObject getObjectAt(const ObjectList* list, int index) {
+    GravitationalObject obj;
+    obj.name = "Particle";
+    obj.element = list->element[index];
+    obj.position = objectPosition(list, index);
+    obj.velocity = (Vector3){ list->velX[index], list->velY[index], list->velZ[index] };
+    return obj;
+}
+
+// Free all memory used by the object list
+void freeObjectList(ObjectList* oList) {
+    if (!oList) return;
+    alignedFree(oList->posX);
+    alignedFree(oList->posY);
+    alignedFree(oList->posZ);
+    alignedFree(oList->velX);
+    alignedFree(oList->velY);
+    alignedFree(oList->velZ);
+    alignedFree(oList->mass);
+    alignedFree(oList->element);
+    alignedFree(oList->ids);
+    free(oList->slotOfId);
+    free(oList->freeIds);
     free(oList);
 }
 
 // Create a random particle at a given position
-GravitationalObject* createRandomParticleAt(Vector3* pos) {
-    GravitationalObject* obj = malloc(sizeof(GravitationalObject));
-    enum element elements[] = {hydrogen, helium, oxygen, carbon, neon, iron};
-    obj->name = "Random";
-    obj->element = elements[rand() % 6];
-    obj->position = *pos;
-    obj->force = (Vector3){0, 0, 0};
-    obj->velocity.x = GetRandomValue(-0.1, 0.1);
-    obj->velocity.y = GetRandomValue(-0.1, 0.1);
-    obj->velocity.z = GetRandomValue(-0.1, 0.1);
+GravitationalObject createRandomParticleAt(Vector3* pos) {
+    GravitationalObject obj;
+    obj.name = "Random";
+    obj.element = elementAt(rand() % ELEMENT_COUNT);
+    obj.position = *pos;
+    obj.velocity.x = rand_int(-0.1, 0.1);
+    obj.velocity.y = rand_int(-0.1, 0.1);
+    obj.velocity.z = rand_int(-0.1, 0.1);
     return obj;
 }
 
 // Create a custom particle at a given position, element, and velocity
-GravitationalObject* createParticleAt(Vector3* pos, enum element element, Vector3* velocity) {
-    GravitationalObject* obj = malloc(sizeof(GravitationalObject));
-    obj->name = "Custom";
-    obj->element = element;
-    obj->position = *pos;
-    obj->force = (Vector3){0, 0, 0};
-    obj->velocity = *velocity;
+GravitationalObject createParticleAt(Vector3* pos, enum element element, Vector3* velocity) {
+    GravitationalObject obj;
+    obj.name = "Custom";
+    obj.element = element;
+    obj.position = *pos;
+    obj.velocity = *velocity;
     return obj;
 }
 
 // Add multiple random objects to the object list within a given room size
 void randomObjectsFor(int count, ObjectList* objList, Vector3 room) {
+    // Grow once up front instead of doubling along the way
+    reserveSlots(objList, objList->size + count);
+    if (count > objList->freeIdCount) reserveIds(objList, objList->nextId + (unsigned int)(count - objList->freeIdCount));
     for(int i = 0; i < count; i++) {
-        Vector3 pos = {GetRandomValue(room.x*-1, room.x), GetRandomValue(room.x*-1, room.x), GetRandomValue(room.x*-1, room.x)};
-        GravitationalObject* obj = createRandomParticleAt(&pos);
-        addObjectList(obj, objList);
-    }
-}
-
-// Remove an object at a specific index from the object list
-void removeObjectAtIndex(ObjectList* list, int index) {
-    if (index < 0 || index >= list->size) return;
-    if (list->gObjs[index] != NULL) {
-        free(list->gObjs[index]);
-    }
-    for (int i = index; i < list->size - 1; i++) {
-        list->gObjs[i] = list->gObjs[i + 1];
-    }
-    list->size--;
-    if (list->size > 0) {
-        GravitationalObject** newArray = realloc(list->gObjs, list->size * sizeof(GravitationalObject*));
-        if (newArray != NULL) {
-            list->gObjs = newArray;
-        }
-    } else {
-        free(list->gObjs);
-        list->gObjs = NULL;
+        Vector3 pos = {rand_int(room.x*-1, room.x), rand_int(room.x*-1, room.x), rand_int(room.x*-1, room.x)};
+        GravitationalObject obj = createRandomParticleAt(&pos);
+        addObjectList(&obj, objList);
     }
 }
-
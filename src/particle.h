@@ -16,28 +16,73 @@ enum element{
     iron = 3298418600
 };
 
+// Elements in a fixed order, used to index lookup tables (e.g. colours)
+#define ELEMENT_COUNT 6
+int elementIndex(enum element element);
+enum element elementAt(int index);
+
+// Alignment of every per-particle array in the ObjectList (one cache line)
+#define PARTICLE_ALIGNMENT 64
+
+// Description of a single particle, used to spawn into and read from an ObjectList.
+// The list itself does not store these structs.
 typedef struct GravitationalObject {
     const char* name;
     enum element element;
     Vector3 position;
-    Vector3 force;
     Vector3 velocity;
 } GravitationalObject;
 
+// Structure-of-arrays particle store. Slots [0, size) are densely packed;
+// removing a particle moves the last one into its slot. Every particle also
+// has a stable id that survives those moves (see indexOfObjectId). Ids of
+// removed particles go onto a free list and are handed out again by later
+// adds, so the id tables stay as large as the peak particle count.
 typedef struct ObjectList {
-    GravitationalObject** gObjs;
+    float* posX;
+    float* posY;
+    float* posZ;
+    float* velX;
+    float* velY;
+    float* velZ;
+    float* mass;
+    enum element* element;
+    unsigned int* ids;      // stable id of the particle in each slot
+    int* slotOfId;          // id -> slot, -1 once the particle was removed
     int size;
+    int capacity;
+    unsigned int nextId;    // every id in use is below this
+    unsigned int idCapacity;
+    unsigned int* freeIds;  // ids of removed particles, reused last-in first-out
+    int freeIdCount;
+    int freeIdCapacity;
+    unsigned int generation; // unique per list and per touchObjectList
 } ObjectList;
 
 ObjectList* createObjectList();
-void addObjectList(GravitationalObject* obj, ObjectList* objList);
+unsigned int addObjectList(const GravitationalObject* obj, ObjectList* objList);
+int reserveObjectList(ObjectList* objList, int capacity); // room for `capacity` slots, 0 on failure
+void removeObjectAtIndex(ObjectList* list, int index);
+int indexOfObjectId(const ObjectList* list, unsigned int id);
+GravitationalObject getObjectAt(const ObjectList* list, int index);
 void freeObjectList(ObjectList* objList);
+// Mark particles as changed outside a solver step (e.g. moved by a
+// collision): caches keyed on the list's generation start over
+void touchObjectList(ObjectList* objList);
 
 void randomObjectsFor(int count, ObjectList* objList, Vector3 room);
-GravitationalObject* createRandomParticleAt(Vector3* pos);
+GravitationalObject createRandomParticleAt(Vector3* pos);
+GravitationalObject createParticleAt(Vector3* pos, enum element element, Vector3* velocity);
+
+// Position of the particle in slot i
+static inline Vector3 objectPosition(const ObjectList* list, int i) {
+    return (Vector3){ list->posX[i], list->posY[i], list->posZ[i] };
+}
 
 
 //Util
 float rand_range(float min, float max);
+void* alignedAlloc(size_t bytes);
+void alignedFree(void* ptr);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,222 @@
+// Correctness checks of the CPU kernels against their references, run by
+// CTest: every SIMD level this CPU supports against the scalar gravityBlock
+// and cullSpheres, and the collision broadphase against an O(N^2) search.
+// Inputs come from fixed seeds; the exit code is the number of failed checks.
+#include "Collision.h"
+#include "SimdKernels.h"
+#include "JobSystem.h"
+#include <string.h>
+
+#define CHECK_SEED 1ULL
+#define CHECK_GRAVITY_TOLERANCE 1e-5  // relative to the sum of the term magnitudes
+#define CHECK_CULL_TOLERANCE 1e-5     // relative to the plane distance's magnitude
+#define CHECK_PAIR_TOLERANCE 1e-5     // relative to the squared contact distance
+#define CHECK_BLOCK 300               // particles per kernel check
+#define CHECK_COLLISION_COUNT 4000
+
+static unsigned long long gRandomState = CHECK_SEED;
+
+// xorshift64*, as in bench.c
+static double checkRandom(void) {
+    gRandomState ^= gRandomState >> 12;
+    gRandomState ^= gRandomState << 25;
+    gRandomState ^= gRandomState >> 27;
+    return (double)((gRandomState * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static float randomIn(float lo, float hi) {
+    return lo + (hi - lo) * (float)checkRandom();
+}
+
+// Counts that end on every lane position of the 8 and 16 wide kernels
+static const int BLOCK_COUNTS[] = { 0, 1, 7, 8, 15, 16, 17, 33, 100, CHECK_BLOCK };
+#define BLOCK_COUNT_CASES ((int)(sizeof(BLOCK_COUNTS) / sizeof(BLOCK_COUNTS[0])))
+
+typedef struct CheckBlock {
+    float x[CHECK_BLOCK], y[CHECK_BLOCK], z[CHECK_BLOCK], m[CHECK_BLOCK];
+    unsigned int indices[CHECK_BLOCK];
+} CheckBlock;
+
+static void fillBlock(CheckBlock* b, float extent) {
+    for (int i = 0; i < CHECK_BLOCK; i++) {
+        b->x[i] = randomIn(-extent, extent);
+        b->y[i] = randomIn(-extent, extent);
+        b->z[i] = randomIn(-extent, extent);
+        b->m[i] = randomIn(1.0f, 60000.0f);
+        b->indices[i] = (unsigned int)i;
+    }
+    // Shuffled, so the indexed cull gathers out of order
+    for (int i = CHECK_BLOCK - 1; i > 0; i--) {
+        int j = (int)(checkRandom() * (i + 1));
+        unsigned int t = b->indices[i];
+        b->indices[i] = b->indices[j];
+        b->indices[j] = t;
+    }
+}
+
+// gravityBlock of the active level against gravityBlockScalar, on points
+// spread over the block and on a point sitting on one of the masses
+static int checkGravity(const CheckBlock* b) {
+    int failed = 0;
+    for (int c = 0; c < BLOCK_COUNT_CASES; c++) {
+        int count = BLOCK_COUNTS[c];
+        for (int t = 0; t < 16; t++) {
+            float px = randomIn(-120.0f, 120.0f), py = randomIn(-120.0f, 120.0f), pz = randomIn(-120.0f, 120.0f);
+            if (t == 0 && count > 0) {
+                px = b->x[count / 2]; py = b->y[count / 2]; pz = b->z[count / 2];
+            }
+            float acc[3] = { 0.0f, 0.0f, 0.0f }, ref[3] = { 0.0f, 0.0f, 0.0f };
+            gravityBlock(b->x, b->y, b->z, b->m, count, px, py, pz, acc);
+            gravityBlockScalar(b->x, b->y, b->z, b->m, count, px, py, pz, ref);
+            double scale = 0.0;
+            for (int i = 0; i < count; i++) {
+                double dx = b->x[i] - px, dy = b->y[i] - py, dz = b->z[i] - pz;
+                double r2 = dx*dx + dy*dy + dz*dz;
+                scale += b->m[i] / (r2 > 1.0 ? r2 : 1.0);
+            }
+            for (int k = 0; k < 3; k++) {
+                if (fabs((double)acc[k] - (double)ref[k]) <= CHECK_GRAVITY_TOLERANCE * scale) continue;
+                printf("  gravityBlock: count %d, point %d, axis %d: %.9g, scalar %.9g\n", count, t, k, acc[k], ref[k]);
+                failed++;
+                break;
+            }
+        }
+    }
+    return failed;
+}
+
+// Distance of (x, y, z) to the nearest culling boundary: a plane moved out by radius
+static double boundaryDistance(const float (*planes)[4], float radius, float x, float y, float z, double* scale) {
+    double nearest = INFINITY;
+    *scale = 0.0;
+    for (int k = 0; k < 6; k++) {
+        double d = planes[k][0] * x + planes[k][1] * y + planes[k][2] * z + planes[k][3] + radius;
+        double s = fabs(planes[k][0] * x) + fabs(planes[k][1] * y) + fabs(planes[k][2] * z) + fabs(planes[k][3]) + radius;
+        if (fabs(d) < nearest) nearest = fabs(d);
+        if (s > *scale) *scale = s;
+    }
+    return nearest;
+}
+
+// cullSpheres of the active level against cullSpheresScalar, with and
+// without an index list. Both keep the input order; a particle may only
+// differ where rounding decides, right on a boundary.
+static int checkCull(const CheckBlock* b) {
+    int failed = 0;
+    int visible[CHECK_BLOCK], ref[CHECK_BLOCK];
+    for (int f = 0; f < 8; f++) {
+        // A box around a random centre, tilted by random normals
+        float planes[6][4];
+        float cx = randomIn(-50.0f, 50.0f), cy = randomIn(-50.0f, 50.0f), cz = randomIn(-50.0f, 50.0f);
+        for (int k = 0; k < 6; k++) {
+            float n[3] = { randomIn(-1.0f, 1.0f), randomIn(-1.0f, 1.0f), randomIn(-1.0f, 1.0f) };
+            n[k / 2] += k % 2 ? -2.0f : 2.0f;
+            float len = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            for (int a = 0; a < 3; a++) planes[k][a] = n[a] / len;
+            planes[k][3] = randomIn(20.0f, 80.0f) - (planes[k][0] * cx + planes[k][1] * cy + planes[k][2] * cz);
+        }
+        float radius = f % 2 ? 1.0f : 0.0f;
+        for (int c = 0; c < BLOCK_COUNT_CASES; c++) {
+            int count = BLOCK_COUNTS[c];
+            for (int indexed = 0; indexed < 2; indexed++) {
+                const unsigned int* indices = indexed ? b->indices : NULL;
+                // Offset into the block, so the kernels start off a lane boundary
+                int first = count < CHECK_BLOCK ? (f * 3) % (CHECK_BLOCK - count + 1) : 0;
+                int n = cullSpheres((const float (*)[4])planes, radius, b->x, b->y, b->z, indices, first, count, visible);
+                int nRef = cullSpheresScalar((const float (*)[4])planes, radius, b->x, b->y, b->z, indices, first, count, ref);
+                int i = 0, j = 0, bad = 0;
+                while (i < n || j < nRef) {
+                    if (i < n && j < nRef && visible[i] == ref[j]) {
+                        i++; j++;
+                        continue;
+                    }
+                    // The particle one side has and the other lacks comes first in input order
+                    int slot = -1;
+                    for (int k = first; k < first + count && slot < 0; k++) {
+                        int s = indices ? (int)indices[k] : k;
+                        if ((i < n && s == visible[i]) || (j < nRef && s == ref[j])) slot = s;
+                    }
+                    if (slot < 0) {
+                        bad = 1;
+                        break;
+                    }
+                    double scale;
+                    double d = boundaryDistance((const float (*)[4])planes, radius, b->x[slot], b->y[slot], b->z[slot], &scale);
+                    if (d > CHECK_CULL_TOLERANCE * scale) {
+                        bad = 1;
+                        break;
+                    }
+                    if (i < n && visible[i] == slot) i++;
+                    else j++;
+                }
+                if (bad) {
+                    printf("  cullSpheres: frustum %d, count %d, %s: %d visible, scalar %d\n",
+                           f, count, indexed ? "indexed" : "slots", n, nRef);
+                    failed++;
+                }
+            }
+        }
+    }
+    return failed;
+}
+
+// resolveCollisions finds every overlapping pair exactly once: its count
+// must lie between the O(N^2) counts of the clear and the borderline pairs
+static int checkBroadphase(void) {
+    ObjectList* list = createObjectList();
+    if (!list || !reserveObjectList(list, CHECK_COLLISION_COUNT)) {
+        printf("  broadphase: out of memory\n");
+        freeObjectList(list);
+        return 1;
+    }
+    // Dense enough for a few thousand contacts, plus clumps sharing a cell
+    for (int i = 0; i < CHECK_COLLISION_COUNT; i++) {
+        GravitationalObject obj = { 0 };
+        obj.name = "Check";
+        obj.element = elementAt(i % ELEMENT_COUNT);
+        float extent = i % 10 == 0 ? 4.0f : 60.0f;
+        obj.position = (Vector3){ randomIn(-extent, extent), randomIn(-extent, extent), randomIn(-extent, extent) };
+        addObjectList(&obj, list);
+    }
+    float radius = 1.0f;
+    double touch2 = 4.0 * radius * radius;
+    int sure = 0, maybe = 0;
+    for (int a = 0; a < list->size; a++) {
+        for (int b = a + 1; b < list->size; b++) {
+            double dx = list->posX[b] - list->posX[a];
+            double dy = list->posY[b] - list->posY[a];
+            double dz = list->posZ[b] - list->posZ[a];
+            double d2 = dx*dx + dy*dy + dz*dz;
+            if (d2 < touch2 * (1.0 - CHECK_PAIR_TOLERANCE)) sure++;
+            if (d2 <= touch2 * (1.0 + CHECK_PAIR_TOLERANCE)) maybe++;
+        }
+    }
+    // Elastic: pairs are counted before any is resolved, and no slot goes away
+    int found = resolveCollisions(list, radius, COLLISION_ELASTIC);
+    freeObjectList(list);
+    if (found >= sure && found <= maybe && sure > 0) return 0;
+    printf("  broadphase: %d pairs, O(N^2) search %d to %d\n", found, sure, maybe);
+    return 1;
+}
+
+int main(void) {
+    int failed = 0;
+    CheckBlock* block = malloc(sizeof(CheckBlock));
+    if (!block) return 1;
+    fillBlock(block, 100.0f);
+    for (int level = SIMD_SCALAR; level <= (int)simdDetectedLevel(); level++) {
+        simdSetLevel((SimdLevel)level);
+        int levelFailed = checkGravity(block) + checkCull(block);
+        printf("%-8s gravityBlock, cullSpheres: %s\n", simdLevelName(simdLevel()), levelFailed ? "FAILED" : "ok");
+        failed += levelFailed;
+    }
+    simdSetLevel(simdDetectedLevel());
+    free(block);
+
+    int broadphaseFailed = checkBroadphase();
+    printf("broadphase: %s\n", broadphaseFailed ? "FAILED" : "ok");
+    failed += broadphaseFailed;
+    freeCollisions();
+    jobSystemShutdown();
+    return failed;
+}